@@ -1,12 +1,34 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
+#include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <list>
+#include <map>
 #include <memory>
+#include <set>
+#include <sstream>
+#include <type_traits>
 #include <vector>
 #include <random>
+#include <string>
+#include <tuple>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace gl {
 
@@ -31,6 +53,69 @@ inline const char *GLGetErrorString(GLenum error) {
   }
 }
 
+// Bytes per texel on the GPU.
+inline size_t TexelSize(GLenum internal_format) {
+  switch (internal_format) {
+    case GL_R8:
+    case GL_R8UI:
+      return 1;
+    case GL_R16F:
+      return 2;
+    case GL_R32F:
+    case GL_R32I:
+    case GL_RG16F:
+    case GL_RGBA8:
+    case GL_RGBA8UI:
+      return 4;
+    case GL_RG32F:
+    case GL_RGBA16F:
+      return 8;
+    case GL_RGBA32F:
+    case GL_RGBA32I:
+      return 16;
+    default:
+      std::cerr << "Unknown internal format " << internal_format << std::endl;
+      assert(false);
+      return 0;
+  }
+}
+
+// Bytes per pixel of host data laid out as (format, type).
+inline size_t PixelSize(GLenum format, GLenum type) {
+  size_t num_components;
+  switch (format) {
+    case GL_RED:
+    case GL_RED_INTEGER:
+      num_components = 1;
+      break;
+    case GL_RG:
+    case GL_RG_INTEGER:
+      num_components = 2;
+      break;
+    case GL_RGBA:
+    case GL_RGBA_INTEGER:
+      num_components = 4;
+      break;
+    default:
+      std::cerr << "Unknown pixel format " << format << std::endl;
+      assert(false);
+      return 0;
+  }
+  switch (type) {
+    case GL_UNSIGNED_BYTE:
+      return num_components;
+    case GL_HALF_FLOAT:
+      return num_components * 2;
+    case GL_INT:
+    case GL_FLOAT:
+      return num_components * 4;
+    default:
+      std::cerr << "Unknown pixel type " << type << std::endl;
+      assert(false);
+      return 0;
+  }
+}
+
 }  // namespace gl
 
 void OPENGL_ABSORB_ERRORS() {
@@ -62,6 +147,200 @@ void GlfwErrorCallback(int err, const char *str) {
   std::cerr << "Error: [" << err << "] " << str << std::endl;
 }
 
+/*!
+ * \brief Convert an IEEE single to an IEEE half, rounding to nearest even.
+ */
+inline GLhalf FloatToHalf(GLfloat value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+
+  uint32_t sign = (bits >> 16) & 0x8000u;
+  uint32_t exponent = (bits >> 23) & 0xffu;
+  uint32_t mantissa = bits & 0x7fffffu;
+
+  // Inf and NaN (keep NaN a NaN).
+  if (exponent == 0xffu) {
+    return static_cast<GLhalf>(sign | 0x7c00u | (mantissa != 0 ? 0x200u : 0));
+  }
+
+  int half_exponent = static_cast<int>(exponent) - 127 + 15;
+
+  // Too large: saturate to infinity.
+  if (half_exponent >= 0x1f) {
+    return static_cast<GLhalf>(sign | 0x7c00u);
+  }
+
+  // Too small for a normal half: produce a subnormal or zero.
+  if (half_exponent <= 0) {
+    if (half_exponent < -10) {
+      return static_cast<GLhalf>(sign);
+    }
+    mantissa |= 0x800000u;
+    auto shift = static_cast<uint32_t>(14 - half_exponent);
+    uint32_t half = mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1u))) {
+      ++half;
+    }
+    return static_cast<GLhalf>(sign | half);
+  }
+
+  // A carry out of the mantissa correctly bumps the exponent.
+  uint32_t half = sign | (static_cast<uint32_t>(half_exponent) << 10)
+                  | (mantissa >> 13);
+  uint32_t rest = mantissa & 0x1fffu;
+  if (rest > 0x1000u || (rest == 0x1000u && (half & 1u))) {
+    ++half;
+  }
+  return static_cast<GLhalf>(half);
+}
+
+/*!
+ * \brief Convert an IEEE half to an IEEE single. This is exact.
+ */
+inline GLfloat HalfToFloat(GLhalf value) {
+  uint32_t sign = static_cast<uint32_t>(value & 0x8000u) << 16;
+  uint32_t exponent = (value >> 10) & 0x1fu;
+  uint32_t mantissa = value & 0x3ffu;
+
+  uint32_t bits;
+  if (exponent == 0) {
+    if (mantissa == 0) {
+      bits = sign;
+    } else {
+      // Subnormal half: renormalize.
+      int e = 1;
+      while ((mantissa & 0x400u) == 0) {
+        mantissa <<= 1;
+        --e;
+      }
+      mantissa &= 0x3ffu;
+      bits = sign | (static_cast<uint32_t>(e + 112) << 23) | (mantissa << 13);
+    }
+  } else if (exponent == 0x1f) {
+    bits = sign | 0x7f800000u | (mantissa << 13);
+  } else {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  }
+
+  GLfloat result;
+  std::memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+/*!
+ * \brief Texture storage types.
+ * A storage type describes
+ *   - HostType: what the user hands us and gets back,
+ *   - TransferType: what actually goes over the bus,
+ *   - kInternalFormat: how the GPU stores it,
+ *   - kFormat/kType: how glTexImage2D/glGetTexImage interpret TransferType,
+ *   - kLanes: how many values are packed in one texel,
+ *   - kBufferInternalFormat: the format of a buffer texture, where the
+ *     buffer holds exactly kLanes TransferType values per texel.
+ * Everything is resolved at compile time. When HostType and TransferType
+ * differ, the conversion happens on the host, so the bus only carries the
+ * narrow type; such storage types also provide
+ *   - Encode(HostType) -> TransferType and Decode(TransferType) -> HostType.
+ */
+namespace dtype {
+
+// The historical layout: one float per RGBA32F texel.
+struct Float32 {
+  using HostType = GLfloat;
+  using TransferType = GLfloat;
+  static const GLint kInternalFormat = GL_RGBA32F;
+  static const GLenum kFormat = GL_RED;
+  static const GLenum kType = GL_FLOAT;
+  static const GLsizei kLanes = 1;
+  static const GLenum kBufferInternalFormat = GL_R32F;
+};
+
+// fp16 storage. Shaders still see fp32 when sampling.
+struct Float16 {
+  using HostType = GLfloat;
+  using TransferType = GLhalf;
+  static const GLint kInternalFormat = GL_R16F;
+  static const GLenum kFormat = GL_RED;
+  static const GLenum kType = GL_HALF_FLOAT;
+  static const GLsizei kLanes = 1;
+  static const GLenum kBufferInternalFormat = GL_R16F;
+
+  static TransferType Encode(HostType value) { return FloatToHalf(value); }
+  static HostType Decode(TransferType value) { return HalfToFloat(value); }
+};
+
+// fp16 storage, 4 consecutive values per texel.
+struct Float16x4 {
+  using HostType = GLfloat;
+  using TransferType = GLhalf;
+  static const GLint kInternalFormat = GL_RGBA16F;
+  static const GLenum kFormat = GL_RGBA;
+  static const GLenum kType = GL_HALF_FLOAT;
+  static const GLsizei kLanes = 4;
+  static const GLenum kBufferInternalFormat = GL_RGBA16F;
+
+  static TransferType Encode(HostType value) { return FloatToHalf(value); }
+  static HostType Decode(TransferType value) { return HalfToFloat(value); }
+};
+
+// Sampled with isampler2D.
+struct Int32 {
+  using HostType = GLint;
+  using TransferType = GLint;
+  static const GLint kInternalFormat = GL_R32I;
+  static const GLenum kFormat = GL_RED_INTEGER;
+  static const GLenum kType = GL_INT;
+  static const GLsizei kLanes = 1;
+  static const GLenum kBufferInternalFormat = GL_R32I;
+};
+
+// Normalized: shaders see value / 255.0.
+struct UInt8x4 {
+  using HostType = GLubyte;
+  using TransferType = GLubyte;
+  static const GLint kInternalFormat = GL_RGBA8;
+  static const GLenum kFormat = GL_RGBA;
+  static const GLenum kType = GL_UNSIGNED_BYTE;
+  static const GLsizei kLanes = 4;
+  static const GLenum kBufferInternalFormat = GL_RGBA8;
+};
+
+// Not normalized: sampled with usampler2D, shaders see 0..255.
+struct UInt8x4Integer {
+  using HostType = GLubyte;
+  using TransferType = GLubyte;
+  static const GLint kInternalFormat = GL_RGBA8UI;
+  static const GLenum kFormat = GL_RGBA_INTEGER;
+  static const GLenum kType = GL_UNSIGNED_BYTE;
+  static const GLsizei kLanes = 4;
+  static const GLenum kBufferInternalFormat = GL_RGBA8UI;
+};
+
+struct Float32x4 {
+  using HostType = GLfloat;
+  using TransferType = GLfloat;
+  static const GLint kInternalFormat = GL_RGBA32F;
+  static const GLenum kFormat = GL_RGBA;
+  static const GLenum kType = GL_FLOAT;
+  static const GLsizei kLanes = 4;
+  static const GLenum kBufferInternalFormat = GL_RGBA32F;
+};
+
+// A complex number per texel: (real, imaginary).
+struct Complex64 {
+  using HostType = GLfloat;
+  using TransferType = GLfloat;
+  static const GLint kInternalFormat = GL_RG32F;
+  static const GLenum kFormat = GL_RG;
+  static const GLenum kType = GL_FLOAT;
+  static const GLsizei kLanes = 2;
+  static const GLenum kBufferInternalFormat = GL_RG32F;
+};
+
+}  // namespace dtype
+
 // This is the main part.
 static const char *fragment_shader_text = "#version 330 core\n"
     "uniform sampler2D A;\n"
@@ -81,615 +360,8407 @@ static const char *fragment_shader_text = "#version 330 core\n"
     "  }\n"
     "}\n";
 
-/*!
- * \brief An OpenGL program, composed of a vertex shader and a fragment shader.
- * In TVM, every program has the same vertex shader.
- * So a program just corresponds to a fragment shader.
- * A program can only be created by the workspace.
- * This class is just a wrapper over an OpenGL program ID.
- */
-class Program {
- public:
-  // Move constructor.
-  Program(Program &&other) noexcept;
+// fp16-storage/fp32-accumulate matmul.
+// A is row-major and B is *transposed* (i.e. B^T is row-major), both stored
+// as dtype::Float16x4, so each texel holds 4 consecutive values along the
+// reduction dimension. N must be a multiple of 4.
+// The original fragment_shader_text also works unchanged on dtype::Float16
+// textures, since sampling always yields fp32.
+static const char *matmul_fp16_shader_text = "#version 330 core\n"
+    "uniform sampler2D A;\n"
+    "uniform sampler2D BT;\n"
+    "uniform int N;\n"
+    "out float color;\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  int idx = pixel.x;\n"
+    "  int row = idx / N;\n"
+    "  int col = idx % N;\n"
+    "  int N4 = N / 4;\n"
+    "  float sum = 0.0;\n"
+    "  for (int i = 0; i < N4; i++) {\n"
+    "    vec4 a = texelFetch(A, ivec2(row * N4 + i, 0), 0);\n"
+    "    vec4 b = texelFetch(BT, ivec2(col * N4 + i, 0), 0);\n"
+    "    sum += dot(a, b);\n"
+    "  }\n"
+    "  color = sum;\n"
+    "}\n";
 
-  // Cannot be copied.
-  Program(const Program &other) = delete;
+// 8-bit quantized matmul: C (M x N) = A (M x K) * B (K x N).
+// A is row-major and B is transposed, both stored as dtype::UInt8x4Integer,
+// so each texel holds 4 consecutive values along K. K must be a multiple of 4.
+// Real values are scale * (q - zero_point). AParams/BTParams hold
+// (scale, zero_point) per row, or only at texel 0 when per tensor.
+// The dot product is computed in integers and dequantized once at the end.
+static const char *matmul_int8_shader_text = "#version 330 core\n"
+    "uniform usampler2D A;\n"
+    "uniform usampler2D BT;\n"
+    "uniform sampler2D AParams;\n"
+    "uniform sampler2D BTParams;\n"
+    "uniform int A_per_channel;\n"
+    "uniform int BT_per_channel;\n"
+    "uniform int N;\n"
+    "uniform int K;\n"
+    "out float color;\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  int idx = pixel.x;\n"
+    "  int row = idx / N;\n"
+    "  int col = idx % N;\n"
+    "  int K4 = K / 4;\n"
+    "  vec2 a_params = texelFetch(AParams,\n"
+    "      ivec2(A_per_channel != 0 ? row : 0, 0), 0).rg;\n"
+    "  vec2 bt_params = texelFetch(BTParams,\n"
+    "      ivec2(BT_per_channel != 0 ? col : 0, 0), 0).rg;\n"
+    "  ivec4 a_zero = ivec4(int(a_params.y));\n"
+    "  ivec4 bt_zero = ivec4(int(bt_params.y));\n"
+    "  int sum = 0;\n"
+    "  for (int i = 0; i < K4; i++) {\n"
+    "    ivec4 a = ivec4(texelFetch(A, ivec2(row * K4 + i, 0), 0)) - a_zero;\n"
+    "    ivec4 b = ivec4(texelFetch(BT, ivec2(col * K4 + i, 0), 0)) - bt_zero;\n"
+    "    ivec4 p = a * b;\n"
+    "    sum += p.x + p.y + p.z + p.w;\n"
+    "  }\n"
+    "  color = float(sum) * a_params.x * bt_params.x;\n"
+    "}\n";
 
-  // Cannot be assigned.
-  Program &operator=(const Program &other) = delete;
+// The same matmul as fragment_shader_text, but reading A and B from buffer
+// textures and writing an N x N 2D texture, so N is no longer limited by
+// sqrt(GL_MAX_TEXTURE_SIZE).
+static const char *matmul_buffer_shader_text = "#version 330 core\n"
+    "uniform samplerBuffer A;\n"
+    "uniform samplerBuffer B;\n"
+    "uniform int N;\n"
+    "out float color;\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  int row = pixel.y;\n"
+    "  int col = pixel.x;\n"
+    "  color = 0.0;\n"
+    "  for (int i = 0; i < N; i++) {\n"
+    "    float a = texelFetch(A, row * N + i).r;\n"
+    "    float b = texelFetch(B, i * N + col).r;\n"
+    "    color += a * b;\n"
+    "  }\n"
+    "}\n";
 
-  // Destructor.
-  ~Program();
+// Matmul over strided views (see TextureView): C (M x N) = A (M x K) * B (K x N).
+// The output is an M x N 2D texture. For each view X, the workspace sets
+// X_offset, X_row_stride, X_col_stride, X_rows and X_cols.
+static const char *matmul_view_shader_text = "#version 330 core\n"
+    "uniform sampler2D A;\n"
+    "uniform int A_offset;\n"
+    "uniform int A_row_stride;\n"
+    "uniform int A_col_stride;\n"
+    "uniform int A_cols;\n"
+    "uniform sampler2D B;\n"
+    "uniform int B_offset;\n"
+    "uniform int B_row_stride;\n"
+    "uniform int B_col_stride;\n"
+    "out float color;\n"
+    "float load(sampler2D t, int idx) {\n"
+    "  int width = textureSize(t, 0).x;\n"
+    "  return texelFetch(t, ivec2(idx % width, idx / width), 0).r;\n"
+    "}\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  int row = pixel.y;\n"
+    "  int col = pixel.x;\n"
+    "  int a_idx = A_offset + row * A_row_stride;\n"
+    "  int b_idx = B_offset + col * B_col_stride;\n"
+    "  color = 0.0;\n"
+    "  for (int i = 0; i < A_cols; i++) {\n"
+    "    color += load(A, a_idx) * load(B, b_idx);\n"
+    "    a_idx += A_col_stride;\n"
+    "    b_idx += B_row_stride;\n"
+    "  }\n"
+    "}\n";
 
- private:
-  friend class Workspace;
+// One block step of a tiled matmul: C = C_in + A * B, over plain 2D textures
+// (texel (col, row)). A is M x K, B is K x N and C is M x N, where K may be
+// smaller than the width of A. Ignores C_in unless "accumulate" is set.
+static const char *matmul_accumulate_shader_text = "#version 330 core\n"
+    "uniform sampler2D A;\n"
+    "uniform sampler2D B;\n"
+    "uniform sampler2D C_in;\n"
+    "uniform int K;\n"
+    "uniform int accumulate;\n"
+    "out float color;\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  color = accumulate != 0 ? texelFetch(C_in, pixel, 0).r : 0.0;\n"
+    "  for (int i = 0; i < K; i++) {\n"
+    "    float a = texelFetch(A, ivec2(i, pixel.y), 0).r;\n"
+    "    float b = texelFetch(B, ivec2(pixel.x, i), 0).r;\n"
+    "    color += a * b;\n"
+    "  }\n"
+    "}\n";
 
-  // Only a workspace can construct a program.
-  explicit Program(GLuint program);
+// Direct conv2d over NHWC4 tensors (see Nhwc4Tensor) and Conv2dFilter
+// weights: each fragment computes 4 output channels of one output pixel, as
+// a sum of mat4 * vec4 over the kernel window and the input channel blocks.
+static const char *conv2d_direct_shader_text = "#version 330 core\n"
+    "uniform sampler2D X;\n"
+    "uniform sampler2D W;\n"
+    "uniform sampler2D bias;\n"
+    "uniform int in_height;\n"
+    "uniform int in_width;\n"
+    "uniform int in_c4;\n"
+    "uniform int out_height;\n"
+    "uniform int out_c4;\n"
+    "uniform int kernel_h;\n"
+    "uniform int kernel_w;\n"
+    "uniform int stride;\n"
+    "uniform int padding;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  int ox = pixel.x / out_c4;\n"
+    "  int oc4 = pixel.x % out_c4;\n"
+    "  int n = pixel.y / out_height;\n"
+    "  int oy = pixel.y % out_height;\n"
+    "  color = texelFetch(bias, ivec2(oc4, 0), 0);\n"
+    "  for (int ky = 0; ky < kernel_h; ++ky) {\n"
+    "    int iy = oy * stride - padding + ky;\n"
+    "    if (iy < 0 || iy >= in_height) continue;\n"
+    "    for (int kx = 0; kx < kernel_w; ++kx) {\n"
+    "      int ix = ox * stride - padding + kx;\n"
+    "      if (ix < 0 || ix >= in_width) continue;\n"
+    "      int w = (ky * kernel_w + kx) * in_c4 * 4;\n"
+    "      for (int ic4 = 0; ic4 < in_c4; ++ic4, w += 4) {\n"
+    "        vec4 x = texelFetch(X, ivec2(ix * in_c4 + ic4,\n"
+    "                                     n * in_height + iy), 0);\n"
+    "        mat4 m = mat4(texelFetch(W, ivec2(w, oc4), 0),\n"
+    "                      texelFetch(W, ivec2(w + 1, oc4), 0),\n"
+    "                      texelFetch(W, ivec2(w + 2, oc4), 0),\n"
+    "                      texelFetch(W, ivec2(w + 3, oc4), 0));\n"
+    "        color += m * x;\n"
+    "      }\n"
+    "    }\n"
+    "  }\n"
+    "}\n";
 
-  // The internal OpenGL program ID.
-  GLuint program_;
+// im2col over an NHWC4 tensor: texel (ox * kk4 + k4, n * out_height + oy)
+// holds input channel block ic4 of pixel (oy * stride - padding + ky,
+// ox * stride - padding + kx), with k4 = (ky * kernel_w + kx) * in_c4 + ic4,
+// or zeros in the padding.
+static const char *im2col_shader_text = "#version 330 core\n"
+    "uniform sampler2D X;\n"
+    "uniform int in_height;\n"
+    "uniform int in_width;\n"
+    "uniform int in_c4;\n"
+    "uniform int out_height;\n"
+    "uniform int kernel_w;\n"
+    "uniform int kk4;\n"
+    "uniform int stride;\n"
+    "uniform int padding;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  int ox = pixel.x / kk4;\n"
+    "  int k4 = pixel.x % kk4;\n"
+    "  int n = pixel.y / out_height;\n"
+    "  int oy = pixel.y % out_height;\n"
+    "  int ic4 = k4 % in_c4;\n"
+    "  int kx = (k4 / in_c4) % kernel_w;\n"
+    "  int ky = k4 / in_c4 / kernel_w;\n"
+    "  int iy = oy * stride - padding + ky;\n"
+    "  int ix = ox * stride - padding + kx;\n"
+    "  color = vec4(0.0);\n"
+    "  if (iy >= 0 && iy < in_height && ix >= 0 && ix < in_width) {\n"
+    "    color = texelFetch(X, ivec2(ix * in_c4 + ic4, n * in_height + iy),\n"
+    "                       0);\n"
+    "  }\n"
+    "}\n";
 
-  static const GLuint kInvalidProgram = static_cast<GLuint>(-1);
-};
+// The matmul after im2col: each fragment reads one contiguous run of kk4
+// texels of the im2col matrix, and writes its output in NHWC4.
+static const char *im2col_matmul_shader_text = "#version 330 core\n"
+    "uniform sampler2D cols;\n"
+    "uniform sampler2D W;\n"
+    "uniform sampler2D bias;\n"
+    "uniform int out_c4;\n"
+    "uniform int kk4;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  int ox = pixel.x / out_c4;\n"
+    "  int oc4 = pixel.x % out_c4;\n"
+    "  color = texelFetch(bias, ivec2(oc4, 0), 0);\n"
+    "  for (int k4 = 0; k4 < kk4; ++k4) {\n"
+    "    vec4 x = texelFetch(cols, ivec2(ox * kk4 + k4, pixel.y), 0);\n"
+    "    mat4 m = mat4(texelFetch(W, ivec2(k4 * 4, oc4), 0),\n"
+    "                  texelFetch(W, ivec2(k4 * 4 + 1, oc4), 0),\n"
+    "                  texelFetch(W, ivec2(k4 * 4 + 2, oc4), 0),\n"
+    "                  texelFetch(W, ivec2(k4 * 4 + 3, oc4), 0));\n"
+    "    color += m * x;\n"
+    "  }\n"
+    "}\n";
 
-/*!
- * An OpenGL texture represents a chunk of GPU memory.
- * This is the way we represent tensors.
- * We always use 2D textures.
- */
-class Texture {
- public:
-  ~Texture();
+// Winograd F(2x2, 3x3), step 1: V = B^T d B for each 4x4 input tile d, with
+// tiles 2 pixels apart. Texel (tx * in_c4 + ic4, pos * rows_per_pos +
+// n * tiles_h + ty) holds position pos = 4 * a + b of V for tile (ty, tx).
+static const char *winograd_input_shader_text = "#version 330 core\n"
+    "uniform sampler2D X;\n"
+    "uniform int in_height;\n"
+    "uniform int in_width;\n"
+    "uniform int in_c4;\n"
+    "uniform int tiles_h;\n"
+    "uniform int rows_per_pos;\n"
+    "uniform int padding;\n"
+    "out vec4 color;\n"
+    "const float BT[16] = float[16](1.0, 0.0, -1.0, 0.0,\n"
+    "                               0.0, 1.0, 1.0, 0.0,\n"
+    "                               0.0, -1.0, 1.0, 0.0,\n"
+    "                               0.0, 1.0, 0.0, -1.0);\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  int tx = pixel.x / in_c4;\n"
+    "  int ic4 = pixel.x % in_c4;\n"
+    "  int pos = pixel.y / rows_per_pos;\n"
+    "  int n = (pixel.y % rows_per_pos) / tiles_h;\n"
+    "  int ty = (pixel.y % rows_per_pos) % tiles_h;\n"
+    "  int a = pos / 4;\n"
+    "  int b = pos % 4;\n"
+    "  color = vec4(0.0);\n"
+    "  for (int i = 0; i < 4; ++i) {\n"
+    "    int iy = 2 * ty - padding + i;\n"
+    "    if (BT[a * 4 + i] == 0.0 || iy < 0 || iy >= in_height) continue;\n"
+    "    for (int j = 0; j < 4; ++j) {\n"
+    "      int ix = 2 * tx - padding + j;\n"
+    "      if (BT[b * 4 + j] == 0.0 || ix < 0 || ix >= in_width) continue;\n"
+    "      color += BT[a * 4 + i] * BT[b * 4 + j]\n"
+    "               * texelFetch(X, ivec2(ix * in_c4 + ic4,\n"
+    "                                     n * in_height + iy), 0);\n"
+    "    }\n"
+    "  }\n"
+    "}\n";
 
-  Texture(Texture &&other) noexcept;
+// Winograd step 2: for each of the 16 positions, an independent GEMM of the
+// transformed tiles by the transformed filters (see Conv2dFilter), mat4 by
+// vec4 as in conv2d_direct_shader_text.
+static const char *winograd_gemm_shader_text = "#version 330 core\n"
+    "uniform sampler2D V;\n"
+    "uniform sampler2D U;\n"
+    "uniform int in_c4;\n"
+    "uniform int out_c4;\n"
+    "uniform int rows_per_pos;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  int tx = pixel.x / out_c4;\n"
+    "  int oc4 = pixel.x % out_c4;\n"
+    "  int w = pixel.y / rows_per_pos * in_c4 * 4;\n"
+    "  color = vec4(0.0);\n"
+    "  for (int ic4 = 0; ic4 < in_c4; ++ic4, w += 4) {\n"
+    "    vec4 v = texelFetch(V, ivec2(tx * in_c4 + ic4, pixel.y), 0);\n"
+    "    mat4 m = mat4(texelFetch(U, ivec2(w, oc4), 0),\n"
+    "                  texelFetch(U, ivec2(w + 1, oc4), 0),\n"
+    "                  texelFetch(U, ivec2(w + 2, oc4), 0),\n"
+    "                  texelFetch(U, ivec2(w + 3, oc4), 0));\n"
+    "    color += m * v;\n"
+    "  }\n"
+    "}\n";
 
-  Texture(const Texture &other) = delete;
+// Winograd step 3: each output pixel is its entry of A^T M A, plus the bias.
+static const char *winograd_output_shader_text = "#version 330 core\n"
+    "uniform sampler2D M;\n"
+    "uniform sampler2D bias;\n"
+    "uniform int out_height;\n"
+    "uniform int out_c4;\n"
+    "uniform int tiles_h;\n"
+    "uniform int rows_per_pos;\n"
+    "out vec4 color;\n"
+    "const float AT[8] = float[8](1.0, 1.0, 1.0, 0.0,\n"
+    "                             0.0, 1.0, -1.0, -1.0);\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  int ox = pixel.x / out_c4;\n"
+    "  int oc4 = pixel.x % out_c4;\n"
+    "  int n = pixel.y / out_height;\n"
+    "  int oy = pixel.y % out_height;\n"
+    "  int x = (ox / 2) * out_c4 + oc4;\n"
+    "  int y = n * tiles_h + oy / 2;\n"
+    "  color = texelFetch(bias, ivec2(oc4, 0), 0);\n"
+    "  for (int a = 0; a < 4; ++a) {\n"
+    "    float ca = AT[(oy % 2) * 4 + a];\n"
+    "    if (ca == 0.0) continue;\n"
+    "    for (int b = 0; b < 4; ++b) {\n"
+    "      float cb = AT[(ox % 2) * 4 + b];\n"
+    "      if (cb == 0.0) continue;\n"
+    "      color += ca * cb\n"
+    "               * texelFetch(M, ivec2(x, (a * 4 + b) * rows_per_pos + y),\n"
+    "                            0);\n"
+    "    }\n"
+    "  }\n"
+    "}\n";
 
-  Texture &operator=(const Texture &other) = delete;
+// Row statistics for softmax, in chunks of columns: texel (p, row) gets the
+// running (max, sum of exp(x - max)) over columns [p * chunk, p * chunk +
+// chunk) of the row. With "partials" set, X holds such pairs from a previous
+// pass instead of values, and they are combined.
+static const char *softmax_stats_shader_text = "#version 330 core\n"
+    "uniform sampler2D X;\n"
+    "uniform int cols;\n"
+    "uniform int chunk;\n"
+    "uniform int partials;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  int end = min(pixel.x * chunk + chunk, cols);\n"
+    "  float m = -3.0e38;\n"
+    "  float s = 0.0;\n"
+    "  for (int i = pixel.x * chunk; i < end; ++i) {\n"
+    "    vec4 v = texelFetch(X, ivec2(i, pixel.y), 0);\n"
+    "    vec2 p = partials != 0 ? v.xy : vec2(v.r, 1.0);\n"
+    "    float n = max(m, p.x);\n"
+    "    s = s * exp(m - n) + p.y * exp(p.x - n);\n"
+    "    m = n;\n"
+    "  }\n"
+    "  color = vec4(m, s, 0.0, 0.0);\n"
+    "}\n";
 
-  GLsizei width() const { return width_; }
+// Same as above for layernorm, with (count, mean, sum of squared
+// deviations), combined as in Chan et al.
+static const char *layernorm_stats_shader_text = "#version 330 core\n"
+    "uniform sampler2D X;\n"
+    "uniform int cols;\n"
+    "uniform int chunk;\n"
+    "uniform int partials;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  int end = min(pixel.x * chunk + chunk, cols);\n"
+    "  vec3 acc = vec3(0.0);\n"
+    "  for (int i = pixel.x * chunk; i < end; ++i) {\n"
+    "    vec4 v = texelFetch(X, ivec2(i, pixel.y), 0);\n"
+    "    vec3 p = partials != 0 ? v.xyz : vec3(1.0, v.r, 0.0);\n"
+    "    float n = acc.x + p.x;\n"
+    "    float d = p.y - acc.y;\n"
+    "    acc.y += d * p.x / n;\n"
+    "    acc.z += p.z + d * d * acc.x * p.x / n;\n"
+    "    acc.x = n;\n"
+    "  }\n"
+    "  color = vec4(acc, 0.0);\n"
+    "}\n";
 
-  GLsizei height() const { return height_; }
+static const char *softmax_shader_text = "#version 330 core\n"
+    "uniform sampler2D X;\n"
+    "uniform sampler2D stats;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  vec4 s = texelFetch(stats, ivec2(0, pixel.y), 0);\n"
+    "  float x = texelFetch(X, pixel, 0).r;\n"
+    "  color = vec4(exp(x - s.x) / s.y, 0.0, 0.0, 0.0);\n"
+    "}\n";
 
-  void GetData(GLfloat *data) const;
+// Needs "const float epsilon" inserted after the #version line.
+static const char *layernorm_shader_text = "#version 330 core\n"
+    "uniform sampler2D X;\n"
+    "uniform sampler2D stats;\n"
+    "uniform sampler2D gamma;\n"
+    "uniform sampler2D beta;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  vec4 s = texelFetch(stats, ivec2(0, pixel.y), 0);\n"
+    "  float x = texelFetch(X, pixel, 0).r;\n"
+    "  float y = (x - s.y) * inversesqrt(s.z / s.x + epsilon);\n"
+    "  y = y * texelFetch(gamma, ivec2(pixel.x, 0), 0).r\n"
+    "      + texelFetch(beta, ivec2(pixel.x, 0), 0).r;\n"
+    "  color = vec4(y, 0.0, 0.0, 0.0);\n"
+    "}\n";
 
- private:
-  friend class Workspace;
+// GEMV, step 1: texel (row, p) gets the dot product of chunk texels of row
+// "row" of A with x, starting at texel p * chunk. Both hold 4 columns per
+// texel.
+static const char *gemv_partial_shader_text = "#version 330 core\n"
+    "uniform sampler2D A;\n"
+    "uniform sampler2D x;\n"
+    "uniform int cols4;\n"
+    "uniform int chunk;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  int end = min(pixel.y * chunk + chunk, cols4);\n"
+    "  vec4 sum = vec4(0.0);\n"
+    "  for (int i = pixel.y * chunk; i < end; ++i) {\n"
+    "    sum += texelFetch(A, ivec2(i, pixel.x), 0)\n"
+    "           * texelFetch(x, ivec2(i, 0), 0);\n"
+    "  }\n"
+    "  color = vec4(dot(sum, vec4(1.0)), 0.0, 0.0, 0.0);\n"
+    "}\n";
 
-  explicit Texture(const GLfloat *data, GLsizei width, GLsizei height);
+// GEMV, step 2: sum the partial dot products of each row.
+static const char *gemv_reduce_shader_text = "#version 330 core\n"
+    "uniform sampler2D partials;\n"
+    "uniform int num_partials;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "  int row = int(gl_FragCoord.x);\n"
+    "  float sum = 0.0;\n"
+    "  for (int p = 0; p < num_partials; ++p) {\n"
+    "    sum += texelFetch(partials, ivec2(row, p), 0).r;\n"
+    "  }\n"
+    "  color = vec4(sum, 0.0, 0.0, 0.0);\n"
+    "}\n";
 
-  GLuint texture() const { return texture_; }
+// Stream compaction through transform feedback: the vertex shader fetches
+// element gl_VertexID, and the geometry shader emits it only if it passes
+// "bool Keep(float x)", inserted after the #version line.
+static const char *filter_vertex_shader_text = "#version 330 core\n"
+    "uniform samplerBuffer X;\n"
+    "out float vertex_value;\n"
+    "flat out int vertex_index;\n"
+    "void main() {\n"
+    "  vertex_value = texelFetch(X, gl_VertexID).r;\n"
+    "  vertex_index = gl_VertexID;\n"
+    "}\n";
 
-  static const GLuint kInvalidTexture = static_cast<GLuint>(-1);
+static const char *filter_geometry_shader_text = "#version 330 core\n"
+    "layout(points) in;\n"
+    "layout(points, max_vertices = 1) out;\n"
+    "in float vertex_value[];\n"
+    "flat in int vertex_index[];\n"
+    "out float value;\n"
+    "flat out int index;\n"
+    "void main() {\n"
+    "  if (Keep(vertex_value[0])) {\n"
+    "    value = vertex_value[0];\n"
+    "    index = vertex_index[0];\n"
+    "    EmitVertex();\n"
+    "    EndPrimitive();\n"
+    "  }\n"
+    "}\n";
 
-  GLuint texture_;
-  GLsizei width_;
-  GLsizei height_;
-};
+// Scatter-add: point gl_VertexID = i * dim + d adds values[i][d] to
+// output[indices[i]][d]. Rows out of range are clipped away.
+static const char *scatter_add_vertex_shader_text = "#version 330 core\n"
+    "uniform isamplerBuffer indices;\n"
+    "uniform sampler2D values;\n"
+    "uniform int dim;\n"
+    "uniform int out_rows;\n"
+    "flat out float value;\n"
+    "void main() {\n"
+    "  int i = gl_VertexID / dim;\n"
+    "  int d = gl_VertexID % dim;\n"
+    "  int row = texelFetch(indices, i).r;\n"
+    "  value = texelFetch(values, ivec2(d, i), 0).r;\n"
+    "  vec2 texel = vec2(d, row) + 0.5;\n"
+    "  gl_Position = vec4(texel / vec2(dim, out_rows) * 2.0 - 1.0, 0.0, 1.0);\n"
+    "}\n";
 
-/*!
- * The OpenGL workspace.
- * This is a global singleton.
- */
-class Workspace {
- public:
-  // Get singleton instance.
-  static Workspace &GetInstance();
+// Histogram: point gl_VertexID adds 1 to bin values[gl_VertexID].
+static const char *histogram_vertex_shader_text = "#version 330 core\n"
+    "uniform isamplerBuffer values;\n"
+    "uniform int bins;\n"
+    "flat out float value;\n"
+    "void main() {\n"
+    "  int bin = texelFetch(values, gl_VertexID).r;\n"
+    "  value = 1.0;\n"
+    "  gl_Position = vec4((float(bin) + 0.5) / float(bins) * 2.0 - 1.0,\n"
+    "                     0.0, 0.0, 1.0);\n"
+    "}\n";
 
-  // Cannot be moved.
-  Workspace(Workspace &&other) = delete;
+static const char *point_fragment_shader_text = "#version 330 core\n"
+    "flat in float value;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "  color = vec4(value, 0.0, 0.0, 0.0);\n"
+    "}\n";
 
-  // Cannot be copied.
-  Workspace(const Workspace &other) = delete;
+// One compare-exchange step of a bitonic sorting network along rows, on
+// (key, value) pairs in .xy, ordered by key then value. Texel i pairs with
+// i ^ j; blocks of size k are sorted in alternating directions.
+static const char *bitonic_shader_text = "#version 330 core\n"
+    "uniform sampler2D X;\n"
+    "uniform int k;\n"
+    "uniform int j;\n"
+    "uniform int descending;\n"
+    "out vec4 color;\n"
+    "bool Less(vec4 a, vec4 b) {\n"
+    "  return a.x < b.x || (a.x == b.x && a.y < b.y);\n"
+    "}\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  int partner = pixel.x ^ j;\n"
+    "  vec4 a = texelFetch(X, pixel, 0);\n"
+    "  vec4 b = texelFetch(X, ivec2(partner, pixel.y), 0);\n"
+    "  bool up = ((pixel.x & k) == 0) != (descending != 0);\n"
+    "  bool take_min = (pixel.x < partner) == up;\n"
+    "  color = (Less(a, b) == take_min) ? a : b;\n"
+    "}\n";
 
-  // Cannot be assigned.
-  Workspace &operator=(const Workspace &other) = delete;
+// Top-k: texel t of block m keeps the greater of texel t of the ascending
+// block 2m and the descending block 2m + 1 (each of k texels), which leaves
+// a bitonic block holding the top k of both.
+static const char *bitonic_topk_shader_text = "#version 330 core\n"
+    "uniform sampler2D X;\n"
+    "uniform int k;\n"
+    "out vec4 color;\n"
+    "bool Less(vec4 a, vec4 b) {\n"
+    "  return a.x < b.x || (a.x == b.x && a.y < b.y);\n"
+    "}\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  int x = pixel.x / k * 2 * k + pixel.x % k;\n"
+    "  vec4 a = texelFetch(X, ivec2(x, pixel.y), 0);\n"
+    "  vec4 b = texelFetch(X, ivec2(x + k, pixel.y), 0);\n"
+    "  color = Less(a, b) ? b : a;\n"
+    "}\n";
 
-  ~Workspace();
+// Copy the first "cols" texels of each row, and fill the rest with pairs
+// that sort last.
+static const char *bitonic_pad_shader_text = "#version 330 core\n"
+    "uniform sampler2D X;\n"
+    "uniform int cols;\n"
+    "uniform int descending;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  if (pixel.x < cols) {\n"
+    "    color = texelFetch(X, pixel, 0);\n"
+    "  } else {\n"
+    "    color = vec4(descending != 0 ? -3.0e38 : 3.0e38, -1.0, 0.0, 0.0);\n"
+    "  }\n"
+    "}\n";
 
-  // Compile a fragment shader and create a program.
-  Program CreateProgram(const char *fragment_shader_src);
+// Scan, up-sweep: texel i of each row gets the sum of texels
+// [i * radix, i * radix + radix) of the row below in the pyramid.
+static const char *scan_reduce_shader_text = "#version 330 core\n"
+    "uniform sampler2D X;\n"
+    "uniform int cols;\n"
+    "uniform int radix;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  int end = min(pixel.x * radix + radix, cols);\n"
+    "  float sum = 0.0;\n"
+    "  for (int i = pixel.x * radix; i < end; ++i) {\n"
+    "    sum += texelFetch(X, ivec2(i, pixel.y), 0).r;\n"
+    "  }\n"
+    "  color = vec4(sum, 0.0, 0.0, 0.0);\n"
+    "}\n";
 
-  // Create a texture with the given data.
-  Texture CreateTexture(const GLfloat *data, GLsizei width, GLsizei height);
+// Scan, down-sweep: the exclusive prefix of texel i is the prefix of its
+// block one level up (P, when has_parent is set) plus its preceding
+// siblings. With "inclusive", X itself is added.
+static const char *scan_down_shader_text = "#version 330 core\n"
+    "uniform sampler2D X;\n"
+    "uniform sampler2D P;\n"
+    "uniform int radix;\n"
+    "uniform int has_parent;\n"
+    "uniform int inclusive;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  int block = pixel.x / radix;\n"
+    "  float sum = 0.0;\n"
+    "  if (has_parent != 0) {\n"
+    "    sum = texelFetch(P, ivec2(block, pixel.y), 0).r;\n"
+    "  }\n"
+    "  int end = inclusive != 0 ? pixel.x + 1 : pixel.x;\n"
+    "  for (int i = block * radix; i < end; ++i) {\n"
+    "    sum += texelFetch(X, ivec2(i, pixel.y), 0).r;\n"
+    "  }\n"
+    "  color = vec4(sum, 0.0, 0.0, 0.0);\n"
+    "}\n";
 
-  // Render to a texture.
-  void Render(const Program &program,
-              const std::vector<std::pair<std::string, Texture *>> &inputs,
-              const std::vector<std::pair<std::string, int>> &uniforms,
-              Texture *output,
-              int niters);
+// Row totals of a row-wise exclusive scan E of X, as a rows x 1 row.
+static const char *scan_totals_shader_text = "#version 330 core\n"
+    "uniform sampler2D X;\n"
+    "uniform sampler2D E;\n"
+    "uniform int cols;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "  ivec2 last = ivec2(cols - 1, int(gl_FragCoord.x));\n"
+    "  color = vec4(texelFetch(E, last, 0).r + texelFetch(X, last, 0).r,\n"
+    "               0.0, 0.0, 0.0);\n"
+    "}\n";
 
-  // Render to the main window.
-  // This is for debugging purposes.
-  void Render(const Program &program,
-              const std::vector<std::pair<std::string, Texture *>> &inputs);
+// Add the exclusive scan T of the row totals to each row of E.
+static const char *scan_offset_shader_text = "#version 330 core\n"
+    "uniform sampler2D X;\n"
+    "uniform sampler2D E;\n"
+    "uniform sampler2D T;\n"
+    "uniform int inclusive;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  float sum = texelFetch(E, pixel, 0).r\n"
+    "              + texelFetch(T, ivec2(pixel.y, 0), 0).r;\n"
+    "  if (inclusive != 0) {\n"
+    "    sum += texelFetch(X, pixel, 0).r;\n"
+    "  }\n"
+    "  color = vec4(sum, 0.0, 0.0, 0.0);\n"
+    "}\n";
 
-  static const int kWindowWidth = 640;
+// One Stockham FFT pass of radix "radix" along axis 0 (rows) or 1
+// (columns), after sub-transforms of size ns. Output o comes from the
+// butterfly over inputs j + s * n / radix, twiddled by powers of
+// exp(-2 pi i / n), read from "twiddles" (conjugated for the inverse).
+static const char *fft_shader_text = "#version 330 core\n"
+    "uniform sampler2D X;\n"
+    "uniform sampler2D twiddles;\n"
+    "uniform int n;\n"
+    "uniform int ns;\n"
+    "uniform int radix;\n"
+    "uniform int axis;\n"
+    "uniform int inverse;\n"
+    "uniform int last;\n"
+    "out vec4 color;\n"
+    "vec2 Twiddle(int k) {\n"
+    "  vec2 w = texelFetch(twiddles, ivec2(k % n, 0), 0).xy;\n"
+    "  return inverse != 0 ? vec2(w.x, -w.y) : w;\n"
+    "}\n"
+    "vec2 Mul(vec2 a, vec2 b) {\n"
+    "  return vec2(a.x * b.x - a.y * b.y, a.x * b.y + a.y * b.x);\n"
+    "}\n"
+    "void main() {\n"
+    "  ivec2 pixel = ivec2(gl_FragCoord.xy);\n"
+    "  int o = axis == 0 ? pixel.x : pixel.y;\n"
+    "  int j = o % ns + o / (ns * radix) * ns;\n"
+    "  int r = o / ns % radix;\n"
+    "  int stride = n / radix;\n"
+    "  int angle = j % ns * (stride / ns);\n"
+    "  vec2 sum = vec2(0.0);\n"
+    "  for (int s = 0; s < radix; ++s) {\n"
+    "    int i = j + s * stride;\n"
+    "    ivec2 at = axis == 0 ? ivec2(i, pixel.y) : ivec2(pixel.x, i);\n"
+    "    vec2 v = texelFetch(X, at, 0).xy;\n"
+    "    sum += Mul(v, Twiddle(s * angle + r * s % radix * stride));\n"
+    "  }\n"
+    "  if (last != 0 && inverse != 0) {\n"
+    "    sum /= float(n);\n"
+    "  }\n"
+    "  color = vec4(sum, 0.0, 0.0);\n"
+    "}\n";
+
+static const char *real_to_complex_shader_text = "#version 330 core\n"
+    "uniform sampler2D X;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "  color = vec4(texelFetch(X, ivec2(gl_FragCoord.xy), 0).r, 0.0, 0.0,\n"
+    "               0.0);\n"
+    "}\n";
+
+/*!
+ * \brief A compile-time kernel DSL: expressions are types, and the GLSL of
+ * a kernel is a constant character array built by the host compiler, with
+ * shapes baked in. Shape and element type mismatches fail to compile.
+ *
+ *   using A = dsl::Input<'A', 64, 32>;
+ *   using B = dsl::Input<'B', 32, 16>;
+ *   using C = dsl::Input<'C', 64, 16>;
+ *   using D = decltype(dsl::relu(dsl::matmul(A(), B()) + C()));
+ *   Program program = workspace.CreateProgram(dsl::Kernel<D>::source);
+ *
+ * Inputs are bound as samplers named after their character. The output is
+ * a Kernel<D>::rows x Kernel<D>::cols texture, one value per texel.
+ */
+namespace dsl {
+
+template <char... Cs>
+struct Chars {
+  static constexpr char value[sizeof...(Cs) + 1] = {Cs..., '\0'};
+};
+
+template <char... Cs>
+constexpr char Chars<Cs...>::value[sizeof...(Cs) + 1];
+
+template <typename... Lists>
+struct Concat;
+
+template <>
+struct Concat<> {
+  using type = Chars<>;
+};
+
+template <char... Cs>
+struct Concat<Chars<Cs...>> {
+  using type = Chars<Cs...>;
+};
+
+template <char... A, char... B, typename... Rest>
+struct Concat<Chars<A...>, Chars<B...>, Rest...>
+    : Concat<Chars<A..., B...>, Rest...> {};
+
+template <typename... Lists>
+using ConcatT = typename Concat<Lists...>::type;
+
+// The i-th character of a string literal, or '\0' past its end.
+template <size_t N>
+constexpr char At(const char (&s)[N], size_t i) {
+  return i < N ? s[i] : '\0';
+}
+
+// Drop the '\0's.
+template <typename In, typename Out = Chars<>>
+struct Trim;
+
+template <char... Out>
+struct Trim<Chars<>, Chars<Out...>> {
+  using type = Chars<Out...>;
+};
+
+template <char C, char... In, char... Out>
+struct Trim<Chars<C, In...>, Chars<Out...>>
+    : Trim<Chars<In...>,
+           typename std::conditional<C == '\0', Chars<Out...>,
+                                     Chars<Out..., C>>::type> {};
+
+template <bool Fits, typename In>
+struct Literal {
+  static_assert(Fits, "String literals in the DSL are at most 64 long.");
+  using type = typename Trim<In>::type;
+};
+
+template <bool Fits, typename In>
+using LiteralT = typename Literal<Fits, In>::type;
+
+#define DSL_AT4(s, i) \
+  ::dsl::At(s, i), ::dsl::At(s, i + 1), ::dsl::At(s, i + 2), \
+  ::dsl::At(s, i + 3)
+#define DSL_AT16(s, i) \
+  DSL_AT4(s, i), DSL_AT4(s, i + 4), DSL_AT4(s, i + 8), DSL_AT4(s, i + 12)
+
+// A string literal of at most 64 characters as Chars.
+#define DSL_STR(s) \
+  ::dsl::LiteralT<(sizeof(s) <= 65), \
+                  ::dsl::Chars<DSL_AT16(s, 0), DSL_AT16(s, 16), \
+                               DSL_AT16(s, 32), DSL_AT16(s, 48)>>
+
+// Decimal digits of N.
+template <unsigned N, char... Cs>
+struct Digits : Digits<N / 10, static_cast<char>('0' + N % 10), Cs...> {};
+
+template <char... Cs>
+struct Digits<0, Cs...> {
+  using type = Chars<Cs...>;
+};
+
+template <unsigned N>
+using Number = typename std::conditional<N == 0, Chars<'0'>,
+                                         typename Digits<N>::type>::type;
+
+// GLSL names of the element types.
+template <typename T>
+struct TypeName;
+
+template <>
+struct TypeName<float> {
+  using type = DSL_STR("float");
+  using sampler = DSL_STR("sampler2D");
+  using zero = DSL_STR("0.0");
+};
+
+template <>
+struct TypeName<int> {
+  using type = DSL_STR("int");
+  using sampler = DSL_STR("isampler2D");
+  using zero = DSL_STR("0");
+};
+
+struct Node {};
+
+template <typename T>
+using IsNode = std::is_base_of<Node, T>;
+
+// A rows x cols texture bound to the sampler "Name".
+template <char Name, int Rows, int Cols, typename T = float>
+struct Input : Node {
+  static const char name = Name;
+  static const int rows = Rows;
+  static const int cols = Cols;
+  using type = T;
+};
+
+template <typename A, typename B>
+struct MatMul : Node {
+  static_assert(A::cols == B::rows, "matmul: inner dimensions differ.");
+  static_assert(std::is_same<typename A::type, typename B::type>::value,
+                "matmul: element types differ.");
+  static const int rows = A::rows;
+  static const int cols = B::cols;
+  using type = typename A::type;
+};
+
+enum class Op { kAdd, kSub, kMul };
+
+template <Op O, typename A, typename B>
+struct Elementwise : Node {
+  static_assert(A::rows == B::rows && A::cols == B::cols,
+                "elementwise: shapes differ.");
+  static_assert(std::is_same<typename A::type, typename B::type>::value,
+                "elementwise: element types differ.");
+  static const int rows = A::rows;
+  static const int cols = A::cols;
+  using type = typename A::type;
+};
+
+template <typename A>
+struct Relu : Node {
+  static const int rows = A::rows;
+  static const int cols = A::cols;
+  using type = typename A::type;
+};
+
+template <typename T, typename A>
+struct Cast : Node {
+  static const int rows = A::rows;
+  static const int cols = A::cols;
+  using type = T;
+};
+
+template <typename A, typename B>
+constexpr MatMul<A, B> matmul(A, B) {
+  return MatMul<A, B>();
+}
+
+template <typename A>
+constexpr Relu<A> relu(A) {
+  return Relu<A>();
+}
+
+template <typename T, typename A>
+constexpr Cast<T, A> cast(A) {
+  return Cast<T, A>();
+}
+
+template <typename A, typename B,
+          typename = typename std::enable_if<IsNode<A>::value
+                                             && IsNode<B>::value>::type>
+constexpr Elementwise<Op::kAdd, A, B> operator+(A, B) {
+  return Elementwise<Op::kAdd, A, B>();
+}
+
+template <typename A, typename B,
+          typename = typename std::enable_if<IsNode<A>::value
+                                             && IsNode<B>::value>::type>
+constexpr Elementwise<Op::kSub, A, B> operator-(A, B) {
+  return Elementwise<Op::kSub, A, B>();
+}
+
+template <typename A, typename B,
+          typename = typename std::enable_if<IsNode<A>::value
+                                             && IsNode<B>::value>::type>
+constexpr Elementwise<Op::kMul, A, B> operator*(A, B) {
+  return Elementwise<Op::kMul, A, B>();
+}
+
+template <typename... Ts>
+struct TypeList {};
+
+template <typename A, typename B>
+struct Join;
+
+template <typename... A, typename... B>
+struct Join<TypeList<A...>, TypeList<B...>> {
+  using type = TypeList<A..., B...>;
+};
+
+// Add an input to a list of distinct inputs.
+template <typename List, typename X>
+struct Insert;
+
+template <typename X>
+struct Insert<TypeList<>, X> {
+  using type = TypeList<X>;
+};
+
+template <typename Head, typename... Tail, typename X>
+struct Insert<TypeList<Head, Tail...>, X> {
+  static_assert(Head::name != X::name || std::is_same<Head, X>::value,
+                "Inputs with the same name must have the same shape and type.");
+  using type = typename std::conditional<
+      Head::name == X::name, TypeList<Head, Tail...>,
+      typename Join<TypeList<Head>,
+                    typename Insert<TypeList<Tail...>, X>::type>::type>::type;
+};
+
+template <typename List, typename Result = TypeList<>>
+struct Unique;
+
+template <typename Result>
+struct Unique<TypeList<>, Result> {
+  using type = Result;
+};
+
+template <typename Head, typename... Tail, typename Result>
+struct Unique<TypeList<Head, Tail...>, Result>
+    : Unique<TypeList<Tail...>, typename Insert<Result, Head>::type> {};
+
+// Each node becomes a GLSL function "f<Id>(int r, int c)" returning its
+// value at row r and column c. Children get the ids 2 * Id + 1 and 2.
+template <unsigned Id>
+using FunctionName = ConcatT<DSL_STR("f"), Number<Id>>;
+
+template <typename T, unsigned Id, typename Body>
+using Function = ConcatT<typename TypeName<T>::type, DSL_STR(" "),
+                         FunctionName<Id>, DSL_STR("(int r, int c) {\n"),
+                         Body, DSL_STR("}\n")>;
+
+template <unsigned Id, typename Row, typename Col>
+using Call = ConcatT<FunctionName<Id>, DSL_STR("("), Row, DSL_STR(", "), Col,
+                     DSL_STR(")")>;
+
+template <typename N, unsigned Id>
+struct Gen;
+
+template <char Name, int Rows, int Cols, typename T, unsigned Id>
+struct Gen<Input<Name, Rows, Cols, T>, Id> {
+  using inputs = TypeList<Input<Name, Rows, Cols, T>>;
+  using defs = Function<T, Id,
+                        ConcatT<DSL_STR("  return texelFetch("), Chars<Name>,
+                                DSL_STR(", ivec2(c, r), 0).r;\n")>>;
+};
+
+template <typename A, typename B, unsigned Id>
+struct Gen<MatMul<A, B>, Id> {
+  using T = typename A::type;
+  using a = Gen<A, 2 * Id + 1>;
+  using b = Gen<B, 2 * Id + 2>;
+  using inputs = typename Join<typename a::inputs, typename b::inputs>::type;
+  using defs = ConcatT<
+      typename a::defs, typename b::defs,
+      Function<T, Id,
+               ConcatT<DSL_STR("  "), typename TypeName<T>::type,
+                       DSL_STR(" s = "), typename TypeName<T>::zero,
+                       DSL_STR(";\n  for (int k = 0; k < "),
+                       Number<A::cols>, DSL_STR("; ++k) {\n    s += "),
+                       Call<2 * Id + 1, Chars<'r'>, Chars<'k'>>,
+                       DSL_STR(" * "),
+                       Call<2 * Id + 2, Chars<'k'>, Chars<'c'>>,
+                       DSL_STR(";\n  }\n  return s;\n")>>>;
+};
+
+template <Op O>
+struct OpName;
+
+template <>
+struct OpName<Op::kAdd> {
+  using type = DSL_STR(" + ");
+};
+
+template <>
+struct OpName<Op::kSub> {
+  using type = DSL_STR(" - ");
+};
+
+template <>
+struct OpName<Op::kMul> {
+  using type = DSL_STR(" * ");
+};
+
+template <Op O, typename A, typename B, unsigned Id>
+struct Gen<Elementwise<O, A, B>, Id> {
+  using a = Gen<A, 2 * Id + 1>;
+  using b = Gen<B, 2 * Id + 2>;
+  using inputs = typename Join<typename a::inputs, typename b::inputs>::type;
+  using defs = ConcatT<
+      typename a::defs, typename b::defs,
+      Function<typename A::type, Id,
+               ConcatT<DSL_STR("  return "),
+                       Call<2 * Id + 1, Chars<'r'>, Chars<'c'>>,
+                       typename OpName<O>::type,
+                       Call<2 * Id + 2, Chars<'r'>, Chars<'c'>>,
+                       DSL_STR(";\n")>>>;
+};
+
+template <typename A, unsigned Id>
+struct Gen<Relu<A>, Id> {
+  using T = typename A::type;
+  using a = Gen<A, 2 * Id + 1>;
+  using inputs = typename a::inputs;
+  using defs = ConcatT<
+      typename a::defs,
+      Function<T, Id,
+               ConcatT<DSL_STR("  return max("),
+                       Call<2 * Id + 1, Chars<'r'>, Chars<'c'>>,
+                       DSL_STR(", "), typename TypeName<T>::zero,
+                       DSL_STR(");\n")>>>;
+};
+
+template <typename T, typename A, unsigned Id>
+struct Gen<Cast<T, A>, Id> {
+  using a = Gen<A, 2 * Id + 1>;
+  using inputs = typename a::inputs;
+  using defs = ConcatT<
+      typename a::defs,
+      Function<T, Id,
+               ConcatT<DSL_STR("  return "), typename TypeName<T>::type,
+                       DSL_STR("("), Call<2 * Id + 1, Chars<'r'>, Chars<'c'>>,
+                       DSL_STR(");\n")>>>;
+};
+
+template <typename List>
+struct Samplers;
+
+template <typename... Inputs>
+struct Samplers<TypeList<Inputs...>> {
+  using type = ConcatT<
+      ConcatT<DSL_STR("uniform "),
+              typename TypeName<typename Inputs::type>::sampler,
+              DSL_STR(" "), Chars<Inputs::name>, DSL_STR(";\n")>...>;
+};
+
+template <typename Expr>
+struct Kernel {
+  static_assert(IsNode<Expr>::value, "Not a DSL expression.");
+
+  static const int rows = Expr::rows;
+  static const int cols = Expr::cols;
+
+  using gen = Gen<Expr, 0>;
+  using text = ConcatT<
+      DSL_STR("#version 330 core\n"),
+      typename Samplers<typename Unique<typename gen::inputs>::type>::type,
+      typename gen::defs,
+      DSL_STR("out "), typename TypeName<typename Expr::type>::type,
+      DSL_STR(" color;\nvoid main() {\n"),
+      DSL_STR("  color = f0(int(gl_FragCoord.y), int(gl_FragCoord.x));\n"),
+      DSL_STR("}\n")>;
+
+  static constexpr const char *source = text::value;
+};
+
+template <typename Expr>
+constexpr const char *Kernel<Expr>::source;
+
+}  // namespace dsl
+
+/*!
+ * \brief An OpenGL program, composed of a vertex shader and a fragment shader.
+ * In TVM, every program has the same vertex shader.
+ * So a program just corresponds to a fragment shader.
+ * A program can only be created by the workspace.
+ * This class is just a wrapper over an OpenGL program ID.
+ */
+class Program {
+ public:
+  // Move constructor.
+  Program(Program &&other) noexcept;
+
+  // Cannot be copied.
+  Program(const Program &other) = delete;
+
+  // Cannot be assigned.
+  Program &operator=(const Program &other) = delete;
+
+  // Destructor.
+  ~Program();
+
+ private:
+  friend class Workspace;
+
+  // Only a workspace can construct a program.
+  explicit Program(GLuint program);
+
+  // The internal OpenGL program ID.
+  GLuint program_;
+
+  static const GLuint kInvalidProgram = static_cast<GLuint>(-1);
+};
+
+/*!
+ * An OpenGL texture represents a chunk of GPU memory.
+ * This is the way we represent tensors.
+ * We use 2D textures, except for 1D tensors too long for a texture row,
+ * which are buffer textures (GL_TEXTURE_BUFFER) of width x 1 texels.
+ * Buffer textures can only be read by shaders, through samplerBuffer.
+ *
+ * Every texture is accounted against the workspace memory budget, and may be
+ * evicted to host memory when the budget runs out (see
+ * Workspace::SetMemoryBudget). An evicted texture is uploaded again the next
+ * time it is used, and gets a new OpenGL ID.
+ */
+class Texture {
+ public:
+  ~Texture();
+
+  Texture(Texture &&other) noexcept;
+
+  Texture(const Texture &other) = delete;
+
+  Texture &operator=(const Texture &other) = delete;
+
+  GLsizei width() const { return width_; }
+
+  GLsizei height() const { return height_; }
+
+  GLenum target() const { return target_; }
+
+  GLenum internal_format() const { return internal_format_; }
+
+  // The host layout of texels (GL_NONE for buffer textures).
+  GLenum format() const { return format_; }
+
+  GLenum type() const { return type_; }
+
+  // Bytes of the content in the host layout.
+  size_t host_bytes() const;
+
+  // Bytes of GPU memory taken when resident.
+  size_t bytes() const { return bytes_; }
+
+  bool resident() const { return resident_; }
+
+  void GetData(GLfloat *data) const;
+
+  // Map the storage of a buffer texture for writing.
+  // The previous content is discarded.
+  // The texture must not be used until UnmapBuffer() is called.
+  GLvoid *MapBuffer();
+
+  void UnmapBuffer();
+
+ protected:
+  // Upload "data" laid out as (format, type) into a texture stored as
+  // internal_format.
+  explicit Texture(const GLvoid *data, GLsizei width, GLsizei height,
+                   GLint internal_format, GLenum format, GLenum type);
+
+  // Create a buffer texture of "width" texels, taking "size" bytes.
+  // "data" must hold "size" bytes, or be nullptr.
+  explicit Texture(const GLvoid *data, GLsizeiptr size, GLsizei width,
+                   GLenum internal_format);
+
+  // Read back the texture as (format, type).
+  // A buffer texture is always read back as is.
+  void GetData(GLenum format, GLenum type, GLvoid *data) const;
+
+  // Overwrite the texture with data laid out as (format, type).
+  // A buffer texture is always overwritten as is.
+  void SetData(GLenum format, GLenum type, const GLvoid *data);
+
+ private:
+  friend class Workspace;
+
+  explicit Texture(const GLfloat *data, GLsizei width, GLsizei height);
+
+  GLuint texture() const { return texture_; }
+
+  // Create the OpenGL objects, with "data" in the host layout.
+  void Allocate(const GLvoid *data) const;
+
+  // Delete the OpenGL objects.
+  void Release() const;
+
+  // Copy the content to host memory and release the OpenGL objects.
+  void Evict() const;
+
+  // Allocate again from the host copy.
+  void Restore() const;
+
+  // GetData() without the residency bookkeeping. Must be resident.
+  void ReadData(GLenum format, GLenum type, GLvoid *data) const;
+
+  static const GLuint kInvalidTexture = static_cast<GLuint>(-1);
+
+  static const GLuint kInvalidBuffer = static_cast<GLuint>(-1);
+
+  GLenum target_;
+
+  // Residency is managed behind the user's back, even for const textures.
+  mutable GLuint texture_;
+
+  GLsizei width_;
+  GLsizei height_;
+
+  GLenum internal_format_;
+  size_t bytes_;
+
+  // How texel data is laid out on the host side (2D textures only).
+  GLenum format_;
+  GLenum type_;
+
+  // Only for buffer textures.
+  mutable GLuint buffer_;
+  GLsizeiptr buffer_size_;
+
+  // Memory management, owned by the workspace.
+  mutable bool resident_;
+  mutable int pins_;
+  mutable std::vector<char> evicted_data_;
+  bool tracked_;
+  std::list<Texture *>::iterator lru_position_;
+};
+
+/*!
+ * A texture whose storage type is known at compile time.
+ * See namespace dtype for the available storage types.
+ * width and height are in texels, so a texture holds
+ * width * height * DType::kLanes values.
+ */
+template <typename DType>
+class TypedTexture : public Texture {
+ public:
+  using HostType = typename DType::HostType;
+
+  using TransferType = typename DType::TransferType;
+
+  TypedTexture(TypedTexture &&other) noexcept = default;
+
+  size_t size() const {
+    return static_cast<size_t>(width()) * height() * DType::kLanes;
+  }
+
+  void GetData(HostType *data) const;
+
+  // Overwrite the whole content, with size() values.
+  void SetData(const HostType *data);
+
+  // See Texture::MapBuffer().
+  TransferType *MapBuffer() {
+    return static_cast<TransferType *>(Texture::MapBuffer());
+  }
+
+ private:
+  friend class Workspace;
+
+  explicit TypedTexture(const HostType *data, GLsizei width, GLsizei height);
+
+  // Create a buffer texture of "width" texels.
+  explicit TypedTexture(const HostType *data, GLsizei width);
+
+  // Selected at compile time:
+  // no staging buffer is involved when HostType == TransferType.
+  static const TransferType *Encode(const HostType *data, size_t size,
+                                    std::vector<TransferType> *staging,
+                                    std::true_type /*same_type*/);
+
+  static const TransferType *Encode(const HostType *data, size_t size,
+                                    std::vector<TransferType> *staging,
+                                    std::false_type /*same_type*/);
+
+  void GetData(HostType *data, std::true_type /*same_type*/) const;
+
+  void GetData(HostType *data, std::false_type /*same_type*/) const;
+
+  using SameType = typename std::is_same<HostType, TransferType>::type;
+};
+
+/*!
+ * A strided 2D view over the values of a texture. Nothing is copied.
+ * The values of a texture are numbered in row-major texel order
+ * (x + y * width), and element (i, j) of the view is value
+ *   offset + i * row_stride + j * col_stride.
+ * Slicing moves the offset and shrinks the shape, transposing swaps the
+ * strides, and broadcasting uses a 0 stride.
+ * Kernels receive views as uniforms (see Workspace::Render).
+ */
+struct TextureView {
+  Texture *texture;
+  GLint offset;
+  GLint rows;
+  GLint cols;
+  GLint row_stride;
+  GLint col_stride;
+
+  // A contiguous row-major rows x cols matrix.
+  static TextureView Matrix(Texture *texture, GLint rows, GLint cols) {
+    return TextureView{texture, 0, rows, cols, cols, 1};
+  }
+
+  // Rows [row_begin, row_end) and columns [col_begin, col_end).
+  TextureView Slice(GLint row_begin, GLint row_end, GLint col_begin,
+                    GLint col_end) const {
+    assert(0 <= row_begin && row_begin <= row_end && row_end <= rows);
+    assert(0 <= col_begin && col_begin <= col_end && col_end <= cols);
+    return TextureView{texture,
+                       offset + row_begin * row_stride + col_begin * col_stride,
+                       row_end - row_begin, col_end - col_begin, row_stride,
+                       col_stride};
+  }
+
+  TextureView Transpose() const {
+    return TextureView{texture, offset, cols, rows, col_stride, row_stride};
+  }
+
+  // Repeat a single row "num_rows" times.
+  TextureView BroadcastRows(GLint num_rows) const {
+    assert(rows == 1);
+    return TextureView{texture, offset, num_rows, cols, 0, col_stride};
+  }
+
+  // Repeat a single column "num_cols" times.
+  TextureView BroadcastCols(GLint num_cols) const {
+    assert(cols == 1);
+    return TextureView{texture, offset, rows, num_cols, row_stride, 0};
+  }
+};
+
+/*!
+ * A tensor with both a host copy and a device copy, kept in sync lazily.
+ * The device copy is only uploaded when a kernel asks for it while stale,
+ * and the host copy is only downloaded when host code reads it while stale.
+ * Ask for mutable access to say which side is about to change.
+ */
+template <typename DType>
+class MirroredTensor {
+ public:
+  using HostType = typename DType::HostType;
+
+  // Starts out as zeros on the host.
+  explicit MirroredTensor(GLsizei width, GLsizei height);
+
+  MirroredTensor(MirroredTensor &&other) noexcept = default;
+
+  MirroredTensor(const MirroredTensor &other) = delete;
+
+  MirroredTensor &operator=(const MirroredTensor &other) = delete;
+
+  size_t size() const { return host_.size(); }
+
+  // For reading on the host. Downloads if needed.
+  const HostType *host_data();
+
+  // For writing on the host. Invalidates the device copy.
+  HostType *mutable_host_data();
+
+  // For a kernel input. Uploads if needed.
+  TypedTexture<DType> *device();
+
+  // For a kernel output, which overwrites all of it.
+  // Never uploads. Invalidates the host copy.
+  TypedTexture<DType> *mutable_device();
+
+  bool host_valid() const { return host_valid_; }
+
+  bool device_valid() const { return device_valid_; }
+
+  // Number of transfers so far, to help find redundant ones.
+  int num_uploads() const { return num_uploads_; }
+
+  int num_downloads() const { return num_downloads_; }
+
+ private:
+  std::vector<HostType> host_;
+  TypedTexture<DType> device_;
+  bool host_valid_;
+  bool device_valid_;
+  int num_uploads_;
+  int num_downloads_;
+};
+
+/*!
+ * \brief Asymmetric 8-bit quantization parameters:
+ *   real = scale * (quantized - zero_point).
+ * Holds one entry for a per-tensor quantization, or one entry per row
+ * ("channel") for a per-channel quantization.
+ * Signed int8 data is stored by adding 128 to both values and zero points.
+ */
+struct QuantParams {
+  std::vector<GLfloat> scales;
+  std::vector<GLint> zero_points;
+};
+
+/*!
+ * \brief Quantize a row-major rows x cols matrix on the host.
+ * \param per_channel Whether each row gets its own scale and zero point.
+ * \param quantized Output, rows * cols values.
+ */
+QuantParams Quantize(const GLfloat *data, GLsizei rows, GLsizei cols,
+                     bool per_channel, GLubyte *quantized);
+
+/*!
+ * An 8-bit quantized rows x cols matrix.
+ * Values are packed 4 per RGBA8UI texel along each row, so a row takes
+ * cols / 4 texels and the whole matrix is laid out linearly in one texture row.
+ * The scale and zero point of each channel live in a small RGBA32F texture.
+ */
+class QuantizedTexture {
+ public:
+  QuantizedTexture(QuantizedTexture &&other) noexcept = default;
+
+  QuantizedTexture(const QuantizedTexture &other) = delete;
+
+  QuantizedTexture &operator=(const QuantizedTexture &other) = delete;
+
+  GLsizei rows() const { return rows_; }
+
+  GLsizei cols() const { return cols_; }
+
+  bool per_channel() const { return per_channel_; }
+
+  TypedTexture<dtype::UInt8x4Integer> &data() { return data_; }
+
+  TypedTexture<dtype::Float32x4> &params() { return params_; }
+
+ private:
+  friend class Workspace;
+
+  QuantizedTexture(TypedTexture<dtype::UInt8x4Integer> data,
+                   TypedTexture<dtype::Float32x4> params,
+                   GLsizei rows, GLsizei cols, bool per_channel);
+
+  TypedTexture<dtype::UInt8x4Integer> data_;
+  TypedTexture<dtype::Float32x4> params_;
+  GLsizei rows_;
+  GLsizei cols_;
+  bool per_channel_;
+};
+
+/*!
+ * An NHWC activation with 4 channels per RGBA32F texel: texel
+ * (x * c4 + i, n * height + y) holds channels 4 * i .. 4 * i + 3 of pixel
+ * (n, y, x), where c4 = ceil(channels / 4). Padding channels are zero.
+ */
+class Nhwc4Tensor {
+ public:
+  Nhwc4Tensor(Nhwc4Tensor &&other) noexcept = default;
+
+  Nhwc4Tensor(const Nhwc4Tensor &other) = delete;
+
+  Nhwc4Tensor &operator=(const Nhwc4Tensor &other) = delete;
+
+  GLsizei batch() const { return batch_; }
+
+  GLsizei height() const { return height_; }
+
+  GLsizei width() const { return width_; }
+
+  GLsizei channels() const { return channels_; }
+
+  GLsizei c4() const { return (channels_ + 3) / 4; }
+
+  TypedTexture<dtype::Float32x4> &texture() { return texture_; }
+
+  const TypedTexture<dtype::Float32x4> &texture() const { return texture_; }
+
+  // batch * height * width * channels values, NHWC.
+  void GetData(GLfloat *nhwc) const;
+
+ private:
+  friend class Workspace;
+
+  Nhwc4Tensor(TypedTexture<dtype::Float32x4> texture, GLsizei batch,
+              GLsizei height, GLsizei width, GLsizei channels);
+
+  TypedTexture<dtype::Float32x4> texture_;
+  GLsizei batch_;
+  GLsizei height_;
+  GLsizei width_;
+  GLsizei channels_;
+};
+
+/*!
+ * Conv2d weights and bias, packed for NHWC4 tensors.
+ * For each output channel block oc4 (a texture row) and each kernel tap and
+ * input channel block k4 = (ky * kernel_w + kx) * in_c4 + ic4, the 4 texels
+ * at 4 * k4 are the columns of the mat4 that maps 4 input channels to 4
+ * output channels. The bias is a row of out_c4 texels.
+ * 3x3 filters also keep their Winograd F(2x2, 3x3) transform U = G g G^T,
+ * computed once when created: the same packing, with the 16 positions of U
+ * in place of the kernel taps. That takes up to GL_MAX_TEXTURE_SIZE / 16
+ * input channels.
+ */
+class Conv2dFilter {
+ public:
+  Conv2dFilter(Conv2dFilter &&other) noexcept = default;
+
+  Conv2dFilter(const Conv2dFilter &other) = delete;
+
+  Conv2dFilter &operator=(const Conv2dFilter &other) = delete;
+
+  GLsizei kernel_h() const { return kernel_h_; }
+
+  GLsizei kernel_w() const { return kernel_w_; }
+
+  GLsizei in_channels() const { return in_channels_; }
+
+  GLsizei out_channels() const { return out_channels_; }
+
+  TypedTexture<dtype::Float32x4> &weights() { return weights_; }
+
+  TypedTexture<dtype::Float32x4> &bias() { return bias_; }
+
+  // nullptr unless 3x3.
+  TypedTexture<dtype::Float32x4> *winograd_weights() {
+    return winograd_weights_.get();
+  }
+
+ private:
+  friend class Workspace;
+
+  Conv2dFilter(TypedTexture<dtype::Float32x4> weights,
+               TypedTexture<dtype::Float32x4> bias,
+               std::unique_ptr<TypedTexture<dtype::Float32x4>>
+                   winograd_weights,
+               GLsizei kernel_h, GLsizei kernel_w, GLsizei in_channels,
+               GLsizei out_channels);
+
+  TypedTexture<dtype::Float32x4> weights_;
+  TypedTexture<dtype::Float32x4> bias_;
+  std::unique_ptr<TypedTexture<dtype::Float32x4>> winograd_weights_;
+  GLsizei kernel_h_;
+  GLsizei kernel_w_;
+  GLsizei in_channels_;
+  GLsizei out_channels_;
+};
+
+enum class Conv2dAlgorithm {
+  // Pick by shape.
+  kAuto,
+  kDirect,
+  kIm2col,
+  // 3x3, stride 1 only.
+  kWinograd,
+};
+
+/*!
+ * \brief Two textures of the same shape for multi-pass kernels: each pass
+ * reads front() and writes back(), then calls Swap().
+ */
+template <typename DType>
+class PingPong {
+ public:
+  TypedTexture<DType> &front() { return textures_[front_]; }
+
+  TypedTexture<DType> &back() { return textures_[1 - front_]; }
+
+  void Swap() { front_ = 1 - front_; }
+
+ private:
+  friend class Workspace;
+
+  PingPong(TypedTexture<DType> front, TypedTexture<DType> back) : front_(0) {
+    textures_.push_back(std::move(front));
+    textures_.push_back(std::move(back));
+  }
+
+  std::vector<TypedTexture<DType>> textures_;
+  int front_;
+};
+
+/*!
+ * A ring of persistently mapped, coherent staging memory
+ * (glBufferStorage with GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT).
+ * Host code writes inputs straight into Region::data, and the GPU pulls them
+ * from there (Workspace::Upload). Readbacks land there too
+ * (Workspace::Download). No extra copy, and no GL call is needed to fill a
+ * region, so any thread may fill a region acquired on the GL thread.
+ * Every GPU use of a region is followed by a fence, and a region is only
+ * handed out again once the GPU is done with it.
+ * All regions in flight must fit in the ring at once.
+ * Requires OpenGL 4.4 or ARB_buffer_storage.
+ */
+class StagingRing {
+ public:
+  struct Region {
+    GLvoid *data;
+    GLintptr offset;
+    GLsizeiptr size;
+  };
+
+  StagingRing(StagingRing &&other) noexcept;
+
+  StagingRing(const StagingRing &other) = delete;
+
+  StagingRing &operator=(const StagingRing &other) = delete;
+
+  ~StagingRing();
+
+  GLsizeiptr capacity() const { return capacity_; }
+
+  // Get "size" bytes of staging memory.
+  // Blocks while the GPU still uses that part of the ring.
+  Region Acquire(GLsizeiptr size);
+
+  // Block until the GPU is done with "region".
+  // Call this before reading the result of a Workspace::Download.
+  void Wait(const Region &region);
+
+  // Hand back a region read back by Workspace::Download once its data has
+  // been consumed. Until then the region stays reserved: Acquire() fails
+  // rather than reuse it, so size rings for every readback kept pending.
+  void Release(const Region &region);
+
+  // Offsets of regions are multiples of this, which suits every texel type
+  // and GL_TEXTURE_BUFFER_OFFSET_ALIGNMENT.
+  static const GLsizeiptr kAlignment = 256;
+
+ private:
+  friend class Workspace;
+
+  explicit StagingRing(GLsizeiptr capacity);
+
+  GLuint buffer() const { return buffer_; }
+
+  // Called after issuing GPU commands that use "region". A readback stays
+  // reserved until Release().
+  void Fence(const Region &region, bool readback = false);
+
+  struct InFlight {
+    GLintptr begin;
+    GLintptr end;
+    // nullptr while the region is only owned by the host.
+    GLsync fence;
+    bool readback;
+  };
+
+  static void WaitFence(GLsync fence);
+
+  static const GLuint kInvalidBuffer = static_cast<GLuint>(-1);
+
+  GLuint buffer_;
+  GLvoid *mapped_;
+  GLsizeiptr capacity_;
+  GLintptr head_;
+
+  // In acquisition order.
+  std::deque<InFlight> in_flight_;
+};
+
+/*!
+ * A bump allocator for host-side tensor staging.
+ * The memory is reserved and faulted in once, and handed out 64-byte
+ * aligned. Reset() makes all of it available again, so that a request
+ * never mallocs or page-faults once the arena is warm.
+ * On Linux the arena can be backed by huge pages to cut TLB misses on large
+ * tensors: transparent huge pages (madvise) or explicit ones (MAP_HUGETLB,
+ * falling back to transparent huge pages when none are reserved).
+ */
+class HostArena {
+ public:
+  enum class HugePages {
+    kNone,
+    kTransparent,
+    kExplicit,
+  };
+
+  explicit HostArena(size_t capacity,
+                     HugePages huge_pages = HugePages::kTransparent);
+
+  HostArena(const HostArena &other) = delete;
+
+  HostArena &operator=(const HostArena &other) = delete;
+
+  ~HostArena();
+
+  // Get uninitialized memory for "count" values of type T.
+  template <typename T>
+  T *Allocate(size_t count) {
+    return static_cast<T *>(Allocate(count * sizeof(T)));
+  }
+
+  void *Allocate(size_t bytes);
+
+  // Free everything at once.
+  void Reset() { used_ = 0; }
+
+  size_t capacity() const { return capacity_; }
+
+  size_t used() const { return used_; }
+
+  static const size_t kAlignment = 64;
+
+  static const size_t kHugePageSize = 2 << 20;
+
+ private:
+  char *data_;
+  size_t capacity_;
+  size_t used_;
+
+  // Whether data_ comes from mmap (otherwise from new[], at raw_).
+  bool mapped_;
+  char *raw_;
+};
+
+/*!
+ * \brief Split a width x height texture into chunks of at most chunk_size
+ * bytes, in row-major order: whole rows when a row fits in a chunk, pieces
+ * of a row otherwise. Calls f(x, y, width, height) for each chunk.
+ */
+template <typename F>
+void ForEachChunk(GLsizei width, GLsizei height, size_t texel_size,
+                  size_t chunk_size, F f) {
+  chunk_size = std::max(chunk_size, texel_size);
+  size_t row_size = texel_size * width;
+
+  GLsizei chunk_rows = 1;
+  GLsizei chunk_width = width;
+  if (row_size <= chunk_size) {
+    chunk_rows = static_cast<GLsizei>(
+        std::min(chunk_size / row_size, static_cast<size_t>(height)));
+  } else {
+    chunk_width = static_cast<GLsizei>(chunk_size / texel_size);
+  }
+
+  for (GLsizei y = 0; y < height; y += chunk_rows) {
+    GLsizei rows = std::min(chunk_rows, height - y);
+    for (GLsizei x = 0; x < width; x += chunk_width) {
+      f(x, y, std::min(chunk_width, width - x), rows);
+    }
+  }
+}
+
+/*!
+ * \brief The numpy type string ("descr") of a transfer type, e.g. "<f4".
+ */
+template <typename T>
+const char *NpyDescr();
+
+template <>
+inline const char *NpyDescr<GLfloat>() { return "<f4"; }
+
+template <>
+inline const char *NpyDescr<GLhalf>() { return "<f2"; }
+
+template <>
+inline const char *NpyDescr<GLint>() { return "<i4"; }
+
+template <>
+inline const char *NpyDescr<GLubyte>() { return "|u1"; }
+
+/*!
+ * A read-only memory mapping of a tensor file, either
+ *   - .npy (format version 1 to 3, C order, little-endian), or
+ *   - raw: values only, with the type and shape given by the caller.
+ * The file is mapped with a sequential access hint, so pages stream in
+ * ahead of use. Workspace::LoadTexture drops them again once they are
+ * uploaded, so a whole file is never resident at once.
+ */
+class TensorFile {
+ public:
+  static TensorFile OpenNpy(const std::string &path);
+
+  static TensorFile OpenRaw(const std::string &path, const std::string &descr,
+                            const std::vector<size_t> &shape);
+
+  TensorFile(TensorFile &&other) noexcept;
+
+  TensorFile(const TensorFile &other) = delete;
+
+  TensorFile &operator=(const TensorFile &other) = delete;
+
+  ~TensorFile();
+
+  const std::string &descr() const { return descr_; }
+
+  const std::vector<size_t> &shape() const { return shape_; }
+
+  size_t num_values() const;
+
+  // Where the values start.
+  const char *values() const { return file_data_ + values_offset_; }
+
+  size_t values_size() const { return file_size_ - values_offset_; }
+
+  // Tell the OS that bytes [begin, end) of the values are no longer needed.
+  void Drop(size_t begin, size_t end) const;
+
+ private:
+  explicit TensorFile(const std::string &path);
+
+  void ParseNpyHeader();
+
+  const char *file_data_;
+  size_t file_size_;
+  size_t values_offset_;
+  std::string descr_;
+  std::vector<size_t> shape_;
+
+  // Without mmap, the file is read into memory.
+  std::vector<char> buffer_;
+};
+
+/*!
+ * \brief Where and how one tensor is stored in a checkpoint.
+ *
+ * A checkpoint file is laid out as
+ *   - a 64-byte header: magic "GLTCKPT1", version, number of tensors,
+ *     offset, size and checksum of the index,
+ *   - the tensors, each starting at a 64-byte aligned offset,
+ *   - the index: one serialized CheckpointEntry per tensor.
+ * Tensors are stored chunk by chunk, in ForEachChunk order. Float tensors
+ * may be encoded as fp16, or as 8 bits with a (scale, zero point) pair in
+ * front of every chunk. Checksums are 64-bit FNV-1a over the stored bytes.
+ * All numbers are little-endian.
+ */
+struct CheckpointEntry {
+  enum Encoding : uint32_t {
+    kRaw = 0,
+    kFloat16 = 1,
+    kInt8 = 2,
+  };
+
+  std::string name;
+  uint32_t encoding;
+
+  // The texture this came from.
+  GLenum target;
+  GLenum internal_format;
+  GLenum format;
+  GLenum type;
+  GLsizei width;
+  GLsizei height;
+
+  // Chunk size in bytes of the texture's host layout.
+  uint64_t chunk_size;
+
+  // Where the stored bytes are in the file.
+  uint64_t offset;
+  uint64_t size;
+  uint64_t checksum;
+};
+
+/*!
+ * \brief Writes textures into a checkpoint, streaming them chunk by chunk
+ * through asynchronous readbacks into a staging ring.
+ * Never holds more than a few chunks on the host.
+ */
+class CheckpointWriter {
+ public:
+  // Chunks are at most chunk_size bytes, and small enough for
+  // kMaxInFlight + 1 of them to fit in the ring, each rounded to
+  // StagingRing::kAlignment. The ring must hold at least kMaxInFlight + 1
+  // aligned regions.
+  CheckpointWriter(const std::string &path, StagingRing *ring,
+                   size_t chunk_size = 1 << 20);
+
+  CheckpointWriter(const CheckpointWriter &other) = delete;
+
+  CheckpointWriter &operator=(const CheckpointWriter &other) = delete;
+
+  // Finishes the checkpoint if Finish() was not called.
+  ~CheckpointWriter();
+
+  void Add(const std::string &name, const Texture &texture,
+           CheckpointEntry::Encoding encoding = CheckpointEntry::kRaw);
+
+  // Write the index and the header.
+  void Finish();
+
+  // Readbacks in flight before the oldest one gets written out.
+  static const size_t kMaxInFlight = 3;
+
+ private:
+  struct InFlight {
+    StagingRing::Region region;
+    size_t entry;
+    size_t num_values;
+  };
+
+  // Write out the oldest readback.
+  void WriteOne();
+
+  std::ofstream out_;
+  StagingRing *ring_;
+  size_t chunk_size_;
+  uint64_t offset_;
+  std::vector<CheckpointEntry> entries_;
+  std::deque<InFlight> in_flight_;
+  std::vector<char> encoded_;
+  bool finished_;
+};
+
+/*!
+ * \brief Reads textures from a checkpoint, streaming them chunk by chunk from
+ * the file straight into a staging ring, then into asynchronous uploads.
+ */
+class CheckpointReader {
+ public:
+  explicit CheckpointReader(const std::string &path);
+
+  const std::vector<CheckpointEntry> &entries() const { return entries_; }
+
+  // nullptr if not found.
+  const CheckpointEntry *Find(const std::string &name) const;
+
+  // Read a tensor into a texture of the same kind and size.
+  void Read(const std::string &name, Texture *texture, StagingRing *ring);
+
+ private:
+  std::ifstream in_;
+  std::vector<CheckpointEntry> entries_;
+  std::vector<char> encoded_;
+};
+
+/*!
+ * \brief Out-of-core matmul: C (M x N) = A (M x K) * B (K x N), with all three
+ * row-major in host memory (e.g. memory-mapped with TensorFile) and only a
+ * few tiles on the device at a time.
+ *
+ * Each tile of C is accumulated over the K dimension, ping-ponging between
+ * two accumulator textures. The A and B tiles are double-buffered: the next
+ * tiles are streamed in through the staging ring while the current block
+ * matmul runs, and each finished C tile is read back while the next one is
+ * computed.
+ */
+class TiledMatmul {
+ public:
+  // Tiles of C are tile_size x tile_size, and the K dimension is split into
+  // steps of tile_depth.
+  TiledMatmul(GLsizei tile_size, GLsizei tile_depth);
+
+  void Run(const GLfloat *a, const GLfloat *b, GLfloat *c, GLsizei M,
+           GLsizei N, GLsizei K);
+
+  // Device memory taken by the tiles.
+  static size_t DeviceBytes(GLsizei tile_size, GLsizei tile_depth);
+
+  // The largest square tiles that fit in "bytes" of device memory.
+  static GLsizei TileSizeFor(size_t bytes);
+
+ private:
+  // Copy the rows x cols block at (row, col) of a row-major matrix with "ld"
+  // columns into staging memory, and upload it to the corner of "texture".
+  void UploadTile(const GLfloat *matrix, GLsizei ld, GLsizei row, GLsizei col,
+                  GLsizei rows, GLsizei cols, Texture *texture);
+
+  struct PendingTile {
+    StagingRing::Region region;
+    GLsizei row, col, rows, cols;
+  };
+
+  // Copy the oldest C tile read back into the host.
+  void FinishTile(GLfloat *c, GLsizei N);
+
+  // Staging memory for the A and B tiles of two steps, uploaded while a C
+  // tile read back is still reserved, plus what wrapping around may waste:
+  // 6 regions of the largest tile, each rounded to StagingRing::kAlignment.
+  static GLsizeiptr StagingBytes(GLsizei tile_size, GLsizei tile_depth);
+
+  GLsizei tile_size_;
+  GLsizei tile_depth_;
+  Program program_;
+  StagingRing ring_;
+  std::vector<Texture> a_tiles_;
+  std::vector<Texture> b_tiles_;
+  std::vector<Texture> c_tiles_;
+  std::deque<PendingTile> pending_;
+};
+
+/*!
+ * \brief A sequence of kernels over 2D float textures ("values").
+ *
+ * A value is either external, i.e. a constant texture provided by the
+ * caller, an input bound before each run, or an intermediate computed by a
+ * kernel. Outputs get textures of their own. Every other intermediate is
+ * planned ahead of time into a band of rows of a few shared "arena" textures,
+ * where values that are never alive at the same time share rows (see Plan()).
+ * Running allocates nothing.
+ *
+ * A graph can be optimized and planned once and then run many times with
+ * other inputs. Generated kernels get the first row of each input X as the
+ * uniform X_row0, and the first row of their output as out_row0.
+ */
+class KernelGraph {
+ public:
+  enum class ValueKind { kExternal, kInput, kIntermediate };
+
+  struct Value {
+    GLsizei rows;
+    GLsizei cols;
+    // Set for external values, bound inputs, and planned intermediates.
+    std::shared_ptr<Texture> texture;
+    ValueKind kind;
+    // The first row of the value in its texture.
+    GLint row;
+  };
+
+  struct Kernel {
+    const Program *program;
+    // Sampler name -> value.
+    std::vector<std::pair<std::string, int>> inputs;
+    std::vector<std::pair<std::string, int>> uniforms;
+    int output;
+  };
+
+  int AddExternal(std::shared_ptr<Texture> texture, GLsizei rows,
+                  GLsizei cols);
+
+  int AddIntermediate(GLsizei rows, GLsizei cols);
+
+  // The index-th input is bound with Bind(index, texture).
+  int AddInput(GLsizei rows, GLsizei cols);
+
+  void Bind(size_t index, std::shared_ptr<Texture> texture);
+
+  void AddKernel(Kernel kernel) {
+    kernels_.push_back(std::move(kernel));
+    planned_ = false;
+  }
+
+  // Keep the texture of a value after running.
+  void AddOutput(int value) {
+    outputs_.push_back(value);
+    planned_ = false;
+  }
+
+  const std::vector<Value> &values() const { return values_; }
+
+  const std::vector<Kernel> &kernels() const { return kernels_; }
+
+  const std::vector<int> &outputs() const { return outputs_; }
+
+  const std::vector<int> &inputs() const { return inputs_; }
+
+  // The texture of an output, after running.
+  std::shared_ptr<Texture> texture(int value) const {
+    return values_[value].texture;
+  }
+
+  // Dispatch every kernel in order. Plans first if needed.
+  void Run();
+
+  // Assign textures to intermediates, from the lifetimes of the values:
+  // bands are placed largest first, into the tightest gap between bands that
+  // are alive at the same time (best fit). A kernel never reads from the
+  // arena it writes to, since that would be a rendering feedback loop.
+  void Plan();
+
+  // Device memory taken by the arenas, once planned.
+  size_t arena_bytes() const;
+
+  // The most memory intermediates other than outputs ever need at once.
+  // No plan can use less than this.
+  size_t peak_live_bytes() const;
+
+  // Optimizer passes. Each returns the number of kernels removed.
+
+  // Merge kernels with the same program, inputs and uniforms.
+  int EliminateCommonSubexpressions();
+
+  // Run the kernels that only read external values now, turning their
+  // outputs into external values.
+  int FoldConstants();
+
+  // Drop kernels whose output is never read.
+  int EliminateDeadKernels();
+
+  // All of the above, then release what is not referenced anymore.
+  // Folding only pays off for graphs that run more than once: a graph run
+  // once would dispatch the same kernels, into unplanned textures.
+  void Optimize(bool fold_constants = true);
+
+ private:
+  // Dispatch with the rows of the values as uniforms.
+  void Dispatch(const Kernel &kernel);
+
+  // The first and last kernels touching each value, or -1.
+  void Lifetimes(std::vector<int> *first, std::vector<int> *last) const;
+
+  bool planned_ = false;
+  std::vector<std::shared_ptr<Texture>> arenas_;
+  std::vector<Value> values_;
+  std::vector<Kernel> kernels_;
+  std::vector<int> outputs_;
+  std::vector<int> inputs_;
+};
+
+/*!
+ * \brief A lazily evaluated float matrix.
+ *
+ * Operations only record a node; nothing runs until eval() or GetData().
+ * Materializing compiles the pending nodes into a KernelGraph: chains of
+ * elementwise ops are fused into the kernel of their producer (including a
+ * matmul), and only values that are shared or feed a matmul get a texture.
+ *
+ *   Tensor d = a.matmul(b).relu() + c;  // Nothing runs yet.
+ *   d.GetData(result);                  // A single kernel.
+ *
+ * Elementwise ops broadcast operands with a single row or column.
+ */
+class Tensor {
+ public:
+  // A constant, uploaded right away.
+  static Tensor FromData(const GLfloat *data, GLsizei rows, GLsizei cols);
+
+  // An input of compiled graphs, see Compile(). Cannot be materialized.
+  static Tensor Placeholder(GLsizei rows, GLsizei cols);
+
+  GLsizei rows() const { return node_->rows; }
+
+  GLsizei cols() const { return node_->cols; }
+
+  Tensor matmul(const Tensor &other) const;
+
+  Tensor relu() const;
+
+  Tensor operator+(const Tensor &other) const;
+
+  Tensor operator-(const Tensor &other) const;
+
+  // Elementwise.
+  Tensor operator*(const Tensor &other) const;
+
+  Tensor operator*(GLfloat scale) const;
+
+  // Materialize, if not done yet.
+  void eval();
+
+  // rows x cols values, row-major. Materializes.
+  void GetData(GLfloat *data);
+
+  // Materializes.
+  const Texture &texture();
+
+  // The kernels that materializing "outputs" together would run, before
+  // optimization. The graph's inputs are the given placeholders, in order.
+  static KernelGraph Compile(const std::vector<Tensor> &outputs,
+                             const std::vector<Tensor> &inputs = {});
+
+  // Materialize several tensors at once, sharing their common work.
+  static void Eval(std::vector<Tensor> *outputs);
+
+ private:
+  struct Node {
+    enum Op {
+      kConstant, kInput, kMatmul, kAdd, kSub, kMul, kScale, kRelu
+    };
+
+    Op op;
+    GLsizei rows;
+    GLsizei cols;
+    std::vector<std::shared_ptr<Node>> args;
+    // For kScale.
+    GLfloat scalar;
+    // Set once materialized.
+    std::shared_ptr<Texture> texture;
+  };
+
+  explicit Tensor(std::shared_ptr<Node> node) : node_(std::move(node)) {}
+
+  static Tensor Elementwise(Node::Op op, const Tensor &lhs, const Tensor &rhs);
+
+  static Tensor Unary(Node::Op op, const Tensor &arg, GLfloat scalar = 0.0f);
+
+  std::shared_ptr<Node> node_;
+};
+
+/*!
+ * \brief A small tensor-expression IR: compute definitions are written once,
+ * and schedules decide how they become a fragment shader.
+ *
+ *   te::Tensor A = te::Placeholder("A", M, K);
+ *   te::Tensor B = te::Placeholder("B", K, N);
+ *   te::IterVar k = te::ReduceAxis("k", K);
+ *   te::Tensor C = te::Compute("C", M, N, [&](te::IterVar i, te::IterVar j) {
+ *     return te::Sum(A(i, k) * B(k, j), k);
+ *   });
+ *   te::Schedule s(C);
+ *   auto k_split = s.Tile(k, 4);
+ *   s.Unroll(k_split.second);
+ *   Program program = workspace.CreateProgram(s.Lower().c_str());
+ *
+ * Each fragment computes one texel of the output, at row i and column j.
+ * Inputs are bound as samplers named after their placeholders.
+ */
+namespace te {
+
+// kVec4: each RGBA texel holds 4 consecutive columns (see dtype::Float32x4).
+enum class Layout { kScalar, kVec4 };
+
+struct IterVarNode;
+using IterVar = std::shared_ptr<IterVarNode>;
+
+// How an axis is iterated over is up to each Schedule.
+struct IterVarNode {
+  std::string name;
+  int extent;
+  bool reduce;
+};
+
+IterVar ReduceAxis(const std::string &name, int extent);
+
+struct ExprNode;
+struct TensorNode;
+
+class Expr {
+ public:
+  // A constant.
+  Expr(float value);
+
+  // The value of an axis.
+  Expr(const IterVar &var);
+
+  explicit Expr(std::shared_ptr<const ExprNode> node) : node_(std::move(node)) {}
+
+  const ExprNode *operator->() const { return node_.get(); }
+
+  const ExprNode *get() const { return node_.get(); }
+
+ private:
+  std::shared_ptr<const ExprNode> node_;
+};
+
+struct ExprNode {
+  enum Kind { kConst, kVar, kLoad, kAdd, kSub, kMul, kMax, kSum };
+
+  Kind kind;
+  float value;
+  // For kVar and kSum.
+  IterVar var;
+  // For kLoad.
+  std::shared_ptr<TensorNode> tensor;
+  // Row and column for kLoad, operands otherwise.
+  std::vector<Expr> args;
+};
+
+Expr operator+(const Expr &a, const Expr &b);
+
+Expr operator-(const Expr &a, const Expr &b);
+
+Expr operator*(const Expr &a, const Expr &b);
+
+Expr Max(const Expr &a, const Expr &b);
+
+// Sum over a reduction axis. Only allowed as the whole body of a compute.
+Expr Sum(const Expr &body, const IterVar &axis);
+
+struct TensorNode {
+  std::string name;
+  int rows;
+  int cols;
+  Layout layout;
+  // For computes: the row and column axes, and the value at (i, j).
+  IterVar axes[2];
+  std::shared_ptr<Expr> body;
+};
+
+class Tensor {
+ public:
+  explicit Tensor(std::shared_ptr<TensorNode> node) : node_(std::move(node)) {}
+
+  // Load the element at (row, col).
+  Expr operator()(const Expr &row, const Expr &col) const;
+
+  // 0 is the row axis, 1 the column axis.
+  const IterVar &axis(int index) const { return node_->axes[index]; }
+
+  const std::shared_ptr<TensorNode> &node() const { return node_; }
+
+ private:
+  std::shared_ptr<TensorNode> node_;
+};
+
+Tensor Placeholder(const std::string &name, int rows, int cols,
+                   Layout layout = Layout::kScalar);
+
+Tensor Compute(const std::string &name, int rows, int cols,
+               const std::function<Expr(IterVar, IterVar)> &f,
+               Layout layout = Layout::kScalar);
+
+/*!
+ * \brief How to turn a compute into a fragment shader.
+ *
+ * The row axis is always one per fragment. The column axis can only be split
+ * by 4 with the inner axis vectorized, for an output in Layout::kVec4.
+ * Reduction axes become loops, outermost first.
+ *
+ * A schedule never modifies the compute, so one compute can have several.
+ */
+class Schedule {
+ public:
+  // "axis" is iterated over as outer * factor + inner.
+  struct Split {
+    IterVar outer;
+    IterVar inner;
+    int factor;
+  };
+
+  explicit Schedule(const Tensor &output);
+
+  // Split "axis" into an outer and an inner axis of "factor" iterations.
+  // The extent must be a multiple of "factor", and the axis must not have
+  // been split by this schedule yet.
+  std::pair<IterVar, IterVar> Tile(const IterVar &axis, int factor);
+
+  // Emit the loop over "axis" fully unrolled.
+  void Unroll(const IterVar &axis);
+
+  // Compute the 4 iterations of "axis" at once, on vec4s. Loads of kVec4
+  // tensors along the axis become a single texelFetch; others are gathered.
+  // "axis" must be the innermost one.
+  void Vectorize(const IterVar &axis);
+
+  // At the start of each iteration of "at", load the elements of "tensor"
+  // that the loop inside it reads into a local array.
+  void CacheRead(const Tensor &tensor, const IterVar &at);
+
+  const TensorNode &output() const { return *output_; }
+
+  // How "axis" was split, or nullptr if it was not.
+  const Split *split(const IterVarNode *axis) const {
+    auto it = splits_.find(axis);
+    return it == splits_.end() ? nullptr : &it->second;
+  }
+
+  bool unrolled(const IterVarNode *axis) const {
+    return unrolled_.count(axis) != 0;
+  }
+
+  bool vectorized(const IterVarNode *axis) const {
+    return vectorized_.count(axis) != 0;
+  }
+
+  const std::vector<std::pair<std::shared_ptr<TensorNode>, IterVar>> &
+  cache_reads() const {
+    return cache_reads_;
+  }
+
+  // The fragment shader.
+  std::string Lower() const;
+
+ private:
+  std::shared_ptr<TensorNode> output_;
+  std::map<const IterVarNode *, Split> splits_;
+  std::set<const IterVarNode *> unrolled_;
+  std::set<const IterVarNode *> vectorized_;
+  std::vector<std::pair<std::shared_ptr<TensorNode>, IterVar>> cache_reads_;
+};
+
+}  // namespace te
+
+/*!
+ * The OpenGL workspace.
+ * This is a global singleton.
+ */
+class Workspace {
+ public:
+  // Get singleton instance.
+  static Workspace &GetInstance();
+
+  // Cannot be moved.
+  Workspace(Workspace &&other) = delete;
+
+  // Cannot be copied.
+  Workspace(const Workspace &other) = delete;
+
+  // Cannot be assigned.
+  Workspace &operator=(const Workspace &other) = delete;
+
+  ~Workspace();
+
+  // Compile a fragment shader and create a program.
+  Program CreateProgram(const char *fragment_shader_src);
+
+  // Same as CreateProgram, but only the first time a source is seen. The
+  // program lives as long as the workspace.
+  const Program &GetCachedProgram(const std::string &fragment_shader_src);
+
+  // Create a texture with the given data.
+  Texture CreateTexture(const GLfloat *data, GLsizei width, GLsizei height);
+
+  // Create a texture with the given storage type.
+  // data holds width * height * DType::kLanes values, or is nullptr.
+  template <typename DType>
+  TypedTexture<DType> CreateTexture(const typename DType::HostType *data,
+                                    GLsizei width, GLsizei height);
+
+  // Create a buffer texture of "width" texels, up to
+  // GL_MAX_TEXTURE_BUFFER_SIZE. Pass nullptr and use MapBuffer() to fill it
+  // in place.
+  template <typename DType>
+  TypedTexture<DType> CreateBufferTexture(
+      const typename DType::HostType *data, GLsizei width);
+
+  // Limit the GPU memory taken by textures to "bytes" (0 means no limit).
+  // When a texture does not fit, the least recently used textures are
+  // evicted to host memory and transparently uploaded again when used.
+  // Only the host layout of a texture survives eviction, e.g. just the red
+  // channel of a dtype::Float32 texture.
+  void SetMemoryBudget(size_t bytes);
+
+  size_t memory_budget() const { return memory_budget_; }
+
+  // GPU memory currently taken by resident textures.
+  size_t memory_used() const { return memory_used_; }
+
+  // Make the next "count" texture allocations fail as if the device were out
+  // of memory, to exercise eviction without exhausting a real device.
+  void FailAllocations(int count) { failing_allocations_ = count; }
+
+  // Create a persistently mapped staging ring of "capacity" bytes.
+  StagingRing CreateStagingRing(GLsizeiptr capacity);
+
+  // Upload texel data from a staging region into a texture.
+  // The region holds width x height texels in the texture's host layout
+  // (the TransferType of a TypedTexture).
+  // Asynchronous: the region is released once the GPU has consumed it.
+  void Upload(StagingRing *ring, const StagingRing::Region &region,
+              Texture *texture);
+
+  // Same as above, into a sub-rectangle of a 2D texture, or into texels
+  // [x, x + width) of a buffer texture.
+  void Upload(StagingRing *ring, const StagingRing::Region &region,
+              Texture *texture, GLint x, GLint y, GLsizei width,
+              GLsizei height);
+
+  // Same as above, with the region holding values of "type" rather than of
+  // the texture's own type. OpenGL converts, e.g. from GL_HALF_FLOAT into a
+  // float texture. Not for buffer textures.
+  void Upload(StagingRing *ring, const StagingRing::Region &region,
+              Texture *texture, GLint x, GLint y, GLsizei width,
+              GLsizei height, GLenum type);
+
+  // Read back a whole texture into a staging region.
+  // Asynchronous: call ring->Wait(region) before reading region.data.
+  void Download(const Texture &texture, StagingRing *ring,
+                const StagingRing::Region &region);
+
+  // Same as above, for a sub-rectangle, with the values converted to "type".
+  // Buffer textures can only be read as is, as a range of texels.
+  void Download(const Texture &texture, StagingRing *ring,
+                const StagingRing::Region &region, GLint x, GLint y,
+                GLsizei width, GLsizei height, GLenum type);
+
+  // Create a width x height texture from a tensor file, with the values
+  // streamed through "ring" in chunks of at most chunk_size bytes.
+  // Each page of the file is copied exactly once, into the staging memory.
+  // The file must hold TransferType values (see NpyDescr).
+  template <typename DType>
+  TypedTexture<DType> LoadTexture(const TensorFile &file, GLsizei width,
+                                  GLsizei height, StagingRing *ring,
+                                  size_t chunk_size = 4 << 20);
+
+  // Whether the context provides OpenGL major.minor.
+  bool HasVersion(GLint major, GLint minor);
+
+  // Whether the context provides the given extension.
+  bool HasExtension(const char *name);
+
+  // Create a quantized rows x cols matrix. cols must be a multiple of 4.
+  QuantizedTexture CreateQuantizedTexture(const GLubyte *data, GLsizei rows,
+                                          GLsizei cols,
+                                          const QuantParams &params);
+
+  // Pack an NHWC tensor. "nhwc" may be nullptr.
+  Nhwc4Tensor CreateNhwc4Tensor(const GLfloat *nhwc, GLsizei batch,
+                                GLsizei height, GLsizei width,
+                                GLsizei channels);
+
+  // Pack kernel_h x kernel_w x in_channels x out_channels (HWIO) weights,
+  // and out_channels biases.
+  Conv2dFilter CreateConv2dFilter(const GLfloat *hwio, const GLfloat *bias,
+                                  GLsizei kernel_h, GLsizei kernel_w,
+                                  GLsizei in_channels, GLsizei out_channels);
+
+  // Conv2d with square stride and zero padding. kAuto uses Winograd for 3x3
+  // stride 1 layers, with 2.25x fewer multiplies. Otherwise it uses im2col for
+  // kernels with several taps, as long as the im2col matrix fits in a texture
+  // and kMaxIm2colBytes; direct convolution otherwise, and for 1x1 kernels,
+  // which already read contiguous channels.
+  Nhwc4Tensor Conv2d(const Nhwc4Tensor &input, Conv2dFilter &filter,
+                     GLsizei stride, GLsizei padding,
+                     Conv2dAlgorithm algorithm = Conv2dAlgorithm::kAuto);
+
+  static const size_t kMaxIm2colBytes = 64 << 20;
+
+  // Pack a rows x cols matrix 4 columns per texel, for Gemv. The texture is
+  // (cols + 3) / 4 x rows, zero padded.
+  TypedTexture<dtype::Float32x4> CreateVec4Matrix(const GLfloat *data,
+                                                  GLsizei rows, GLsizei cols);
+
+  // y = A x, with A and x (a 1 x cols matrix) from CreateVec4Matrix, and y
+  // a rows x 1 texture (width rows). The reduction over A's columns is split
+  // across fragments, kGemvChunk texels each, whose partial sums are added up
+  // in a second pass, so a single output row still fills the device.
+  // The partial sums go to "scratch", from CreateGemvScratch, or to a
+  // temporary texture if it is null.
+  void Gemv(TypedTexture<dtype::Float32x4> *a,
+            TypedTexture<dtype::Float32x4> *x, Texture *y,
+            Texture *scratch = nullptr);
+
+  // Scratch space for repeated Gemv calls over matrices shaped like "a".
+  Texture CreateGemvScratch(const TypedTexture<dtype::Float32x4> &a);
+
+  static const GLsizei kGemvChunk = 64;
+
+  // Softmax over each row of a rows x cols (width x height) matrix.
+  void Softmax(Texture *input, Texture *output);
+
+  // Normalize each row to zero mean and unit variance, then scale and shift
+  // column c by gamma[c] and beta[c] (cols x 1 textures).
+  void LayerNorm(Texture *input, Texture *gamma, Texture *beta,
+                 GLfloat epsilon, Texture *output);
+
+  // Columns reduced by one fragment in row-wise reductions. Longer rows are
+  // reduced in several passes over chunks, with only cols / kRowChunk
+  // partial statistics written in between.
+  static const GLsizei kRowChunk = 256;
+
+  // Render to a texture.
+  void Render(const Program &program,
+              const std::vector<std::pair<std::string, Texture *>> &inputs,
+              const std::vector<std::pair<std::string, int>> &uniforms,
+              Texture *output,
+              int niters);
+
+  // Compile a program for Feedback(): a vertex shader, run once per element,
+  // and an optional geometry shader (nullptr for none), which may emit any
+  // number of points per element. Each of "varyings" is captured into its
+  // own buffer.
+  Program CreateFeedbackProgram(const char *vertex_shader_src,
+                                const char *geometry_shader_src,
+                                const std::vector<std::string> &varyings);
+
+  // Run a feedback program over "count" elements (gl_VertexID) without
+  // rasterizing, capturing the i-th varying into outputs[i], a buffer
+  // texture with one varying per texel. Unlike Render(), records can go
+  // anywhere and in any number, up to the outputs' width: this is for
+  // scatter, filtering and compaction. Outputs must not also be inputs.
+  // Returns the number of records written, which waits for the GPU.
+  GLuint Feedback(const Program &program,
+                  const std::vector<std::pair<std::string, Texture *>> &inputs,
+                  const std::vector<std::pair<std::string, int>> &uniforms,
+                  GLsizei count, const std::vector<Texture *> &outputs);
+
+  // Link a program for Scatter().
+  Program CreatePointProgram(const char *vertex_shader_src,
+                             const char *fragment_shader_src);
+
+  // Draw "count" points (gl_VertexID) into "output", each on the texel its
+  // vertex shader puts it, with additive blending: the fragment colors of
+  // points landing on the same texel are summed into it. This gives scatter
+  // accumulation without atomics. With "clear", output starts from zeros;
+  // otherwise the points are added to its content.
+  void Scatter(const Program &program,
+               const std::vector<std::pair<std::string, Texture *>> &inputs,
+               const std::vector<std::pair<std::string, int>> &uniforms,
+               GLsizei count, Texture *output, bool clear);
+
+  // output[indices[i]][d] += values[i][d], e.g. for embedding gradients.
+  // "indices" is an Int32 buffer texture of n rows, "values" an n x dim
+  // matrix (dim x n texels), and output a rows x dim matrix.
+  void ScatterAdd(TypedTexture<dtype::Int32> *indices, Texture *values,
+                  Texture *output);
+
+  // Count the occurrences of each value in [0, counts->width()) of an Int32
+  // buffer texture into "counts", a bins x 1 texture. Others are ignored.
+  void Histogram(TypedTexture<dtype::Int32> *values, Texture *counts);
+
+  // Two uninitialized width x height textures.
+  template <typename DType>
+  PingPong<DType> CreatePingPong(GLsizei width, GLsizei height);
+
+  // Sort the (key, value) pairs in the red and green of each texel along
+  // each row, by key then value, with a bitonic network: O(log^2 n) passes
+  // over the row length rounded up to a power of 2.
+  TypedTexture<dtype::Float32x4> SortRows(
+      TypedTexture<dtype::Float32x4> *pairs, bool descending);
+
+  // The k pairs with the largest keys of each row, in descending order, as
+  // a k x rows texture. Rows are sorted in blocks of k (rounded up to a
+  // power of 2), then pairs of blocks are merged down to one, halving the
+  // width each time, so only k pairs per row need to be read back.
+  TypedTexture<dtype::Float32x4> TopK(TypedTexture<dtype::Float32x4> *pairs,
+                                      GLsizei k);
+
+  // Prefix sums along each row of a rows x cols (width x height) matrix,
+  // inclusive or exclusive. Work-efficient: an up-sweep builds a pyramid of
+  // block sums, kScanRadix times narrower per level, and a down-sweep back
+  // through a ping-pong pair adds each block's prefix to its elements.
+  void ScanRows(Texture *input, Texture *output, bool inclusive);
+
+  // Prefix sums over a whole texture in row-major order, e.g. a large 1D
+  // tensor wrapped into rows: a row-wise scan, a scan of the row totals,
+  // and a pass adding those.
+  void Scan(Texture *input, Texture *output, bool inclusive);
+
+  static const GLsizei kScanRadix = 8;
+
+  // A complex copy of a real matrix, with zero imaginary parts.
+  TypedTexture<dtype::Complex64> ToComplex(Texture *real);
+
+  // Batched 1D FFT along each row, whose length must be a power of 2 (at
+  // least 2), or the inverse FFT (scaled by 1 / n). Runs Stockham passes of
+  // radix 4, and one of radix 2 when log2(n) is odd, through a ping-pong
+  // pair. Twiddle factors are computed once per length, into a texture
+  // kept until ReleaseFftTwiddles().
+  void FftRows(TypedTexture<dtype::Complex64> *input,
+               TypedTexture<dtype::Complex64> *output, bool inverse);
+
+  // 2D FFT: along rows, then along columns. Both sizes must be powers of 2,
+  // at least 2.
+  void Fft2d(TypedTexture<dtype::Complex64> *input,
+             TypedTexture<dtype::Complex64> *output, bool inverse);
+
+  // Delete the twiddle factor textures of every FFT length used so far.
+  // Later FFTs compute them again.
+  void ReleaseFftTwiddles() { fft_twiddles_.clear(); }
+
+  // Compact the elements x of "input" for which the GLSL expression
+  // "predicate" holds, e.g. "x > 0.0", into the front of "values", along
+  // with their positions into "indices". Order is preserved.
+  // Returns the number of elements kept. All are buffer textures.
+  GLuint Filter(TypedTexture<dtype::Float32> *input,
+                const std::string &predicate,
+                TypedTexture<dtype::Float32> *values,
+                TypedTexture<dtype::Int32> *indices);
+
+  // Render to a texture once, without waiting for the GPU, so that later
+  // passes and transfers queue up behind it. Nothing is printed.
+  void Dispatch(const Program &program,
+                const std::vector<std::pair<std::string, Texture *>> &inputs,
+                const std::vector<std::pair<std::string, int>> &uniforms,
+                Texture *output);
+
+  // Same as above, only drawing the width x height rectangle at (x, y).
+  // gl_FragCoord still counts from the corner of the whole output.
+  void Dispatch(const Program &program,
+                const std::vector<std::pair<std::string, Texture *>> &inputs,
+                const std::vector<std::pair<std::string, int>> &uniforms,
+                Texture *output, GLint x, GLint y, GLsizei width,
+                GLsizei height);
+
+  // Render to a texture, with inputs given as views.
+  // For each view "X", the program gets the uniforms X_offset, X_row_stride,
+  // X_col_stride, X_rows and X_cols along with the sampler X.
+  void Render(const Program &program,
+              const std::vector<std::pair<std::string, TextureView>> &inputs,
+              const std::vector<std::pair<std::string, int>> &uniforms,
+              Texture *output,
+              int niters);
+
+  // Render to the main window.
+  // This is for debugging purposes.
+  void Render(const Program &program,
+              const std::vector<std::pair<std::string, Texture *>> &inputs);
+
+  static const int kWindowWidth = 640;
+
+  static const int kWindowHeight = 480;
+
+ private:
+  friend class Texture;
+
+  explicit Workspace();
+
+  GLuint NumTextureUnits();
+
+  void BindTextureUnit(GLuint unit, GLuint texture);
+
+  void BindTextureUnit(GLuint unit, GLenum target, GLuint texture);
+
+  void BindTextureUnit(GLuint unit, const Texture &texture);
+
+  GLuint CreateShader(GLenum shader_kind, const char *shader_src);
+
+  Program CreateProgram(GLuint fragment_shader);
+
+  // Link "shaders" into a program, capturing "varyings" with transform
+  // feedback, if any.
+  GLuint LinkProgram(const std::vector<GLuint> &shaders,
+                     const std::vector<std::string> &varyings);
+
+  // Use the program and set its samplers and uniforms.
+  void BindInputs(const Program &program,
+                  const std::vector<std::pair<std::string, Texture *>> &inputs,
+                  const std::vector<std::pair<std::string, int>> &uniforms);
+
+  // Bind the program, inputs, uniforms and a frame buffer on "output" for
+  // drawing. Returns the frame buffer, to be passed to EndPass().
+  GLuint BeginPass(const Program &program,
+                   const std::vector<std::pair<std::string, Texture *>> &inputs,
+                   const std::vector<std::pair<std::string, int>> &uniforms,
+                   Texture *output);
+
+  void EndPass(const std::vector<std::pair<std::string, Texture *>> &inputs,
+               Texture *output, GLuint frame_buffer);
+
+  // Copy rows of "pairs" into the front of a new ping-pong pair of
+  // "width" columns, padded with pairs that sort last.
+  PingPong<dtype::Float32x4> PadRows(TypedTexture<dtype::Float32x4> *pairs,
+                                     GLsizei width, bool descending);
+
+  // Run the bitonic passes j = j_start, ..., 1 of stage k over the first
+  // "width" columns.
+  void BitonicMerge(PingPong<dtype::Float32x4> *pairs, GLsizei width,
+                    GLsizei k, GLsizei j_start, bool descending);
+
+  // Copy the first "width" columns of the front texture.
+  TypedTexture<dtype::Float32x4> CropRows(PingPong<dtype::Float32x4> *pairs,
+                                          GLsizei width);
+
+  // FFT along axis 0 (rows) or 1 (columns).
+  void Fft(TypedTexture<dtype::Complex64> *input,
+           TypedTexture<dtype::Complex64> *output, int axis, bool inverse);
+
+  // Reduce each row of "input" to a single texel of statistics with a
+  // *_stats_shader_text program. "partials" tells whether "input" holds
+  // values or statistics from a previous pass.
+  TypedTexture<dtype::Float32x4> RowStats(const Program &program,
+                                          Texture *input, int partials = 0);
+
+  // Register a new resident texture as the most recently used.
+  void Track(Texture *texture);
+
+  void Untrack(Texture *texture);
+
+  // Make sure a texture is resident, and mark it as the most recently used.
+  void MakeResident(const Texture &texture);
+
+  // Pinned textures are never evicted. Pinning makes a texture resident.
+  void Pin(const Texture &texture);
+
+  void Unpin(const Texture &texture);
+
+  // A point program with point_fragment_shader_text, linked on first use.
+  const Program &GetCachedPointProgram(const char *vertex_shader_src);
+
+  // Evict textures until "bytes" more fit in the budget.
+  void Reserve(size_t bytes);
+
+  // Evict the least recently used unpinned texture.
+  // Returns false when there is none.
+  bool EvictOne();
+
+  size_t memory_budget_ = 0;
+  size_t memory_used_ = 0;
+  int failing_allocations_ = 0;
+
+  // Most recently used first.
+  std::list<Texture *> lru_;
+
+  // By fragment shader source, see GetCachedProgram.
+  std::map<std::string, Program> programs_;
+
+  // By predicate, see Filter.
+  std::map<std::string, Program> filter_programs_;
+
+  // By vertex shader source, see GetCachedPointProgram.
+  std::map<std::string, Program> point_programs_;
+
+  // By length, see FftRows.
+  std::map<GLsizei, TypedTexture<dtype::Complex64>> fft_twiddles_;
+
+  // Don't need to change this.
+  // We want to draw 2 giant triangles that cover the whole screen.
+  struct Vertex {
+    float x, y;
+  };
+
+  static constexpr size_t kNumVertices = 6;
+
+  static const Vertex vertices[kNumVertices];
+
+  static const char *vertex_shader_text_;
+
+  // For the full-screen triangles.
+  GLuint vertex_array_;
+
+  // Feedback and point passes fetch their inputs from textures, without
+  // attributes.
+  GLuint empty_vertex_array_;
+
+ public:
+  GLFWwindow *window_;
+  GLuint vertex_shader_;
+};
+
+void TestRenderToWindow() {
+  Workspace &workspace = Workspace::GetInstance();
+
+  GLint width, height;
+  glfwGetFramebufferSize(workspace.window_, &width, &height);
+
+  auto texture_size = static_cast<size_t>(width) * height;
+
+  std::vector<GLfloat> texture0_data(texture_size, 0.25f);
+  auto texture0 = workspace.CreateTexture(texture0_data.data(), width, height);
+
+  std::vector<GLfloat> texture1_data(texture_size, 0.25f);
+  auto texture1 = workspace.CreateTexture(texture1_data.data(), width, height);
+
+  Program program = workspace.CreateProgram(fragment_shader_text);
+
+  while (glfwWindowShouldClose(workspace.window_) == GL_FALSE) {
+    workspace.Render(
+        program, {
+            {"texture0", &texture0},
+            {"texture1", &texture1}
+        }
+    );
+    glfwSwapBuffers(workspace.window_);
+    glfwPollEvents();
+  }
+}
+
+// Host buffers come from "arena", which is reset for every call.
+void TestRenderToTexture(HostArena *arena, int N, int niters) {
+  Workspace &workspace = Workspace::GetInstance();
+
+  arena->Reset();
+
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(1.0f, 2.0f);
+
+  GLint width = N * N;
+  GLint height = 1;
+  auto texture_size = static_cast<size_t>(width) * height;
+
+  GLfloat *texture0_data = arena->Allocate<GLfloat>(texture_size);
+  for (size_t i = 0; i != texture_size; ++i) {
+    texture0_data[i] = dist(mt);
+  }
+  auto texture0 = workspace.CreateTexture(texture0_data, width, height);
+
+  GLfloat *texture1_data = arena->Allocate<GLfloat>(texture_size);
+  for (size_t i = 0; i != texture_size; ++i) {
+    texture1_data[i] = dist(mt);
+  }
+  auto texture1 = workspace.CreateTexture(texture1_data, width, height);
+
+  Program program = workspace.CreateProgram(fragment_shader_text);
+
+  auto target_texture = workspace.CreateTexture(nullptr, width, height);
+
+  workspace.Render(
+      program, {
+          {"A", &texture0},
+          {"B", &texture1}
+      }, {
+          {"N", N}
+      },
+      &target_texture,
+      niters
+  );
+
+  GLfloat *retrieved_data = arena->Allocate<GLfloat>(texture_size);
+  target_texture.GetData(retrieved_data);
+
+  GLfloat *cpu_result = arena->Allocate<GLfloat>(texture_size);
+  auto cpu_start = std::chrono::system_clock::now();
+  for (int iter = 0; iter < niters; ++iter) {
+    for (int row = 0; row != N; ++row) {
+      for (int col = 0; col != N; ++col) {
+        cpu_result[row * N + col] = 0.0f;
+        for (int i = 0; i != N; ++i) {
+          GLfloat a = texture0_data[row * N + i];
+          GLfloat b = texture1_data[i * N + col];
+          cpu_result[row * N + col] += a * b;
+        }
+      }
+    }
+  }
+  auto cpu_end = std::chrono::system_clock::now();
+
+  for (size_t i = 0; i < texture_size; ++i) {
+    assert(std::abs(retrieved_data[i] - cpu_result[i]) < 0.001f);
+  }
+
+  std::cout << "cpu:    "
+            << (std::chrono::duration_cast<std::chrono::microseconds>(cpu_end - cpu_start).count() / niters)
+            << std::endl;
+}
+
+// Same as TestRenderToTexture, but with fp16 operands.
+void TestRenderToTextureFp16(int N, int niters) {
+  Workspace &workspace = Workspace::GetInstance();
+
+  assert(N % 4 == 0);
+
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(1.0f, 2.0f);
+
+  auto size = static_cast<size_t>(N) * N;
+
+  // A is row-major, B is stored transposed.
+  std::vector<GLfloat> a_data(size);
+  std::vector<GLfloat> bt_data(size);
+  for (size_t i = 0; i != size; ++i) {
+    a_data[i] = dist(mt);
+    bt_data[i] = dist(mt);
+  }
+
+  auto a = workspace.CreateTexture<dtype::Float16x4>(a_data.data(), N * N / 4,
+                                                      1);
+  auto bt = workspace.CreateTexture<dtype::Float16x4>(bt_data.data(),
+                                                       N * N / 4, 1);
+
+  // The reference uses the values the GPU actually sees.
+  a.GetData(a_data.data());
+  bt.GetData(bt_data.data());
+
+  Program program = workspace.CreateProgram(matmul_fp16_shader_text);
+
+  auto target_texture = workspace.CreateTexture(nullptr, N * N, 1);
+
+  workspace.Render(
+      program, {
+          {"A", &a},
+          {"BT", &bt}
+      }, {
+          {"N", N}
+      },
+      &target_texture,
+      niters
+  );
+
+  std::vector<GLfloat> retrieved_data(size);
+  target_texture.GetData(retrieved_data.data());
+
+  for (int row = 0; row != N; ++row) {
+    for (int col = 0; col != N; ++col) {
+      GLfloat expected = 0.0f;
+      for (int i = 0; i != N; ++i) {
+        expected += a_data[row * N + i] * bt_data[col * N + i];
+      }
+      GLfloat actual = retrieved_data[row * N + col];
+      assert(std::abs(actual - expected) < 1e-5f * N * std::abs(expected));
+    }
+  }
+}
+
+// C = A * B with A quantized per tensor and B quantized per output column.
+void TestQuantizedMatmul(int N, int niters) {
+  Workspace &workspace = Workspace::GetInstance();
+
+  assert(N % 4 == 0);
+
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.0f, 2.0f);
+
+  auto size = static_cast<size_t>(N) * N;
+
+  // A is row-major, B is stored transposed.
+  std::vector<GLfloat> a_data(size);
+  std::vector<GLfloat> bt_data(size);
+  for (size_t i = 0; i != size; ++i) {
+    a_data[i] = dist(mt);
+    bt_data[i] = dist(mt);
+  }
+
+  std::vector<GLubyte> a_quantized(size);
+  QuantParams a_params = Quantize(a_data.data(), N, N, /*per_channel=*/false,
+                                  a_quantized.data());
+  std::vector<GLubyte> bt_quantized(size);
+  QuantParams bt_params = Quantize(bt_data.data(), N, N, /*per_channel=*/true,
+                                   bt_quantized.data());
+
+  auto a = workspace.CreateQuantizedTexture(a_quantized.data(), N, N,
+                                            a_params);
+  auto bt = workspace.CreateQuantizedTexture(bt_quantized.data(), N, N,
+                                             bt_params);
+
+  Program program = workspace.CreateProgram(matmul_int8_shader_text);
+
+  auto target_texture = workspace.CreateTexture(nullptr, N * N, 1);
+
+  workspace.Render(
+      program, {
+          {"A", &a.data()},
+          {"BT", &bt.data()},
+          {"AParams", &a.params()},
+          {"BTParams", &bt.params()}
+      }, {
+          {"A_per_channel", a.per_channel()},
+          {"BT_per_channel", bt.per_channel()},
+          {"N", N},
+          {"K", N}
+      },
+      &target_texture,
+      niters
+  );
+
+  std::vector<GLfloat> retrieved_data(size);
+  target_texture.GetData(retrieved_data.data());
+
+  // Compare against the dequantized operands.
+  for (int row = 0; row != N; ++row) {
+    for (int col = 0; col != N; ++col) {
+      GLfloat expected = 0.0f;
+      for (int i = 0; i != N; ++i) {
+        GLfloat a_value = a_params.scales[0]
+            * (a_quantized[row * N + i] - a_params.zero_points[0]);
+        GLfloat b_value = bt_params.scales[col]
+            * (bt_quantized[col * N + i] - bt_params.zero_points[col]);
+        expected += a_value * b_value;
+      }
+      GLfloat actual = retrieved_data[row * N + col];
+      assert(std::abs(actual - expected) < 1e-3f * N);
+    }
+  }
+}
+
+// Same as TestRenderToTexture, but A and B are buffer textures.
+// A is filled in place through a mapping.
+void TestRenderToBufferTexture(int N, int niters) {
+  Workspace &workspace = Workspace::GetInstance();
+
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(1.0f, 2.0f);
+
+  auto size = static_cast<size_t>(N) * N;
+
+  std::vector<GLfloat> a_data(size);
+  std::vector<GLfloat> b_data(size);
+  for (size_t i = 0; i != size; ++i) {
+    a_data[i] = dist(mt);
+    b_data[i] = dist(mt);
+  }
+
+  auto a = workspace.CreateBufferTexture<dtype::Float32>(nullptr, N * N);
+  GLfloat *a_mapped = a.MapBuffer();
+  std::copy(a_data.begin(), a_data.end(), a_mapped);
+  a.UnmapBuffer();
+
+  auto b = workspace.CreateBufferTexture<dtype::Float32>(b_data.data(), N * N);
+
+  Program program = workspace.CreateProgram(matmul_buffer_shader_text);
+
+  auto target_texture = workspace.CreateTexture(nullptr, N, N);
+
+  workspace.Render(
+      program, {
+          {"A", &a},
+          {"B", &b}
+      }, {
+          {"N", N}
+      },
+      &target_texture,
+      niters
+  );
+
+  std::vector<GLfloat> retrieved_data(size);
+  target_texture.GetData(retrieved_data.data());
+
+  for (int row = 0; row != N; ++row) {
+    for (int col = 0; col != N; ++col) {
+      GLfloat expected = 0.0f;
+      for (int i = 0; i != N; ++i) {
+        expected += a_data[row * N + i] * b_data[i * N + col];
+      }
+      assert(std::abs(retrieved_data[row * N + col] - expected) < 0.001f);
+    }
+  }
+}
+
+// Same as TestRenderToTexture, but every transfer goes through a staging ring.
+void TestStagingRing(int N, int niters) {
+  Workspace &workspace = Workspace::GetInstance();
+
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(1.0f, 2.0f);
+
+  auto size = static_cast<size_t>(N) * N;
+  auto bytes = static_cast<GLsizeiptr>(size * sizeof(GLfloat));
+
+  StagingRing ring = workspace.CreateStagingRing(4 * bytes
+                                                 + 4 * StagingRing::kAlignment);
+
+  auto a = workspace.CreateTexture(nullptr, N * N, 1);
+  auto b = workspace.CreateTexture(nullptr, N * N, 1);
+
+  // Written in place, without any GL call.
+  StagingRing::Region a_region = ring.Acquire(bytes);
+  StagingRing::Region b_region = ring.Acquire(bytes);
+  auto a_data = static_cast<GLfloat *>(a_region.data);
+  auto b_data = static_cast<GLfloat *>(b_region.data);
+  for (size_t i = 0; i != size; ++i) {
+    a_data[i] = dist(mt);
+    b_data[i] = dist(mt);
+  }
+
+  workspace.Upload(&ring, a_region, &a);
+  workspace.Upload(&ring, b_region, &b);
+
+  Program program = workspace.CreateProgram(fragment_shader_text);
+
+  auto target_texture = workspace.CreateTexture(nullptr, N * N, 1);
+
+  workspace.Render(
+      program, {
+          {"A", &a},
+          {"B", &b}
+      }, {
+          {"N", N}
+      },
+      &target_texture,
+      niters
+  );
+
+  StagingRing::Region result_region = ring.Acquire(bytes);
+  workspace.Download(target_texture, &ring, result_region);
+  ring.Wait(result_region);
+  auto result = static_cast<const GLfloat *>(result_region.data);
+
+  for (int row = 0; row != N; ++row) {
+    for (int col = 0; col != N; ++col) {
+      GLfloat expected = 0.0f;
+      for (int i = 0; i != N; ++i) {
+        expected += a_data[row * N + i] * b_data[i * N + col];
+      }
+      assert(std::abs(result[row * N + col] - expected) < 0.001f);
+    }
+  }
+
+  ring.Release(result_region);
+}
+
+// Run two independent matmuls under a budget that only fits one at a time.
+void TestMemoryBudget(int N) {
+  Workspace &workspace = Workspace::GetInstance();
+
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(1.0f, 2.0f);
+
+  auto size = static_cast<size_t>(N) * N;
+
+  std::vector<std::vector<GLfloat>> data(4, std::vector<GLfloat>(size));
+  for (auto &matrix : data) {
+    for (auto &value : matrix) {
+      value = dist(mt);
+    }
+  }
+
+  auto a0 = workspace.CreateTexture(data[0].data(), N * N, 1);
+  workspace.SetMemoryBudget(3 * a0.bytes());
+
+  auto b0 = workspace.CreateTexture(data[1].data(), N * N, 1);
+  auto a1 = workspace.CreateTexture(data[2].data(), N * N, 1);
+  auto b1 = workspace.CreateTexture(data[3].data(), N * N, 1);
+  assert(!a0.resident());
+
+  Program program = workspace.CreateProgram(fragment_shader_text);
+
+  auto c0 = workspace.CreateTexture(nullptr, N * N, 1);
+  auto c1 = workspace.CreateTexture(nullptr, N * N, 1);
+  assert(workspace.memory_used() <= workspace.memory_budget());
+
+  workspace.Render(program, {{"A", &a0}, {"B", &b0}}, {{"N", N}}, &c0, 1);
+  workspace.Render(program, {{"A", &a1}, {"B", &b1}}, {{"N", N}}, &c1, 1);
+
+  std::vector<GLfloat> c0_data(size);
+  c0.GetData(c0_data.data());
+  std::vector<GLfloat> c1_data(size);
+  c1.GetData(c1_data.data());
+
+  for (int row = 0; row != N; ++row) {
+    for (int col = 0; col != N; ++col) {
+      GLfloat expected0 = 0.0f;
+      GLfloat expected1 = 0.0f;
+      for (int i = 0; i != N; ++i) {
+        expected0 += data[0][row * N + i] * data[1][i * N + col];
+        expected1 += data[2][row * N + i] * data[3][i * N + col];
+      }
+      assert(std::abs(c0_data[row * N + col] - expected0) < 0.001f);
+      assert(std::abs(c1_data[row * N + col] - expected1) < 0.001f);
+    }
+  }
+
+  workspace.SetMemoryBudget(0);
+}
+
+// Allocations that run out of device memory evict other textures and retry.
+void TestOutOfMemory(int N) {
+  Workspace &workspace = Workspace::GetInstance();
+
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(1.0f, 2.0f);
+
+  auto size = static_cast<size_t>(N) * N;
+
+  std::vector<std::vector<GLfloat>> data(4, std::vector<GLfloat>(size));
+  for (auto &matrix : data) {
+    for (auto &value : matrix) {
+      value = dist(mt);
+    }
+  }
+
+  auto a = workspace.CreateTexture(data[0].data(), N, N);
+  auto b = workspace.CreateBufferTexture<dtype::Float32>(
+      data[1].data(), static_cast<GLsizei>(size));
+
+  // Evicting "a" reads it back through the unit "c" is bound to.
+  workspace.FailAllocations(1);
+  auto c = workspace.CreateTexture(data[2].data(), N, N);
+  assert(!a.resident() && c.resident());
+
+  // Evicting "b" binds it as the buffer "d" is being allocated in.
+  workspace.FailAllocations(1);
+  auto d = workspace.CreateBufferTexture<dtype::Float32>(
+      data[3].data(), static_cast<GLsizei>(size));
+  assert(!b.resident() && d.resident());
+
+  std::vector<GLfloat> result(size);
+  a.GetData(result.data());
+  assert(result == data[0]);
+  b.GetData(result.data());
+  assert(result == data[1]);
+  c.GetData(result.data());
+  assert(result == data[2]);
+  d.GetData(result.data());
+  assert(result == data[3]);
+}
+
+// C = A * B, then D = A * C, with mirrored tensors.
+// A is only uploaded once, and C is never downloaded.
+void TestMirroredTensor(int N) {
+  Workspace &workspace = Workspace::GetInstance();
+
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+
+  auto size = static_cast<size_t>(N) * N;
+
+  MirroredTensor<dtype::Float32> a(N * N, 1);
+  MirroredTensor<dtype::Float32> b(N * N, 1);
+  MirroredTensor<dtype::Float32> c(N * N, 1);
+  MirroredTensor<dtype::Float32> d(N * N, 1);
+
+  GLfloat *a_data = a.mutable_host_data();
+  GLfloat *b_data = b.mutable_host_data();
+  for (size_t i = 0; i != size; ++i) {
+    a_data[i] = dist(mt);
+    b_data[i] = dist(mt);
+  }
+
+  Program program = workspace.CreateProgram(fragment_shader_text);
+
+  workspace.Render(program, {{"A", a.device()}, {"B", b.device()}},
+                   {{"N", N}}, c.mutable_device(), 1);
+  workspace.Render(program, {{"A", a.device()}, {"B", c.device()}},
+                   {{"N", N}}, d.mutable_device(), 1);
+
+  const GLfloat *d_data = d.host_data();
+
+  assert(a.num_uploads() == 1 && b.num_uploads() == 1);
+  assert(c.num_uploads() == 0 && c.num_downloads() == 0);
+  assert(d.num_downloads() == 1);
+
+  std::vector<GLfloat> c_expected(size, 0.0f);
+  for (int row = 0; row != N; ++row) {
+    for (int col = 0; col != N; ++col) {
+      for (int i = 0; i != N; ++i) {
+        c_expected[row * N + col] += a_data[row * N + i] * b_data[i * N + col];
+      }
+    }
+  }
+  for (int row = 0; row != N; ++row) {
+    for (int col = 0; col != N; ++col) {
+      GLfloat expected = 0.0f;
+      for (int i = 0; i != N; ++i) {
+        expected += a_data[row * N + i] * c_expected[i * N + col];
+      }
+      assert(std::abs(d_data[row * N + col] - expected)
+             < 1e-5f * N * N * std::abs(expected));
+    }
+  }
+}
+
+// C = A[0:N/2, :] * A^T[:, N/2:N], without materializing either operand.
+void TestTextureView(int N, int niters) {
+  Workspace &workspace = Workspace::GetInstance();
+
+  assert(N % 2 == 0);
+
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(1.0f, 2.0f);
+
+  auto size = static_cast<size_t>(N) * N;
+
+  std::vector<GLfloat> a_data(size);
+  for (auto &value : a_data) {
+    value = dist(mt);
+  }
+
+  auto a = workspace.CreateTexture(a_data.data(), N * N, 1);
+  TextureView a_view = TextureView::Matrix(&a, N, N);
+
+  Program program = workspace.CreateProgram(matmul_view_shader_text);
+
+  int M = N / 2;
+  auto target_texture = workspace.CreateTexture(nullptr, M, M);
+
+  workspace.Render(
+      program, {
+          {"A", a_view.Slice(0, M, 0, N)},
+          {"B", a_view.Transpose().Slice(0, N, M, N)}
+      },
+      {},
+      &target_texture,
+      niters
+  );
+
+  std::vector<GLfloat> retrieved_data(static_cast<size_t>(M) * M);
+  target_texture.GetData(retrieved_data.data());
+
+  for (int row = 0; row != M; ++row) {
+    for (int col = 0; col != M; ++col) {
+      GLfloat expected = 0.0f;
+      for (int i = 0; i != N; ++i) {
+        expected += a_data[row * N + i] * a_data[(M + col) * N + i];
+      }
+      assert(std::abs(retrieved_data[row * M + col] - expected) < 0.001f);
+    }
+  }
+}
+
+// Write a .npy file and stream it into a texture.
+void TestLoadTexture(int N, const std::string &path) {
+  Workspace &workspace = Workspace::GetInstance();
+
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(1.0f, 2.0f);
+
+  auto size = static_cast<size_t>(N) * N;
+
+  std::vector<GLfloat> data(size);
+  for (auto &value : data) {
+    value = dist(mt);
+  }
+
+  // A version 1.0 header, padded with spaces to a multiple of 64 bytes.
+  std::string header = "{'descr': '<f4', 'fortran_order': False, 'shape': ("
+                       + std::to_string(N) + ", " + std::to_string(N)
+                       + "), }";
+  header.resize((header.size() + 11 + 63) / 64 * 64 - 11, ' ');
+  header += '\n';
+
+  std::ofstream out(path, std::ios::binary);
+  out.write("\x93NUMPY\x01\x00", 8);
+  auto header_size = static_cast<uint16_t>(header.size());
+  char header_size_bytes[2] = {static_cast<char>(header_size & 0xff),
+                               static_cast<char>(header_size >> 8)};
+  out.write(header_size_bytes, 2);
+  out.write(header.data(), static_cast<std::streamsize>(header.size()));
+  out.write(reinterpret_cast<const char *>(data.data()),
+            static_cast<std::streamsize>(size * sizeof(GLfloat)));
+  out.close();
+
+  TensorFile file = TensorFile::OpenNpy(path);
+  assert(file.shape().size() == 2 && file.num_values() == size);
+
+  // Small chunks, to exercise chunking within and across rows.
+  StagingRing ring = workspace.CreateStagingRing(1 << 20);
+  auto a = workspace.LoadTexture<dtype::Float32>(file, N, N, &ring,
+                                                  /*chunk_size=*/N * 12);
+  auto b = workspace.LoadTexture<dtype::Float32>(file, N * N, 1, &ring,
+                                                  /*chunk_size=*/N * 12);
+
+  std::vector<GLfloat> retrieved_data(size);
+  a.GetData(retrieved_data.data());
+  assert(retrieved_data == data);
+  b.GetData(retrieved_data.data());
+  assert(retrieved_data == data);
+
+  std::remove(path.c_str());
+
+  // The same values without a header.
+  std::string raw_path = path + ".raw";
+  std::ofstream raw_out(raw_path, std::ios::binary);
+  raw_out.write(reinterpret_cast<const char *>(data.data()),
+                static_cast<std::streamsize>(size * sizeof(GLfloat)));
+  raw_out.close();
+
+  TensorFile raw_file = TensorFile::OpenRaw(
+      raw_path, "<f4", {static_cast<size_t>(N), static_cast<size_t>(N)});
+  assert(raw_file.num_values() == size);
+  assert(raw_file.values_size() == size * sizeof(GLfloat));
+  auto c = workspace.LoadTexture<dtype::Float32>(raw_file, N, N, &ring,
+                                                  /*chunk_size=*/N * 12);
+  c.GetData(retrieved_data.data());
+  assert(retrieved_data == data);
+
+  std::remove(raw_path.c_str());
+}
+
+// d = relu(a * b) + c must run as a single kernel.
+void TestTensorExpression(int N) {
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+  auto size = static_cast<size_t>(N) * N;
+  std::vector<GLfloat> a_data(size);
+  std::vector<GLfloat> b_data(size);
+  std::vector<GLfloat> c_data(N);
+  for (size_t i = 0; i != size; ++i) {
+    a_data[i] = dist(mt);
+    b_data[i] = dist(mt);
+  }
+  for (auto &value : c_data) {
+    value = dist(mt);
+  }
+
+  Tensor a = Tensor::FromData(a_data.data(), N, N);
+  Tensor b = Tensor::FromData(b_data.data(), N, N);
+  // A bias row, broadcast over the rows.
+  Tensor c = Tensor::FromData(c_data.data(), 1, N);
+
+  Tensor d = a.matmul(b).relu() + c;
+  assert(Tensor::Compile({d}).kernels().size() == 1);
+
+  // The matmul is used twice, so it gets its own texture.
+  Tensor ab = a.matmul(b);
+  Tensor e = ab.relu() * 0.5f - ab;
+  assert(Tensor::Compile({e}).kernels().size() == 2);
+
+  std::vector<GLfloat> d_result(size);
+  std::vector<GLfloat> e_result(size);
+  d.GetData(d_result.data());
+  e.GetData(e_result.data());
+
+  for (int row = 0; row != N; ++row) {
+    for (int col = 0; col != N; ++col) {
+      GLfloat sum = 0.0f;
+      for (int i = 0; i != N; ++i) {
+        sum += a_data[row * N + i] * b_data[i * N + col];
+      }
+      GLfloat d_expected = std::max(sum, 0.0f) + c_data[col];
+      GLfloat e_expected = std::max(sum, 0.0f) * 0.5f - sum;
+      assert(std::abs(d_result[row * N + col] - d_expected) < 1e-4f * N);
+      assert(std::abs(e_result[row * N + col] - e_expected) < 1e-4f * N);
+    }
+  }
+
+  // Materialized tensors are leaves from now on.
+  assert(Tensor::Compile({d + e}).kernels().size() == 1);
+}
+
+// Compile y = relu(x * (w1 * w2)) twice over, plus a dead kernel, and check
+// that optimizing leaves a single kernel that still computes y.
+void TestGraphOptimizer(int N) {
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+  auto size = static_cast<size_t>(N) * N;
+  std::vector<GLfloat> w1_data(size);
+  std::vector<GLfloat> w2_data(size);
+  std::vector<GLfloat> x_data(size);
+  for (size_t i = 0; i != size; ++i) {
+    w1_data[i] = dist(mt);
+    w2_data[i] = dist(mt);
+    x_data[i] = dist(mt);
+  }
+
+  Tensor x = Tensor::Placeholder(N, N);
+  Tensor w = Tensor::FromData(w1_data.data(), N, N)
+      .matmul(Tensor::FromData(w2_data.data(), N, N));
+  Tensor y1 = x.matmul(w).relu();
+  Tensor y2 = x.matmul(w).relu();
+
+  KernelGraph graph = Tensor::Compile({y1, y2}, {x});
+
+  // Same as y1, but only over part of the reduction, and never read.
+  KernelGraph::Kernel dead = graph.kernels().back();
+  dead.uniforms[0].second = N - 1;
+  dead.output = graph.AddIntermediate(N, N);
+  graph.AddKernel(dead);
+  assert(graph.kernels().size() == 4);
+
+  assert(graph.EliminateCommonSubexpressions() == 1);
+  assert(graph.FoldConstants() == 1);
+  assert(graph.EliminateDeadKernels() == 1);
+  assert(graph.kernels().size() == 1);
+  assert(graph.outputs()[0] == graph.outputs()[1]);
+
+  auto &workspace = Workspace::GetInstance();
+  graph.Bind(0, std::make_shared<Texture>(
+      workspace.CreateTexture(x_data.data(), N, N)));
+  graph.Run();
+
+  std::vector<GLfloat> result(size);
+  graph.texture(graph.outputs()[0])->GetData(result.data());
+
+  for (int row = 0; row != N; ++row) {
+    for (int col = 0; col != N; ++col) {
+      GLfloat sum = 0.0f;
+      for (int i = 0; i != N; ++i) {
+        GLfloat w_value = 0.0f;
+        for (int j = 0; j != N; ++j) {
+          w_value += w1_data[i * N + j] * w2_data[j * N + col];
+        }
+        sum += x_data[row * N + i] * w_value;
+      }
+      assert(std::abs(result[row * N + col] - std::max(sum, 0.0f))
+             < 1e-4f * N * N);
+    }
+  }
+}
+
+// An MLP with a skip connection, with layers of different widths.
+// Its activations should pack into little more than the peak live memory.
+void TestMemoryPlanner(int N) {
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+  const std::vector<int> widths = {N, 2 * N, N / 2, N, 3 * N, N};
+
+  std::vector<std::vector<GLfloat>> weights;
+  std::vector<Tensor> w;
+  for (size_t i = 0; i + 1 < widths.size(); ++i) {
+    weights.emplace_back(static_cast<size_t>(widths[i]) * widths[i + 1]);
+    for (auto &value : weights.back()) {
+      value = dist(mt) / widths[i];
+    }
+    w.push_back(Tensor::FromData(weights.back().data(), widths[i],
+                                 widths[i + 1]));
+  }
+
+  Tensor x = Tensor::Placeholder(N, N);
+  Tensor h = x;
+  Tensor skip = x;
+  for (size_t i = 0; i != w.size(); ++i) {
+    h = h.matmul(w[i]).relu();
+    if (widths[i + 1] == N) {
+      h = h + skip;
+      skip = h;
+    }
+  }
+
+  KernelGraph graph = Tensor::Compile({h}, {x});
+  graph.Optimize();
+  graph.Plan();
+  assert(graph.arena_bytes() <= 2 * graph.peak_live_bytes());
+
+  std::vector<GLfloat> x_data(static_cast<size_t>(N) * N);
+  for (auto &value : x_data) {
+    value = dist(mt);
+  }
+  auto &workspace = Workspace::GetInstance();
+  graph.Bind(0, std::make_shared<Texture>(
+      workspace.CreateTexture(x_data.data(), N, N)));
+
+  // Nothing gets allocated when running.
+  size_t memory_used = workspace.memory_used();
+  graph.Run();
+  graph.Run();
+  assert(workspace.memory_used() == memory_used);
+
+  std::vector<GLfloat> result(x_data.size());
+  graph.texture(graph.outputs()[0])->GetData(result.data());
+
+  // The same on the CPU.
+  std::vector<GLfloat> expected = x_data;
+  std::vector<GLfloat> skip_data = x_data;
+  for (size_t i = 0; i != w.size(); ++i) {
+    int in = widths[i];
+    int out = widths[i + 1];
+    std::vector<GLfloat> next(static_cast<size_t>(N) * out);
+    for (int row = 0; row != N; ++row) {
+      for (int col = 0; col != out; ++col) {
+        GLfloat sum = 0.0f;
+        for (int j = 0; j != in; ++j) {
+          sum += expected[row * in + j] * weights[i][j * out + col];
+        }
+        next[row * out + col] = std::max(sum, 0.0f);
+      }
+    }
+    if (out == N) {
+      for (size_t j = 0; j != next.size(); ++j) {
+        next[j] += skip_data[j];
+      }
+      skip_data = next;
+    }
+    expected = next;
+  }
+
+  for (size_t i = 0; i != result.size(); ++i) {
+    assert(std::abs(result[i] - expected[i]) < 1e-3f);
+  }
+}
+
+// The same matmul under several schedules.
+void TestTensorExpressionSchedules(int N) {
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+  auto size = static_cast<size_t>(N) * N;
+  std::vector<GLfloat> a_data(size);
+  std::vector<GLfloat> b_data(size);
+  for (size_t i = 0; i != size; ++i) {
+    a_data[i] = dist(mt);
+    b_data[i] = dist(mt);
+  }
+
+  std::vector<GLfloat> expected(size);
+  for (int row = 0; row != N; ++row) {
+    for (int col = 0; col != N; ++col) {
+      GLfloat sum = 0.0f;
+      for (int i = 0; i != N; ++i) {
+        sum += a_data[row * N + i] * b_data[i * N + col];
+      }
+      expected[row * N + col] = sum;
+    }
+  }
+
+  Workspace &workspace = Workspace::GetInstance();
+  auto a = workspace.CreateTexture(a_data.data(), N, N);
+  auto b = workspace.CreateTexture(b_data.data(), N, N);
+  auto a4 = workspace.CreateTexture<dtype::Float32x4>(a_data.data(), N / 4, N);
+  auto b4 = workspace.CreateTexture<dtype::Float32x4>(b_data.data(), N / 4, N);
+  auto c = workspace.CreateTexture(nullptr, N, N);
+  auto c4 = workspace.CreateTexture<dtype::Float32x4>(nullptr, N / 4, N);
+
+  // A * B, over A and B in the given layouts.
+  struct Matmul {
+    te::Tensor A, B, C;
+    te::IterVar k;
+  };
+  auto matmul = [&](te::Layout a_layout, te::Layout b_layout,
+                    te::Layout c_layout) {
+    te::Tensor A = te::Placeholder("A", N, N, a_layout);
+    te::Tensor B = te::Placeholder("B", N, N, b_layout);
+    te::IterVar k = te::ReduceAxis("k", N);
+    te::Tensor C = te::Compute("C", N, N, [&](te::IterVar i, te::IterVar j) {
+      return te::Sum(A(i, k) * B(k, j), k);
+    }, c_layout);
+    return Matmul{A, B, C, k};
+  };
+
+  std::vector<GLfloat> result(size);
+  auto run = [&](const te::Schedule &schedule, Texture *a, Texture *b,
+                 Texture *c) {
+    Program program = workspace.CreateProgram(schedule.Lower().c_str());
+    workspace.Render(program, {{"A", a}, {"B", b}}, {}, c, 1);
+  };
+  auto check = [&]() {
+    for (size_t i = 0; i != size; ++i) {
+      assert(std::abs(result[i] - expected[i]) < 1e-4f * N);
+    }
+  };
+
+  using te::Layout;
+
+  // Schedules of the same compute do not interfere with each other.
+  Matmul scalar = matmul(Layout::kScalar, Layout::kScalar, Layout::kScalar);
+
+  // Plain loops.
+  {
+    run(te::Schedule(scalar.C), &a, &b, &c);
+    c.GetData(result.data());
+    check();
+  }
+
+  // Unrolled by 4, with A cached 4 at a time.
+  {
+    te::Schedule s(scalar.C);
+    auto k_split = s.Tile(scalar.k, 4);
+    s.Unroll(k_split.second);
+    s.CacheRead(scalar.A, k_split.first);
+    run(s, &a, &b, &c);
+    c.GetData(result.data());
+    check();
+  }
+
+  // Unrolled by 4, with each element of A cached in its unrolled copy.
+  {
+    te::Schedule s(scalar.C);
+    auto k_split = s.Tile(scalar.k, 4);
+    s.Unroll(k_split.second);
+    s.CacheRead(scalar.A, k_split.second);
+    run(s, &a, &b, &c);
+    c.GetData(result.data());
+    check();
+  }
+
+  // The outer loop unrolled, with B cached inside each copy.
+  {
+    te::Schedule s(scalar.C);
+    auto k_split = s.Tile(scalar.k, N / 4);
+    s.Unroll(k_split.first);
+    s.CacheRead(scalar.B, k_split.second);
+    run(s, &a, &b, &c);
+    c.GetData(result.data());
+    check();
+  }
+
+  // Unrolled by 8 instead.
+  {
+    te::Schedule s(scalar.C);
+    s.Unroll(s.Tile(scalar.k, 8).second);
+    run(s, &a, &b, &c);
+    c.GetData(result.data());
+    check();
+  }
+
+  // The compute itself was left as it was.
+  assert(te::Schedule(scalar.C).Lower().find("k_o") == std::string::npos);
+
+  // vec4 along the reduction: A in vec4 texels, B gathered.
+  {
+    Matmul m = matmul(Layout::kVec4, Layout::kScalar, Layout::kScalar);
+    te::Schedule s(m.C);
+    s.Vectorize(s.Tile(m.k, 4).second);
+    run(s, &a4, &b, &c);
+    c.GetData(result.data());
+    check();
+  }
+
+  // vec4 along the output columns, with A cached 8 at a time.
+  {
+    Matmul m = matmul(Layout::kScalar, Layout::kVec4, Layout::kVec4);
+    te::Schedule s(m.C);
+    s.Vectorize(s.Tile(m.C.axis(1), 4).second);
+    auto k_split = s.Tile(m.k, 8);
+    s.CacheRead(m.A, k_split.first);
+    run(s, &a, &b4, &c4);
+    c4.GetData(result.data());
+    check();
+  }
+}
+
+// relu(A * B + C) and a cast from an int texture, from the compile-time DSL.
+void TestKernelDsl() {
+  const int M = 24, K = 16, N = 8;
+  using A = dsl::Input<'A', M, K>;
+  using B = dsl::Input<'B', K, N>;
+  using C = dsl::Input<'C', M, N>;
+  using I = dsl::Input<'I', M, N, int>;
+  using D = decltype(dsl::relu(dsl::matmul(A(), B()) + C())
+                     * dsl::cast<float>(I()));
+  static_assert(dsl::Kernel<D>::rows == M && dsl::Kernel<D>::cols == N,
+                "Wrong output shape.");
+
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+  std::vector<GLfloat> a_data(M * K), b_data(K * N), c_data(M * N);
+  std::vector<GLint> i_data(M * N);
+  for (auto &value : a_data) {
+    value = dist(mt);
+  }
+  for (auto &value : b_data) {
+    value = dist(mt);
+  }
+  for (size_t i = 0; i != c_data.size(); ++i) {
+    c_data[i] = dist(mt);
+    i_data[i] = static_cast<GLint>(mt() % 5) - 2;
+  }
+
+  Workspace &workspace = Workspace::GetInstance();
+  auto a = workspace.CreateTexture(a_data.data(), K, M);
+  auto b = workspace.CreateTexture(b_data.data(), N, K);
+  auto c = workspace.CreateTexture(c_data.data(), N, M);
+  auto i = workspace.CreateTexture<dtype::Int32>(i_data.data(), N, M);
+  auto d = workspace.CreateTexture(nullptr, dsl::Kernel<D>::cols,
+                                   dsl::Kernel<D>::rows);
+
+  Program program = workspace.CreateProgram(dsl::Kernel<D>::source);
+  workspace.Render(program, {{"A", &a}, {"B", &b}, {"C", &c}, {"I", &i}}, {},
+                   &d, 1);
+
+  std::vector<GLfloat> result(M * N);
+  d.GetData(result.data());
+  for (int row = 0; row != M; ++row) {
+    for (int col = 0; col != N; ++col) {
+      GLfloat sum = c_data[row * N + col];
+      for (int k = 0; k != K; ++k) {
+        sum += a_data[row * K + k] * b_data[k * N + col];
+      }
+      GLfloat expected = std::max(sum, 0.0f) * i_data[row * N + col];
+      assert(std::abs(result[row * N + col] - expected) < 1e-4f * K);
+    }
+  }
+}
+
+// Conv2d through both algorithms, against the CPU.
+void TestConv2d(GLsizei batch, GLsizei height, GLsizei width,
+                GLsizei in_channels, GLsizei out_channels, GLsizei kernel_size,
+                GLsizei stride, GLsizei padding) {
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+  std::vector<GLfloat> input_data(static_cast<size_t>(batch) * height * width
+                                  * in_channels);
+  std::vector<GLfloat> weights(static_cast<size_t>(kernel_size) * kernel_size
+                               * in_channels * out_channels);
+  std::vector<GLfloat> bias(out_channels);
+  for (auto &value : input_data) {
+    value = dist(mt);
+  }
+  for (auto &value : weights) {
+    value = dist(mt);
+  }
+  for (auto &value : bias) {
+    value = dist(mt);
+  }
+
+  GLsizei out_height = (height + 2 * padding - kernel_size) / stride + 1;
+  GLsizei out_width = (width + 2 * padding - kernel_size) / stride + 1;
+  std::vector<GLfloat> expected(static_cast<size_t>(batch) * out_height
+                                * out_width * out_channels);
+  for (GLsizei n = 0; n != batch; ++n) {
+    for (GLsizei oy = 0; oy != out_height; ++oy) {
+      for (GLsizei ox = 0; ox != out_width; ++ox) {
+        for (GLsizei oc = 0; oc != out_channels; ++oc) {
+          GLfloat sum = bias[oc];
+          for (GLsizei ky = 0; ky != kernel_size; ++ky) {
+            for (GLsizei kx = 0; kx != kernel_size; ++kx) {
+              GLsizei iy = oy * stride - padding + ky;
+              GLsizei ix = ox * stride - padding + kx;
+              if (iy < 0 || iy >= height || ix < 0 || ix >= width) {
+                continue;
+              }
+              for (GLsizei ic = 0; ic != in_channels; ++ic) {
+                sum += input_data[((n * height + iy) * width + ix)
+                                  * in_channels + ic]
+                       * weights[((ky * kernel_size + kx) * in_channels + ic)
+                                 * out_channels + oc];
+              }
+            }
+          }
+          expected[((n * out_height + oy) * out_width + ox) * out_channels
+                   + oc] = sum;
+        }
+      }
+    }
+  }
+
+  Workspace &workspace = Workspace::GetInstance();
+  Nhwc4Tensor input = workspace.CreateNhwc4Tensor(input_data.data(), batch,
+                                                  height, width, in_channels);
+  Conv2dFilter filter = workspace.CreateConv2dFilter(
+      weights.data(), bias.data(), kernel_size, kernel_size, in_channels,
+      out_channels);
+
+  std::vector<Conv2dAlgorithm> algorithms = {
+      Conv2dAlgorithm::kAuto, Conv2dAlgorithm::kDirect,
+      Conv2dAlgorithm::kIm2col};
+  if (kernel_size == 3 && stride == 1) {
+    algorithms.push_back(Conv2dAlgorithm::kWinograd);
+  }
+  for (auto algorithm : algorithms) {
+    Nhwc4Tensor output = workspace.Conv2d(input, filter, stride, padding,
+                                          algorithm);
+    assert(output.height() == out_height && output.width() == out_width);
+
+    std::vector<GLfloat> result(expected.size());
+    output.GetData(result.data());
+    for (size_t i = 0; i != result.size(); ++i) {
+      assert(std::abs(result[i] - expected[i])
+             < 1e-4f * kernel_size * kernel_size * in_channels);
+    }
+  }
+}
+
+void TestGemv(GLsizei rows, GLsizei cols, int niters) {
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+  std::vector<GLfloat> a(static_cast<size_t>(rows) * cols);
+  std::vector<GLfloat> x(cols);
+  for (auto &value : a) {
+    value = dist(mt);
+  }
+  for (auto &value : x) {
+    value = dist(mt);
+  }
+
+  Workspace &workspace = Workspace::GetInstance();
+  auto a_texture = workspace.CreateVec4Matrix(a.data(), rows, cols);
+  auto x_texture = workspace.CreateVec4Matrix(x.data(), 1, cols);
+  Texture y_texture = workspace.CreateTexture(nullptr, rows, 1);
+  Texture scratch = workspace.CreateGemvScratch(a_texture);
+
+  // Once without scratch space.
+  workspace.Gemv(&a_texture, &x_texture, &y_texture);
+
+  auto start = std::chrono::system_clock::now();
+  for (int i = 0; i != niters; ++i) {
+    workspace.Gemv(&a_texture, &x_texture, &y_texture, &scratch);
+  }
+  OPENGL_CALL(glFinish());
+  auto end = std::chrono::system_clock::now();
+  std::cout << "gemv: "
+            << std::chrono::duration_cast<std::chrono::microseconds>(
+                   end - start).count() / niters
+            << std::endl;
+
+  std::vector<GLfloat> y(rows);
+  y_texture.GetData(y.data());
+  for (GLsizei row = 0; row != rows; ++row) {
+    GLfloat sum = 0.0f;
+    for (GLsizei col = 0; col != cols; ++col) {
+      sum += a[static_cast<size_t>(row) * cols + col] * x[col];
+    }
+    assert(std::abs(y[row] - sum) < 1e-5f * cols);
+  }
+}
+
+// Batched 1D and 2D FFTs against a direct DFT, and their inverses.
+void TestFft(GLsizei rows, GLsizei cols) {
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+  size_t size = static_cast<size_t>(rows) * cols;
+  std::vector<GLfloat> real(size);
+  for (auto &value : real) {
+    value = dist(mt);
+  }
+
+  Workspace &workspace = Workspace::GetInstance();
+  Texture real_texture = workspace.CreateTexture(real.data(), cols, rows);
+  auto input = workspace.ToComplex(&real_texture);
+  auto output = workspace.CreateTexture<dtype::Complex64>(nullptr, cols,
+                                                          rows);
+  auto inverse = workspace.CreateTexture<dtype::Complex64>(nullptr, cols,
+                                                           rows);
+  std::vector<GLfloat> result(size * 2);
+
+  // X[u][v] = sum of x[y][x] exp(-2 pi i (u y / rows + v x / cols)), with
+  // only v for 1D.
+  auto check = [&](bool two_d) {
+    output.GetData(result.data());
+    GLfloat tolerance = 1e-4f * cols * (two_d ? rows : 1);
+    for (GLsizei u = 0; u != rows; ++u) {
+      for (GLsizei v = 0; v != cols; ++v) {
+        double re = 0.0;
+        double im = 0.0;
+        for (GLsizei y = 0; y != rows; ++y) {
+          if (!two_d && y != u) {
+            continue;
+          }
+          for (GLsizei x = 0; x != cols; ++x) {
+            double angle = -2.0 * std::acos(-1.0)
+                           * (static_cast<double>(v) * x / cols
+                              + (two_d ? 1.0 * u * y / rows : 0.0));
+            re += real[static_cast<size_t>(y) * cols + x] * std::cos(angle);
+            im += real[static_cast<size_t>(y) * cols + x] * std::sin(angle);
+          }
+        }
+        size_t i = static_cast<size_t>(u) * cols + v;
+        assert(std::abs(result[i * 2] - re) < tolerance);
+        assert(std::abs(result[i * 2 + 1] - im) < tolerance);
+      }
+    }
+
+    inverse.GetData(result.data());
+    for (size_t i = 0; i != size; ++i) {
+      assert(std::abs(result[i * 2] - real[i]) < 1e-4f);
+      assert(std::abs(result[i * 2 + 1]) < 1e-4f);
+    }
+  };
+
+  workspace.FftRows(&input, &output, false);
+  workspace.FftRows(&output, &inverse, true);
+  check(false);
+
+  workspace.Fft2d(&input, &output, false);
+  workspace.Fft2d(&output, &inverse, true);
+  check(true);
+
+  size_t memory_used = workspace.memory_used();
+  workspace.ReleaseFftTwiddles();
+  assert(workspace.memory_used() < memory_used);
+}
+
+// Row-wise and whole-texture prefix sums of small integers, which are exact
+// in fp32.
+void TestScan(GLsizei rows, GLsizei cols) {
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_int_distribution<int> dist(0, 3);
+
+  std::vector<GLfloat> data(static_cast<size_t>(rows) * cols);
+  for (auto &value : data) {
+    value = static_cast<GLfloat>(dist(mt));
+  }
+
+  Workspace &workspace = Workspace::GetInstance();
+  Texture input = workspace.CreateTexture(data.data(), cols, rows);
+  Texture output = workspace.CreateTexture(nullptr, cols, rows);
+  std::vector<GLfloat> result(data.size());
+
+  for (bool inclusive : {false, true}) {
+    workspace.ScanRows(&input, &output, inclusive);
+    output.GetData(result.data());
+    for (GLsizei row = 0; row != rows; ++row) {
+      GLfloat sum = 0.0f;
+      for (GLsizei col = 0; col != cols; ++col) {
+        size_t i = static_cast<size_t>(row) * cols + col;
+        if (inclusive) {
+          sum += data[i];
+        }
+        assert(result[i] == sum);
+        if (!inclusive) {
+          sum += data[i];
+        }
+      }
+    }
+
+    workspace.Scan(&input, &output, inclusive);
+    output.GetData(result.data());
+    GLfloat sum = 0.0f;
+    for (size_t i = 0; i != data.size(); ++i) {
+      if (inclusive) {
+        sum += data[i];
+      }
+      assert(result[i] == sum);
+      if (!inclusive) {
+        sum += data[i];
+      }
+    }
+  }
+}
+
+// Sort rows of (key, index) pairs, and take their top k.
+void TestSortTopK(GLsizei rows, GLsizei cols, GLsizei k) {
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+  std::vector<GLfloat> keys(static_cast<size_t>(rows) * cols);
+  std::vector<GLfloat> pairs(keys.size() * 4, 0.0f);
+  for (size_t i = 0; i != keys.size(); ++i) {
+    keys[i] = dist(mt);
+    pairs[i * 4] = keys[i];
+    pairs[i * 4 + 1] = static_cast<GLfloat>(i % cols);
+  }
+
+  Workspace &workspace = Workspace::GetInstance();
+  auto input = workspace.CreateTexture<dtype::Float32x4>(pairs.data(), cols,
+                                                         rows);
+
+  // Each output pair must be (key of its index, index), in order.
+  auto check = [&](TypedTexture<dtype::Float32x4> &output, GLsizei width,
+                   bool descending) {
+    std::vector<GLfloat> result(static_cast<size_t>(rows) * width * 4);
+    output.GetData(result.data());
+    for (GLsizei row = 0; row != rows; ++row) {
+      std::vector<GLfloat> expected(&keys[static_cast<size_t>(row) * cols],
+                                    &keys[static_cast<size_t>(row + 1) * cols]);
+      if (descending) {
+        std::sort(expected.begin(), expected.end(), std::greater<GLfloat>());
+      } else {
+        std::sort(expected.begin(), expected.end());
+      }
+      for (GLsizei col = 0; col != width; ++col) {
+        const GLfloat *pair = &result[(static_cast<size_t>(row) * width + col)
+                                      * 4];
+        auto index = static_cast<size_t>(pair[1]);
+        assert(pair[0] == expected[col]);
+        assert(keys[static_cast<size_t>(row) * cols + index] == pair[0]);
+      }
+    }
+  };
+
+  auto ascending = workspace.SortRows(&input, false);
+  check(ascending, cols, false);
+  auto descending = workspace.SortRows(&input, true);
+  check(descending, cols, true);
+  auto top = workspace.TopK(&input, k);
+  check(top, k, true);
+}
+
+// Scatter-add rows with repeated indices, and count them.
+void TestScatterAdd(GLsizei rows, GLsizei dim, GLsizei n) {
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+  std::uniform_int_distribution<GLint> row_dist(0, rows - 1);
+
+  std::vector<GLint> indices(n);
+  std::vector<GLfloat> values(static_cast<size_t>(n) * dim);
+  std::vector<GLfloat> expected(static_cast<size_t>(rows) * dim);
+  std::vector<GLfloat> expected_counts(rows, 0.0f);
+  for (auto &value : values) {
+    value = dist(mt);
+  }
+  for (auto &value : expected) {
+    value = dist(mt);
+  }
+  std::vector<GLfloat> initial = expected;
+  for (GLsizei i = 0; i != n; ++i) {
+    indices[i] = row_dist(mt);
+    expected_counts[indices[i]] += 1.0f;
+    for (GLsizei d = 0; d != dim; ++d) {
+      expected[static_cast<size_t>(indices[i]) * dim + d] +=
+          values[static_cast<size_t>(i) * dim + d];
+    }
+  }
+
+  Workspace &workspace = Workspace::GetInstance();
+  auto indices_texture = workspace.CreateBufferTexture<dtype::Int32>(
+      indices.data(), n);
+  Texture values_texture = workspace.CreateTexture(values.data(), dim, n);
+  Texture output = workspace.CreateTexture(initial.data(), dim, rows);
+  Texture counts = workspace.CreateTexture(nullptr, rows, 1);
+
+  workspace.ScatterAdd(&indices_texture, &values_texture, &output);
+  workspace.Histogram(&indices_texture, &counts);
+
+  std::vector<GLfloat> result(expected.size());
+  output.GetData(result.data());
+  for (size_t i = 0; i != result.size(); ++i) {
+    assert(std::abs(result[i] - expected[i]) < 1e-4f * n / rows + 1e-5f);
+  }
+
+  std::vector<GLfloat> result_counts(rows);
+  counts.GetData(result_counts.data());
+  assert(result_counts == expected_counts);
+}
+
+// Keep the positive elements of a vector, on the device.
+void TestFilter(GLsizei size) {
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+  std::vector<GLfloat> data(size);
+  for (auto &value : data) {
+    value = dist(mt);
+  }
+
+  Workspace &workspace = Workspace::GetInstance();
+  auto input = workspace.CreateBufferTexture<dtype::Float32>(data.data(),
+                                                              size);
+  auto values = workspace.CreateBufferTexture<dtype::Float32>(nullptr, size);
+  auto indices = workspace.CreateBufferTexture<dtype::Int32>(nullptr, size);
+
+  GLuint count = workspace.Filter(&input, "x > 0.0", &values, &indices);
+
+  std::vector<GLfloat> kept_values(size);
+  std::vector<GLint> kept_indices(size);
+  values.GetData(kept_values.data());
+  indices.GetData(kept_indices.data());
+
+  GLuint expected_count = 0;
+  for (GLsizei i = 0; i != size; ++i) {
+    if (data[i] > 0.0f) {
+      assert(expected_count < count);
+      assert(kept_indices[expected_count] == i);
+      assert(kept_values[expected_count] == data[i]);
+      ++expected_count;
+    }
+  }
+  assert(count == expected_count);
+}
+
+// Softmax and layernorm over rows longer and shorter than kRowChunk.
+void TestSoftmaxLayerNorm(GLsizei rows, GLsizei cols) {
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(-10.0f, 10.0f);
+
+  std::vector<GLfloat> input_data(static_cast<size_t>(rows) * cols);
+  std::vector<GLfloat> gamma(cols);
+  std::vector<GLfloat> beta(cols);
+  for (auto &value : input_data) {
+    value = dist(mt);
+  }
+  for (GLsizei col = 0; col != cols; ++col) {
+    gamma[col] = dist(mt);
+    beta[col] = dist(mt);
+  }
+  const GLfloat epsilon = 1e-5f;
+
+  std::vector<GLfloat> expected_softmax(input_data.size());
+  std::vector<GLfloat> expected_layernorm(input_data.size());
+  for (GLsizei row = 0; row != rows; ++row) {
+    const GLfloat *x = &input_data[static_cast<size_t>(row) * cols];
+    double max = *std::max_element(x, x + cols);
+    double sum = 0.0;
+    double mean = 0.0;
+    for (GLsizei col = 0; col != cols; ++col) {
+      sum += std::exp(x[col] - max);
+      mean += x[col];
+    }
+    mean /= cols;
+    double var = 0.0;
+    for (GLsizei col = 0; col != cols; ++col) {
+      var += (x[col] - mean) * (x[col] - mean);
+    }
+    var /= cols;
+    for (GLsizei col = 0; col != cols; ++col) {
+      size_t i = static_cast<size_t>(row) * cols + col;
+      expected_softmax[i] = static_cast<GLfloat>(std::exp(x[col] - max)
+                                                 / sum);
+      expected_layernorm[i] = static_cast<GLfloat>(
+          (x[col] - mean) / std::sqrt(var + epsilon) * gamma[col]
+          + beta[col]);
+    }
+  }
+
+  Workspace &workspace = Workspace::GetInstance();
+  Texture input = workspace.CreateTexture(input_data.data(), cols, rows);
+  Texture gamma_texture = workspace.CreateTexture(gamma.data(), cols, 1);
+  Texture beta_texture = workspace.CreateTexture(beta.data(), cols, 1);
+  Texture output = workspace.CreateTexture(nullptr, cols, rows);
+  std::vector<GLfloat> result(input_data.size());
+
+  workspace.Softmax(&input, &output);
+  output.GetData(result.data());
+  for (size_t i = 0; i != result.size(); ++i) {
+    assert(std::abs(result[i] - expected_softmax[i])
+           <= 1e-4f * expected_softmax[i] + 1e-7f);
+  }
+
+  workspace.LayerNorm(&input, &gamma_texture, &beta_texture, epsilon,
+                      &output);
+  output.GetData(result.data());
+  for (size_t i = 0; i != result.size(); ++i) {
+    assert(std::abs(result[i] - expected_layernorm[i]) < 1e-3f);
+  }
+}
+
+// Multiply matrices through tiles that do not divide them.
+void TestTiledMatmul(int M, int N, int K, int tile_size, int tile_depth) {
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+
+  std::vector<GLfloat> a(static_cast<size_t>(M) * K);
+  std::vector<GLfloat> b(static_cast<size_t>(K) * N);
+  for (auto &value : a) {
+    value = dist(mt);
+  }
+  for (auto &value : b) {
+    value = dist(mt);
+  }
+
+  Workspace &workspace = Workspace::GetInstance();
+  workspace.SetMemoryBudget(TiledMatmul::DeviceBytes(tile_size, tile_depth));
+
+  std::vector<GLfloat> c(static_cast<size_t>(M) * N);
+  {
+    TiledMatmul matmul(tile_size, tile_depth);
+
+    auto start = std::chrono::system_clock::now();
+    matmul.Run(a.data(), b.data(), c.data(), M, N, K);
+    auto end = std::chrono::system_clock::now();
+    std::cout << "tiled: "
+              << std::chrono::duration_cast<std::chrono::microseconds>(
+                     end - start).count()
+              << std::endl;
+
+    assert(workspace.memory_used() <= workspace.memory_budget());
+  }
+  workspace.SetMemoryBudget(0);
+
+  for (int row = 0; row != M; ++row) {
+    for (int col = 0; col != N; ++col) {
+      GLfloat sum = 0.0f;
+      for (int i = 0; i != K; ++i) {
+        sum += a[static_cast<size_t>(row) * K + i]
+               * b[static_cast<size_t>(i) * N + col];
+      }
+      assert(std::abs(c[static_cast<size_t>(row) * N + col] - sum)
+             < 1e-3f * K);
+    }
+  }
+}
+
+// The same, with the largest square tiles that fit in "bytes".
+void TestTiledMatmulForBudget(int M, int N, int K, size_t bytes) {
+  GLsizei tile_size = TiledMatmul::TileSizeFor(bytes);
+  assert(TiledMatmul::DeviceBytes(tile_size, tile_size) <= bytes);
+  assert(TiledMatmul::DeviceBytes(tile_size + 1, tile_size + 1) > bytes);
+  TestTiledMatmul(M, N, K, tile_size, tile_size);
+}
+
+// Save a few tensors with every encoding, and read them back.
+void TestCheckpoint(int N, const std::string &path) {
+  Workspace &workspace = Workspace::GetInstance();
+
+  std::random_device rd;
+  std::mt19937 mt(rd());
+  std::uniform_real_distribution<float> dist(1.0f, 2.0f);
+
+  auto size = static_cast<size_t>(N) * N;
+
+  std::vector<GLfloat> a_data(size);
+  std::vector<GLint> b_data(size);
+  for (size_t i = 0; i != size; ++i) {
+    a_data[i] = dist(mt);
+    b_data[i] = static_cast<GLint>(mt());
+  }
+
+  auto a = workspace.CreateTexture(a_data.data(), N, N);
+  auto b = workspace.CreateTexture<dtype::Int32>(b_data.data(), N * N, 1);
+  auto c = workspace.CreateBufferTexture<dtype::Float32>(a_data.data(), N * N);
+
+  // Small chunks and a small ring, to exercise streaming.
+  StagingRing ring = workspace.CreateStagingRing(std::max<GLsizeiptr>(
+      64 * N,
+      (CheckpointWriter::kMaxInFlight + 1) * StagingRing::kAlignment));
+  {
+    CheckpointWriter writer(path, &ring, /*chunk_size=*/12 * N);
+    writer.Add("a", a);
+    writer.Add("a_fp16", a, CheckpointEntry::kFloat16);
+    writer.Add("a_int8", a, CheckpointEntry::kInt8);
+    writer.Add("b", b);
+    writer.Add("c", c);
+  }
+
+  CheckpointReader reader(path);
+  assert(reader.entries().size() == 5);
+
+  std::vector<GLfloat> retrieved_data(size);
+  auto a_read = workspace.CreateTexture(nullptr, N, N);
+
+  reader.Read("a", &a_read, &ring);
+  a_read.GetData(retrieved_data.data());
+  assert(retrieved_data == a_data);
+
+  reader.Read("a_fp16", &a_read, &ring);
+  a_read.GetData(retrieved_data.data());
+  for (size_t i = 0; i != size; ++i) {
+    assert(retrieved_data[i] == HalfToFloat(FloatToHalf(a_data[i])));
+  }
+
+  reader.Read("a_int8", &a_read, &ring);
+  a_read.GetData(retrieved_data.data());
+  for (size_t i = 0; i != size; ++i) {
+    assert(std::abs(retrieved_data[i] - a_data[i]) < 2.0f / 255.0f);
+  }
+
+  auto b_read = workspace.CreateTexture<dtype::Int32>(nullptr, N * N, 1);
+  reader.Read("b", &b_read, &ring);
+  std::vector<GLint> b_retrieved(size);
+  b_read.GetData(b_retrieved.data());
+  assert(b_retrieved == b_data);
+
+  auto c_read = workspace.CreateBufferTexture<dtype::Float32>(nullptr, N * N);
+  reader.Read("c", &c_read, &ring);
+  c_read.GetData(retrieved_data.data());
+  assert(retrieved_data == a_data);
+
+  std::remove(path.c_str());
+}
+
+// Runs the test called "name", or every test but "window" if it is "all".
+// Integer arguments come from "args", and missing ones fall back to small
+// shapes. Returns false if no test is called "name".
+bool RunTest(const std::string &name, const std::vector<int> &args) {
+  auto arg = [&args](size_t i, int fallback) {
+    return i < args.size() ? args[i] : fallback;
+  };
+
+  bool found = false;
+  auto run = [&](const std::string &test_name, bool in_all,
+                 const std::function<void()> &test) {
+    if (name == test_name || (in_all && name == "all")) {
+      std::clog << "Running " << test_name << std::endl;
+      test();
+      found = true;
+    }
+  };
+
+  run("window", false, [&] { TestRenderToWindow(); });
+  run("render", true, [&] {
+    int N = arg(0, 64);
+    HostArena arena(4 * static_cast<size_t>(N) * N * sizeof(GLfloat)
+                    + 4 * HostArena::kAlignment);
+    TestRenderToTexture(&arena, N, arg(1, 2));
+  });
+  run("fp16", true, [&] { TestRenderToTextureFp16(arg(0, 64), arg(1, 2)); });
+  run("quantized", true, [&] { TestQuantizedMatmul(arg(0, 64), arg(1, 2)); });
+  run("buffer", true, [&] {
+    TestRenderToBufferTexture(arg(0, 32), arg(1, 2));
+  });
+  run("staging", true, [&] { TestStagingRing(arg(0, 64), arg(1, 2)); });
+  run("budget", true, [&] { TestMemoryBudget(arg(0, 64)); });
+  run("oom", true, [&] { TestOutOfMemory(arg(0, 64)); });
+  run("mirrored", true, [&] { TestMirroredTensor(arg(0, 32)); });
+  run("view", true, [&] { TestTextureView(arg(0, 32), arg(1, 2)); });
+  run("load", true, [&] { TestLoadTexture(arg(0, 64), "glitter_test.npy"); });
+  run("expression", true, [&] { TestTensorExpression(arg(0, 16)); });
+  run("optimizer", true, [&] { TestGraphOptimizer(arg(0, 16)); });
+  run("planner", true, [&] { TestMemoryPlanner(arg(0, 16)); });
+  run("schedules", true, [&] { TestTensorExpressionSchedules(arg(0, 16)); });
+  run("dsl", true, [&] { TestKernelDsl(); });
+  run("conv2d", true, [&] {
+    if (!args.empty()) {
+      TestConv2d(arg(0, 1), arg(1, 8), arg(2, 8), arg(3, 4), arg(4, 4),
+                 arg(5, 3), arg(6, 1), arg(7, 1));
+      return;
+    }
+    TestConv2d(2, 9, 7, 5, 6, 3, 1, 1);
+    TestConv2d(1, 12, 11, 8, 3, 3, 2, 0);
+    TestConv2d(2, 5, 5, 3, 9, 1, 1, 0);
+  });
+  run("gemv", true, [&] { TestGemv(arg(0, 100), arg(1, 1000), arg(2, 2)); });
+  run("fft", true, [&] {
+    if (!args.empty()) {
+      TestFft(arg(0, 8), arg(1, 16));
+      return;
+    }
+    TestFft(4, 8);
+    TestFft(2, 512);
+    TestFft(32, 4);
+  });
+  run("scan", true, [&] {
+    if (!args.empty()) {
+      TestScan(arg(0, 7), arg(1, 1000));
+      return;
+    }
+    TestScan(1, 9);
+    TestScan(7, 1000);
+  });
+  run("sort", true, [&] {
+    TestSortTopK(arg(0, 3), arg(1, 300), arg(2, 10));
+  });
+  run("scatter", true, [&] {
+    TestScatterAdd(arg(0, 10), arg(1, 7), arg(2, 100));
+  });
+  run("filter", true, [&] { TestFilter(arg(0, 1000)); });
+  run("softmax", true, [&] {
+    if (!args.empty()) {
+      TestSoftmaxLayerNorm(arg(0, 3), arg(1, 1000));
+      return;
+    }
+    TestSoftmaxLayerNorm(3, 10);
+    TestSoftmaxLayerNorm(5, 1000);
+  });
+  run("tiled_matmul", true, [&] {
+    if (!args.empty()) {
+      TestTiledMatmul(arg(0, 50), arg(1, 40), arg(2, 30), arg(3, 16),
+                      arg(4, 8));
+      return;
+    }
+    TestTiledMatmul(50, 40, 30, 16, 8);
+    // Tiles much smaller than StagingRing::kAlignment.
+    for (int tile_depth = 1; tile_depth <= 8; ++tile_depth) {
+      TestTiledMatmul(20, 20, 20, 3, tile_depth);
+    }
+    TestTiledMatmul(20, 20, 20, 9, 8);
+    TestTiledMatmulForBudget(50, 40, 30, 4 << 10);
+    TestTiledMatmulForBudget(50, 40, 30, 64 << 10);
+  });
+  run("checkpoint", true, [&] {
+    if (!args.empty()) {
+      TestCheckpoint(arg(0, 64), "glitter_test.ckpt");
+      return;
+    }
+    // Rings that only fit a few aligned chunks.
+    for (int N : {4, 8, 13, 64}) {
+      TestCheckpoint(N, "glitter_test.ckpt");
+    }
+  });
+
+  return found;
+}
+
+// Arguments are either <N> <niters>, to time N x N matmuls, or
+// <test> [<args>...], where <test> is a name in RunTest.
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " <N> <niters> | <test> [<args>...]"
+              << std::endl;
+    return 1;
+  }
+
+  Workspace::GetInstance();
+
+  char *end;
+  int N = static_cast<int>(std::strtol(argv[1], &end, 10));
+  if (*end != '\0') {
+    std::vector<int> args;
+    for (int i = 2; i < argc; ++i) {
+      args.push_back(atoi(argv[i]));
+    }
+    if (!RunTest(argv[1], args)) {
+      std::cerr << "Unknown test: " << argv[1] << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  // A, B, the result and the CPU result.
+  HostArena arena(4 * static_cast<size_t>(N) * N * sizeof(GLfloat)
+                  + 4 * HostArena::kAlignment);
+
+  TestRenderToTexture(&arena, N, /*niters=*/argc > 2 ? atoi(argv[2]) : 1);
+
+  return 0;
+}
+
+Program::Program(Program &&other) noexcept : program_(other.program_) {
+  other.program_ = kInvalidProgram;
+}
+
+Program::Program(GLuint program) : program_(program) {}
+
+Program::~Program() {
+  if (program_ != kInvalidProgram) {
+    glDeleteProgram(program_);
+    program_ = kInvalidProgram;
+  }
+}
+
+Texture::Texture(const GLfloat *data, GLsizei width, GLsizei height)
+    : Texture(data, width, height, GL_RGBA32F, GL_RED, GL_FLOAT) {}
+
+Texture::Texture(const GLvoid *data, GLsizei width, GLsizei height,
+                 GLint internal_format, GLenum format, GLenum type)
+    : target_(GL_TEXTURE_2D), texture_(kInvalidTexture), width_(width),
+      height_(height), internal_format_(static_cast<GLenum>(internal_format)),
+      bytes_(static_cast<size_t>(width) * height
+             * gl::TexelSize(internal_format_)),
+      format_(format), type_(type), buffer_(kInvalidBuffer), buffer_size_(0),
+      resident_(false), pins_(0), tracked_(false) {
+  Allocate(data);
+  Workspace::GetInstance().Track(this);
+}
+
+Texture::Texture(const GLvoid *data, GLsizeiptr size, GLsizei width,
+                 GLenum internal_format)
+    : target_(GL_TEXTURE_BUFFER), texture_(kInvalidTexture), width_(width),
+      height_(1), internal_format_(internal_format),
+      bytes_(static_cast<size_t>(size)), format_(GL_NONE), type_(GL_NONE),
+      buffer_(kInvalidBuffer), buffer_size_(size), resident_(false), pins_(0),
+      tracked_(false) {
+  GLint max_size;
+  OPENGL_CALL(glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_size));
+  if (width > max_size) {
+    std::cerr << "Buffer texture too large: " << width << " > " << max_size
+              << " texels." << std::endl;
+    assert(false);
+  }
+
+  Allocate(data);
+  Workspace::GetInstance().Track(this);
+}
+
+Texture::Texture(Texture &&other) noexcept
+    : target_(other.target_), texture_(other.texture_), width_(other.width_),
+      height_(other.height_), internal_format_(other.internal_format_),
+      bytes_(other.bytes_), format_(other.format_), type_(other.type_),
+      buffer_(other.buffer_), buffer_size_(other.buffer_size_),
+      resident_(other.resident_), pins_(other.pins_),
+      evicted_data_(std::move(other.evicted_data_)),
+      tracked_(other.tracked_), lru_position_(other.lru_position_) {
+  if (tracked_) {
+    *lru_position_ = this;
+  }
+  other.texture_ = kInvalidTexture;
+  other.buffer_ = kInvalidBuffer;
+  other.resident_ = false;
+  other.tracked_ = false;
+}
+
+Texture::~Texture() {
+  if (tracked_) {
+    Workspace::GetInstance().Untrack(this);
+    tracked_ = false;
+  }
+  if (resident_) {
+    Release();
+  }
+}
+
+void Texture::Allocate(const GLvoid *data) const {
+  auto &workspace = Workspace::GetInstance();
+
+  // Make room first, so that eviction does not disturb our bindings.
+  workspace.Reserve(bytes_);
+
+  if (target_ == GL_TEXTURE_BUFFER) {
+    // Create the storage.
+    OPENGL_CALL(glGenBuffers(1, &buffer_));
+  } else {
+    // Create a texture.
+    OPENGL_CALL(glGenTextures(1, &texture_));
+
+    std::clog << "Created texture [" << texture_ << "]" << std::endl;
+
+    OPENGL_CALL(glPixelStorei(GL_UNPACK_ALIGNMENT, 1));
+  }
+
+  // Similar to cudaMemcpy.
+  // Running out of memory is not fatal as long as something can be evicted.
+  while (true) {
+    // Evicting reads the victim back through the same binding points, so
+    // bind again before every attempt.
+    GLenum err = GL_OUT_OF_MEMORY;
+    if (target_ == GL_TEXTURE_BUFFER) {
+      OPENGL_CALL(glBindBuffer(GL_TEXTURE_BUFFER, buffer_));
+    } else {
+      // Bind to temporary unit.
+      workspace.BindTextureUnit(workspace.NumTextureUnits() - 1, texture_);
+    }
+    if (workspace.failing_allocations_ > 0) {
+      --workspace.failing_allocations_;
+    } else if (target_ == GL_TEXTURE_BUFFER) {
+      glBufferData(GL_TEXTURE_BUFFER, buffer_size_, data, GL_STATIC_DRAW);
+      err = glGetError();
+    } else {
+      glTexImage2D(GL_TEXTURE_2D, /*level=*/0,
+                   static_cast<GLint>(internal_format_), width_, height_,
+                   /*border=*/0, format_, type_, data);
+      err = glGetError();
+    }
+
+    if (err == GL_NO_ERROR) {
+      break;
+    }
+    if (err == GL_OUT_OF_MEMORY && workspace.EvictOne()) {
+      continue;
+    }
+    std::cerr << "OpenGL error, code=" << err << ": "
+              << gl::GLGetErrorString(err) << std::endl;
+    assert(false);
+  }
+
+  if (target_ == GL_TEXTURE_BUFFER) {
+    OPENGL_CALL(glBindBuffer(GL_TEXTURE_BUFFER, 0));
+
+    // Create a texture that views the storage.
+    OPENGL_CALL(glGenTextures(1, &texture_));
+
+    std::clog << "Created buffer texture [" << texture_ << "]" << std::endl;
+
+    workspace.BindTextureUnit(workspace.NumTextureUnits() - 1, target_,
+                              texture_);
+    OPENGL_CALL(glTexBuffer(GL_TEXTURE_BUFFER, internal_format_, buffer_));
+  } else {
+    // TODO(zhixunt): What are these?
+    OPENGL_CALL(
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    OPENGL_CALL(
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    OPENGL_CALL(
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    OPENGL_CALL(
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+  }
+
+  resident_ = true;
+  workspace.memory_used_ += bytes_;
+}
+
+void Texture::Release() const {
+  if (texture_ != kInvalidTexture) {
+    std::clog << "Deleting texture [" << texture_ << "]" << std::endl;
+    OPENGL_CALL(glDeleteTextures(1, &texture_));
+    texture_ = kInvalidTexture;
+  }
+  if (buffer_ != kInvalidBuffer) {
+    OPENGL_CALL(glDeleteBuffers(1, &buffer_));
+    buffer_ = kInvalidBuffer;
+  }
+
+  resident_ = false;
+  Workspace::GetInstance().memory_used_ -= bytes_;
+}
+
+void Texture::Evict() const {
+  assert(resident_ && pins_ == 0);
+
+  std::clog << "Evicting texture [" << texture_ << "]" << std::endl;
+
+  evicted_data_.resize(host_bytes());
+  ReadData(format_, type_, evicted_data_.data());
+  Release();
+}
+
+void Texture::Restore() const {
+  assert(!resident_);
+
+  Allocate(evicted_data_.data());
+  evicted_data_.clear();
+  evicted_data_.shrink_to_fit();
+}
+
+size_t Texture::host_bytes() const {
+  if (target_ == GL_TEXTURE_BUFFER) {
+    return static_cast<size_t>(buffer_size_);
+  }
+  return static_cast<size_t>(width_) * height_
+         * gl::PixelSize(format_, type_);
+}
+
+GLvoid *Texture::MapBuffer() {
+  assert(target_ == GL_TEXTURE_BUFFER);
+
+  auto &workspace = Workspace::GetInstance();
+  workspace.Pin(*this);
+
+  OPENGL_CALL(glBindBuffer(GL_TEXTURE_BUFFER, buffer_));
+  GLvoid *data = glMapBufferRange(
+      GL_TEXTURE_BUFFER, 0, buffer_size_,
+      GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  OPENGL_CHECK_ERROR();
+  return data;
+}
+
+void Texture::UnmapBuffer() {
+  assert(target_ == GL_TEXTURE_BUFFER);
+
+  OPENGL_CALL(glBindBuffer(GL_TEXTURE_BUFFER, buffer_));
+  if (glUnmapBuffer(GL_TEXTURE_BUFFER) != GL_TRUE) {
+    std::cerr << "Buffer texture [" << texture_ << "] got corrupted."
+              << std::endl;
+    assert(false);
+  }
+  OPENGL_CALL(glBindBuffer(GL_TEXTURE_BUFFER, 0));
+
+  Workspace::GetInstance().Unpin(*this);
+}
+
+void Texture::GetData(GLfloat *data) const {
+  GetData(GL_RED, GL_FLOAT, data);
+}
+
+void Texture::GetData(GLenum format, GLenum type, GLvoid *data) const {
+  Workspace::GetInstance().MakeResident(*this);
+  ReadData(format, type, data);
+}
+
+void Texture::SetData(GLenum format, GLenum type, const GLvoid *data) {
+  auto &workspace = Workspace::GetInstance();
+  workspace.MakeResident(*this);
+
+  if (target_ == GL_TEXTURE_BUFFER) {
+    OPENGL_CALL(glBindBuffer(GL_TEXTURE_BUFFER, buffer_));
+    OPENGL_CALL(glBufferSubData(GL_TEXTURE_BUFFER, 0, buffer_size_, data));
+    OPENGL_CALL(glBindBuffer(GL_TEXTURE_BUFFER, 0));
+    return;
+  }
+
+  workspace.BindTextureUnit(workspace.NumTextureUnits() - 1, texture_);
+
+  OPENGL_CALL(glPixelStorei(GL_UNPACK_ALIGNMENT, 1));
+  OPENGL_CALL(glTexSubImage2D(GL_TEXTURE_2D, /*level=*/0, 0, 0, width_,
+                              height_, format, type, data));
+}
+
+void Texture::ReadData(GLenum format, GLenum type, GLvoid *data) const {
+  auto &workspace = Workspace::GetInstance();
+
+  if (target_ == GL_TEXTURE_BUFFER) {
+    OPENGL_CALL(glBindBuffer(GL_TEXTURE_BUFFER, buffer_));
+    OPENGL_CALL(glGetBufferSubData(GL_TEXTURE_BUFFER, 0, buffer_size_, data));
+    OPENGL_CALL(glBindBuffer(GL_TEXTURE_BUFFER, 0));
+    return;
+  }
+
+  workspace.BindTextureUnit(workspace.NumTextureUnits() - 1, texture_);
+
+  // Rows of narrow types are not 4-byte aligned in general.
+  OPENGL_CALL(glPixelStorei(GL_PACK_ALIGNMENT, 1));
+  glGetTexImage(GL_TEXTURE_2D, /*level=*/0, format, type, data);
+}
+
+template <typename DType>
+TypedTexture<DType>::TypedTexture(const HostType *data, GLsizei width,
+                                  GLsizei height)
+    : Texture(nullptr, width, height, DType::kInternalFormat, DType::kFormat,
+              DType::kType) {
+  if (data != nullptr) {
+    SetData(data);
+  }
+}
+
+template <typename DType>
+TypedTexture<DType>::TypedTexture(const HostType *data, GLsizei width)
+    : Texture(nullptr,
+              static_cast<GLsizeiptr>(width) * DType::kLanes
+                  * sizeof(TransferType),
+              width, DType::kBufferInternalFormat) {
+  if (data != nullptr) {
+    SetData(data);
+  }
+}
+
+template <typename DType>
+void TypedTexture<DType>::SetData(const HostType *data) {
+  std::vector<TransferType> staging;
+  const TransferType *transfer = Encode(data, size(), &staging, SameType());
+  Texture::SetData(DType::kFormat, DType::kType, transfer);
+}
+
+template <typename DType>
+const typename DType::TransferType *TypedTexture<DType>::Encode(
+    const HostType *data, size_t /*size*/,
+    std::vector<TransferType> * /*staging*/, std::true_type) {
+  return data;
+}
+
+template <typename DType>
+const typename DType::TransferType *TypedTexture<DType>::Encode(
+    const HostType *data, size_t size, std::vector<TransferType> *staging,
+    std::false_type) {
+  staging->resize(size);
+  for (size_t i = 0; i != size; ++i) {
+    (*staging)[i] = DType::Encode(data[i]);
+  }
+  return staging->data();
+}
+
+template <typename DType>
+void TypedTexture<DType>::GetData(HostType *data) const {
+  GetData(data, SameType());
+}
+
+template <typename DType>
+void TypedTexture<DType>::GetData(HostType *data, std::true_type) const {
+  Texture::GetData(DType::kFormat, DType::kType, data);
+}
+
+template <typename DType>
+void TypedTexture<DType>::GetData(HostType *data, std::false_type) const {
+  std::vector<TransferType> staging(size());
+  Texture::GetData(DType::kFormat, DType::kType, staging.data());
+  for (size_t i = 0; i != staging.size(); ++i) {
+    data[i] = DType::Decode(staging[i]);
+  }
+}
+
+template <typename DType>
+MirroredTensor<DType>::MirroredTensor(GLsizei width, GLsizei height)
+    : host_(static_cast<size_t>(width) * height * DType::kLanes),
+      device_(Workspace::GetInstance().CreateTexture<DType>(nullptr, width,
+                                                            height)),
+      host_valid_(true), device_valid_(false), num_uploads_(0),
+      num_downloads_(0) {}
+
+template <typename DType>
+const typename DType::HostType *MirroredTensor<DType>::host_data() {
+  if (!host_valid_) {
+    device_.GetData(host_.data());
+    host_valid_ = true;
+    ++num_downloads_;
+  }
+  return host_.data();
+}
+
+template <typename DType>
+typename DType::HostType *MirroredTensor<DType>::mutable_host_data() {
+  host_data();
+  device_valid_ = false;
+  return host_.data();
+}
+
+template <typename DType>
+TypedTexture<DType> *MirroredTensor<DType>::device() {
+  if (!device_valid_) {
+    device_.SetData(host_.data());
+    device_valid_ = true;
+    ++num_uploads_;
+  }
+  return &device_;
+}
+
+template <typename DType>
+TypedTexture<DType> *MirroredTensor<DType>::mutable_device() {
+  device_valid_ = true;
+  host_valid_ = false;
+  return &device_;
+}
+
+QuantParams Quantize(const GLfloat *data, GLsizei rows, GLsizei cols,
+                     bool per_channel, GLubyte *quantized) {
+  QuantParams params;
+
+  GLsizei num_channels = per_channel ? rows : 1;
+  auto channel_size = static_cast<size_t>(rows) * cols / num_channels;
+
+  for (GLsizei channel = 0; channel != num_channels; ++channel) {
+    const GLfloat *begin = data + channel * channel_size;
+    GLubyte *out = quantized + channel * channel_size;
+
+    // The range must contain 0 so that 0 is exactly representable.
+    GLfloat min = 0.0f, max = 0.0f;
+    for (size_t i = 0; i != channel_size; ++i) {
+      min = std::min(min, begin[i]);
+      max = std::max(max, begin[i]);
+    }
+
+    GLfloat scale = (max - min) / 255.0f;
+    if (scale == 0.0f) {
+      scale = 1.0f;
+    }
+    auto zero_point = static_cast<GLint>(std::round(-min / scale));
+    zero_point = std::max(0, std::min(255, zero_point));
+
+    for (size_t i = 0; i != channel_size; ++i) {
+      auto q = static_cast<GLint>(std::round(begin[i] / scale)) + zero_point;
+      out[i] = static_cast<GLubyte>(std::max(0, std::min(255, q)));
+    }
+
+    params.scales.push_back(scale);
+    params.zero_points.push_back(zero_point);
+  }
+
+  return params;
+}
+
+QuantizedTexture::QuantizedTexture(TypedTexture<dtype::UInt8x4Integer> data,
+                                   TypedTexture<dtype::Float32x4> params,
+                                   GLsizei rows, GLsizei cols, bool per_channel)
+    : data_(std::move(data)), params_(std::move(params)), rows_(rows),
+      cols_(cols), per_channel_(per_channel) {}
+
+Nhwc4Tensor::Nhwc4Tensor(TypedTexture<dtype::Float32x4> texture,
+                         GLsizei batch, GLsizei height, GLsizei width,
+                         GLsizei channels)
+    : texture_(std::move(texture)), batch_(batch), height_(height),
+      width_(width), channels_(channels) {}
+
+void Nhwc4Tensor::GetData(GLfloat *nhwc) const {
+  std::vector<GLfloat> packed(static_cast<size_t>(texture_.size()) * 4);
+  texture_.GetData(packed.data());
+
+  size_t num_pixels = static_cast<size_t>(batch_) * height_ * width_;
+  for (size_t pixel = 0; pixel != num_pixels; ++pixel) {
+    std::memcpy(nhwc + pixel * channels_, &packed[pixel * c4() * 4],
+                sizeof(GLfloat) * channels_);
+  }
+}
+
+Conv2dFilter::Conv2dFilter(
+    TypedTexture<dtype::Float32x4> weights,
+    TypedTexture<dtype::Float32x4> bias,
+    std::unique_ptr<TypedTexture<dtype::Float32x4>> winograd_weights,
+    GLsizei kernel_h, GLsizei kernel_w, GLsizei in_channels,
+    GLsizei out_channels)
+    : weights_(std::move(weights)), bias_(std::move(bias)),
+      winograd_weights_(std::move(winograd_weights)), kernel_h_(kernel_h),
+      kernel_w_(kernel_w), in_channels_(in_channels),
+      out_channels_(out_channels) {}
+
+StagingRing::StagingRing(GLsizeiptr capacity)
+    : buffer_(kInvalidBuffer), mapped_(nullptr), capacity_(capacity),
+      head_(0) {
+  auto &workspace = Workspace::GetInstance();
+  if (!workspace.HasVersion(4, 4)
+      && !workspace.HasExtension("GL_ARB_buffer_storage")) {
+    std::cerr << "Staging rings need OpenGL 4.4 or GL_ARB_buffer_storage."
+              << std::endl;
+    assert(false);
+  }
+
+  GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT
+                     | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+  OPENGL_CALL(glGenBuffers(1, &buffer_));
+  OPENGL_CALL(glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_));
+  OPENGL_CALL(glBufferStorage(GL_COPY_WRITE_BUFFER, capacity_, nullptr,
+                              flags));
+  mapped_ = glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, capacity_, flags);
+  OPENGL_CHECK_ERROR();
+  OPENGL_CALL(glBindBuffer(GL_COPY_WRITE_BUFFER, 0));
+
+  std::clog << "Created staging ring [" << buffer_ << "] of " << capacity_
+            << " bytes" << std::endl;
+}
+
+StagingRing::StagingRing(StagingRing &&other) noexcept
+    : buffer_(other.buffer_), mapped_(other.mapped_),
+      capacity_(other.capacity_), head_(other.head_),
+      in_flight_(std::move(other.in_flight_)) {
+  other.buffer_ = kInvalidBuffer;
+  other.mapped_ = nullptr;
+  other.in_flight_.clear();
+}
+
+StagingRing::~StagingRing() {
+  for (auto &region : in_flight_) {
+    if (region.fence != nullptr) {
+      WaitFence(region.fence);
+      glDeleteSync(region.fence);
+    }
+  }
+  in_flight_.clear();
+
+  if (buffer_ != kInvalidBuffer) {
+    std::clog << "Deleting staging ring [" << buffer_ << "]" << std::endl;
+    OPENGL_CALL(glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_));
+    OPENGL_CALL(glUnmapBuffer(GL_COPY_WRITE_BUFFER));
+    OPENGL_CALL(glBindBuffer(GL_COPY_WRITE_BUFFER, 0));
+    OPENGL_CALL(glDeleteBuffers(1, &buffer_));
+    buffer_ = kInvalidBuffer;
+  }
+}
+
+StagingRing::Region StagingRing::Acquire(GLsizeiptr size) {
+  GLsizeiptr aligned_size = (size + kAlignment - 1) / kAlignment * kAlignment;
+  if (aligned_size > capacity_) {
+    std::cerr << "Staging ring too small: " << size << " > " << capacity_
+              << " bytes." << std::endl;
+    assert(false);
+  }
+
+  // Wrap around rather than splitting a region.
+  if (head_ + aligned_size > capacity_) {
+    head_ = 0;
+  }
+  GLintptr begin = head_;
+  GLintptr end = head_ + aligned_size;
+
+  // Retire everything that overlaps the new region.
+  for (auto it = in_flight_.begin(); it != in_flight_.end();) {
+    if (it->end <= begin || it->begin >= end) {
+      ++it;
+      continue;
+    }
+    if (it->fence == nullptr || it->readback) {
+      std::cerr << "Staging ring overflow: a region is still owned by the "
+                << "host." << std::endl;
+      assert(false);
+    }
+    WaitFence(it->fence);
+    glDeleteSync(it->fence);
+    it = in_flight_.erase(it);
+  }
+
+  in_flight_.push_back(InFlight{begin, end, nullptr, false});
+  head_ = end;
+
+  return Region{static_cast<char *>(mapped_) + begin, begin, size};
+}
+
+void StagingRing::Fence(const Region &region, bool readback) {
+  for (auto &in_flight : in_flight_) {
+    if (in_flight.begin == region.offset) {
+      if (in_flight.fence != nullptr) {
+        glDeleteSync(in_flight.fence);
+      }
+      in_flight.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      in_flight.readback = readback;
+      OPENGL_CHECK_ERROR();
+      return;
+    }
+  }
+  std::cerr << "Unknown staging region at offset " << region.offset
+            << std::endl;
+  assert(false);
+}
+
+void StagingRing::Wait(const Region &region) {
+  for (auto &in_flight : in_flight_) {
+    if (in_flight.begin == region.offset && in_flight.fence != nullptr) {
+      WaitFence(in_flight.fence);
+      return;
+    }
+  }
+}
+
+void StagingRing::Release(const Region &region) {
+  for (auto it = in_flight_.begin(); it != in_flight_.end(); ++it) {
+    if (it->begin == region.offset && it->readback) {
+      WaitFence(it->fence);
+      glDeleteSync(it->fence);
+      in_flight_.erase(it);
+      return;
+    }
+  }
+  std::cerr << "Not a pending readback at offset " << region.offset
+            << std::endl;
+  assert(false);
+}
+
+void StagingRing::WaitFence(GLsync fence) {
+  // Flush on the first wait, so that the fence is guaranteed to signal.
+  GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+  while (true) {
+    GLenum status = glClientWaitSync(fence, flags, /*timeout=*/1000000000);
+    if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+      return;
+    }
+    if (status == GL_WAIT_FAILED) {
+      OPENGL_CHECK_ERROR();
+      assert(false);
+    }
+    flags = 0;
+  }
+}
+
+HostArena::HostArena(size_t capacity, HugePages huge_pages)
+    : data_(nullptr), capacity_(capacity), used_(0), mapped_(false),
+      raw_(nullptr) {
+#ifdef __linux__
+  if (huge_pages != HugePages::kNone) {
+    capacity_ = (capacity_ + kHugePageSize - 1) / kHugePageSize
+                * kHugePageSize;
+  }
+
+  void *data = MAP_FAILED;
+  if (huge_pages == HugePages::kExplicit) {
+    data = mmap(nullptr, capacity_, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1,
+                0);
+    if (data == MAP_FAILED) {
+      std::cerr << "No explicit huge pages available, using transparent ones."
+                << std::endl;
+      huge_pages = HugePages::kTransparent;
+    }
+  }
+  if (data == MAP_FAILED) {
+    data = mmap(nullptr, capacity_, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+      std::cerr << "mmap() failed for a " << capacity_ << "-byte arena."
+                << std::endl;
+      assert(false);
+    }
+    // Must come before the first touch, so that pages are faulted in huge.
+    if (huge_pages == HugePages::kTransparent) {
+      madvise(data, capacity_, MADV_HUGEPAGE);
+    }
+    // Fault everything in now rather than on the request path.
+    std::memset(data, 0, capacity_);
+  }
+
+  data_ = static_cast<char *>(data);
+  mapped_ = true;
+#else
+  (void)huge_pages;
+  raw_ = new char[capacity_ + kAlignment];
+  auto address = reinterpret_cast<uintptr_t>(raw_);
+  data_ = raw_ + (kAlignment - address % kAlignment) % kAlignment;
+  std::memset(data_, 0, capacity_);
+#endif
+}
+
+HostArena::~HostArena() {
+#ifdef __linux__
+  if (mapped_) {
+    munmap(data_, capacity_);
+  }
+#endif
+  delete[] raw_;
+}
+
+void *HostArena::Allocate(size_t bytes) {
+  size_t begin = (used_ + kAlignment - 1) / kAlignment * kAlignment;
+  if (begin + bytes > capacity_) {
+    std::cerr << "Host arena exhausted: " << begin << " + " << bytes << " > "
+              << capacity_ << " bytes." << std::endl;
+    assert(false);
+    return nullptr;
+  }
+  used_ = begin + bytes;
+  return data_ + begin;
+}
+
+TensorFile::TensorFile(const std::string &path)
+    : file_data_(nullptr), file_size_(0), values_offset_(0) {
+#ifndef _WIN32
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Cannot open " << path << std::endl;
+    assert(false);
+  }
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0) {
+    close(fd);
+    std::cerr << "Cannot stat " << path << std::endl;
+    assert(false);
+  }
+  file_size_ = static_cast<size_t>(file_stat.st_size);
+
+  void *data = mmap(nullptr, file_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    std::cerr << "Cannot map " << path << std::endl;
+    assert(false);
+  }
+  madvise(data, file_size_, MADV_SEQUENTIAL);
+  file_data_ = static_cast<const char *>(data);
+#else
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    std::cerr << "Cannot open " << path << std::endl;
+    assert(false);
+  }
+  buffer_.assign(std::istreambuf_iterator<char>(in),
+                 std::istreambuf_iterator<char>());
+  file_data_ = buffer_.data();
+  file_size_ = buffer_.size();
+#endif
+}
+
+TensorFile::TensorFile(TensorFile &&other) noexcept
+    : file_data_(other.file_data_), file_size_(other.file_size_),
+      values_offset_(other.values_offset_), descr_(std::move(other.descr_)),
+      shape_(std::move(other.shape_)), buffer_(std::move(other.buffer_)) {
+  other.file_data_ = nullptr;
+}
+
+TensorFile::~TensorFile() {
+#ifndef _WIN32
+  if (file_data_ != nullptr) {
+    munmap(const_cast<char *>(file_data_), file_size_);
+  }
+#endif
+}
+
+TensorFile TensorFile::OpenNpy(const std::string &path) {
+  TensorFile file(path);
+  file.ParseNpyHeader();
+  return file;
+}
+
+TensorFile TensorFile::OpenRaw(const std::string &path,
+                               const std::string &descr,
+                               const std::vector<size_t> &shape) {
+  TensorFile file(path);
+  file.descr_ = descr;
+  file.shape_ = shape;
+  return file;
+}
+
+size_t TensorFile::num_values() const {
+  size_t num_values = 1;
+  for (size_t dim : shape_) {
+    num_values *= dim;
+  }
+  return num_values;
+}
+
+// https://numpy.org/doc/stable/reference/generated/numpy.lib.format.html
+// "\x93NUMPY", major, minor, header length (2 bytes in 1.0, 4 bytes after),
+// then a Python dict literal such as
+//   {'descr': '<f4', 'fortran_order': False, 'shape': (3, 4), }
+void TensorFile::ParseNpyHeader() {
+  if (file_size_ < 10 || std::memcmp(file_data_, "\x93NUMPY", 6) != 0) {
+    std::cerr << "Not a .npy file." << std::endl;
+    assert(false);
+  }
+
+  auto bytes = reinterpret_cast<const unsigned char *>(file_data_);
+  int major = bytes[6];
+  size_t header_size;
+  if (major == 1) {
+    header_size = bytes[8] | (bytes[9] << 8);
+    values_offset_ = 10 + header_size;
+  } else {
+    header_size = bytes[8] | (bytes[9] << 8) | (bytes[10] << 16)
+                  | (static_cast<size_t>(bytes[11]) << 24);
+    values_offset_ = 12 + header_size;
+  }
+  std::string header(file_data_ + values_offset_ - header_size, header_size);
+
+  auto find_value = [&header](const std::string &key) {
+    size_t pos = header.find("'" + key + "'");
+    if (pos == std::string::npos) {
+      std::cerr << "Missing " << key << " in .npy header." << std::endl;
+      assert(false);
+    }
+    pos = header.find(':', pos);
+    return header.find_first_not_of(' ', pos + 1);
+  };
+
+  size_t descr_begin = find_value("descr") + 1;
+  descr_ = header.substr(descr_begin,
+                         header.find('\'', descr_begin) - descr_begin);
+
+  if (header.compare(find_value("fortran_order"), 4, "True") == 0) {
+    std::cerr << "Fortran-ordered .npy files are not supported." << std::endl;
+    assert(false);
+  }
+
+  size_t pos = find_value("shape") + 1;
+  size_t shape_end = header.find(')', pos);
+  shape_.clear();
+  while (pos < shape_end) {
+    size_t digit = header.find_first_of("0123456789", pos);
+    if (digit >= shape_end) {
+      break;
+    }
+    size_t end = header.find_first_not_of("0123456789", digit);
+    shape_.push_back(std::stoul(header.substr(digit, end - digit)));
+    pos = end;
+  }
+}
+
+void TensorFile::Drop(size_t begin, size_t end) const {
+#ifndef _WIN32
+  // Only whole pages can be dropped.
+  auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  size_t first = (values_offset_ + begin + page_size - 1) / page_size
+                 * page_size;
+  size_t last = (values_offset_ + end) / page_size * page_size;
+  if (first < last) {
+    madvise(const_cast<char *>(file_data_) + first, last - first,
+            MADV_DONTNEED);
+  }
+#else
+  (void)begin;
+  (void)end;
+#endif
+}
+
+namespace {
+
+const char kCheckpointMagic[8] = {'G', 'L', 'T', 'C', 'K', 'P', 'T', '1'};
+
+const uint32_t kCheckpointVersion = 1;
+
+const size_t kCheckpointHeaderSize = 64;
+
+const size_t kCheckpointAlignment = 64;
+
+// 64-bit FNV-1a.
+const uint64_t kChecksumSeed = 0xcbf29ce484222325ull;
+
+uint64_t UpdateChecksum(uint64_t checksum, const char *data, size_t size) {
+  for (size_t i = 0; i != size; ++i) {
+    checksum ^= static_cast<unsigned char>(data[i]);
+    checksum *= 0x100000001b3ull;
+  }
+  return checksum;
+}
+
+template <typename T>
+void Put(std::string *out, T value) {
+  char bytes[sizeof(T)];
+  std::memcpy(bytes, &value, sizeof(T));
+  out->append(bytes, sizeof(T));
+}
+
+template <typename T>
+T Get(const char **in) {
+  T value;
+  std::memcpy(&value, *in, sizeof(T));
+  *in += sizeof(T);
+  return value;
+}
+
+// Bytes per texel of a stored tensor, before encoding.
+size_t CheckpointTexelSize(const CheckpointEntry &entry) {
+  if (entry.target == GL_TEXTURE_BUFFER) {
+    return gl::TexelSize(entry.internal_format);
+  }
+  return gl::PixelSize(entry.format, entry.type);
+}
+
+// The type that goes through the staging ring.
+GLenum CheckpointTransferType(const CheckpointEntry &entry) {
+  return entry.encoding == CheckpointEntry::kFloat16 ? GL_HALF_FLOAT
+                                                     : entry.type;
+}
+
+}  // namespace
+
+CheckpointWriter::CheckpointWriter(const std::string &path, StagingRing *ring,
+                                   size_t chunk_size)
+    : out_(path, std::ios::binary), ring_(ring),
+      chunk_size_(std::min(chunk_size,
+                           static_cast<size_t>(ring->capacity())
+                               / (kMaxInFlight + 1) / StagingRing::kAlignment
+                               * StagingRing::kAlignment)),
+      offset_(kCheckpointHeaderSize), finished_(false) {
+  if (!out_) {
+    std::cerr << "Cannot create " << path << std::endl;
+    assert(false);
+  }
+
+  // Every pending readback keeps its region until written out.
+  if (chunk_size_ == 0) {
+    std::cerr << "Staging ring too small for a checkpoint: "
+              << ring->capacity() << " < "
+              << (kMaxInFlight + 1) * StagingRing::kAlignment << " bytes."
+              << std::endl;
+    assert(false);
+  }
+
+  // Filled in by Finish().
+  char header[kCheckpointHeaderSize] = {};
+  out_.write(header, kCheckpointHeaderSize);
+}
+
+CheckpointWriter::~CheckpointWriter() {
+  if (!finished_) {
+    Finish();
+  }
+}
+
+void CheckpointWriter::Add(const std::string &name, const Texture &texture,
+                           CheckpointEntry::Encoding encoding) {
+  bool is_float = texture.target() == GL_TEXTURE_2D
+                  && texture.type() == GL_FLOAT;
+  if (encoding != CheckpointEntry::kRaw && !is_float) {
+    std::cerr << "Only float 2D textures can be encoded." << std::endl;
+    assert(false);
+  }
+
+  CheckpointEntry entry;
+  entry.name = name;
+  entry.encoding = encoding;
+  entry.target = texture.target();
+  entry.internal_format = texture.internal_format();
+  entry.format = texture.format();
+  entry.type = texture.type();
+  entry.width = texture.width();
+  entry.height = texture.height();
+  entry.chunk_size = chunk_size_;
+  entry.offset = 0;  // Known when the first chunk gets written.
+  entry.size = 0;
+  entry.checksum = kChecksumSeed;
+  entries_.push_back(entry);
+
+  auto &workspace = Workspace::GetInstance();
+  size_t texel_size = CheckpointTexelSize(entry);
+  GLenum type = CheckpointTransferType(entry);
+  size_t transfer_texel_size = entry.target == GL_TEXTURE_BUFFER
+      ? texel_size : gl::PixelSize(entry.format, type);
+
+  ForEachChunk(entry.width, entry.height, texel_size, chunk_size_,
+               [&](GLint x, GLint y, GLsizei width, GLsizei height) {
+    // Write out older chunks while this one is being read back.
+    if (in_flight_.size() >= kMaxInFlight) {
+      WriteOne();
+    }
+
+    size_t size = transfer_texel_size * width * height;
+    StagingRing::Region region = ring_->Acquire(
+        static_cast<GLsizeiptr>(size));
+    workspace.Download(texture, ring_, region, x, y, width, height, type);
+
+    size_t num_values = size / (type == GL_HALF_FLOAT ? 2 : 4);
+    in_flight_.push_back(InFlight{region, entries_.size() - 1, num_values});
+  });
+}
+
+void CheckpointWriter::WriteOne() {
+  InFlight chunk = in_flight_.front();
+  in_flight_.pop_front();
+  ring_->Wait(chunk.region);
+
+  CheckpointEntry &entry = entries_[chunk.entry];
+  if (entry.size == 0) {
+    // Pad to the alignment.
+    uint64_t aligned_offset = (offset_ + kCheckpointAlignment - 1)
+                              / kCheckpointAlignment * kCheckpointAlignment;
+    std::string padding(aligned_offset - offset_, '\0');
+    out_.write(padding.data(), static_cast<std::streamsize>(padding.size()));
+    offset_ = aligned_offset;
+    entry.offset = offset_;
+  }
+
+  auto data = static_cast<const char *>(chunk.region.data);
+  size_t size = static_cast<size_t>(chunk.region.size);
+
+  if (entry.encoding == CheckpointEntry::kInt8) {
+    auto values = reinterpret_cast<const GLfloat *>(data);
+    std::vector<GLubyte> quantized(chunk.num_values);
+    QuantParams params = Quantize(values, 1,
+                                  static_cast<GLsizei>(chunk.num_values),
+                                  /*per_channel=*/false, quantized.data());
+
+    encoded_.clear();
+    std::string chunk_header;
+    Put<GLfloat>(&chunk_header, params.scales[0]);
+    Put<int32_t>(&chunk_header, params.zero_points[0]);
+    encoded_.insert(encoded_.end(), chunk_header.begin(), chunk_header.end());
+    encoded_.insert(encoded_.end(), quantized.begin(), quantized.end());
+
+    data = encoded_.data();
+    size = encoded_.size();
+  }
+
+  out_.write(data, static_cast<std::streamsize>(size));
+  entry.checksum = UpdateChecksum(entry.checksum, data, size);
+  entry.size += size;
+  offset_ += size;
+
+  ring_->Release(chunk.region);
+}
+
+void CheckpointWriter::Finish() {
+  while (!in_flight_.empty()) {
+    WriteOne();
+  }
+
+  std::string index;
+  for (auto &entry : entries_) {
+    Put<uint32_t>(&index, static_cast<uint32_t>(entry.name.size()));
+    index += entry.name;
+    Put<uint32_t>(&index, entry.encoding);
+    Put<uint32_t>(&index, entry.target);
+    Put<uint32_t>(&index, entry.internal_format);
+    Put<uint32_t>(&index, entry.format);
+    Put<uint32_t>(&index, entry.type);
+    Put<int32_t>(&index, entry.width);
+    Put<int32_t>(&index, entry.height);
+    Put<uint64_t>(&index, entry.chunk_size);
+    Put<uint64_t>(&index, entry.offset);
+    Put<uint64_t>(&index, entry.size);
+    Put<uint64_t>(&index, entry.checksum);
+  }
+  out_.write(index.data(), static_cast<std::streamsize>(index.size()));
+
+  std::string header(kCheckpointMagic, sizeof(kCheckpointMagic));
+  Put<uint32_t>(&header, kCheckpointVersion);
+  Put<uint32_t>(&header, static_cast<uint32_t>(entries_.size()));
+  Put<uint64_t>(&header, offset_);
+  Put<uint64_t>(&header, index.size());
+  Put<uint64_t>(&header,
+                UpdateChecksum(kChecksumSeed, index.data(), index.size()));
+  header.resize(kCheckpointHeaderSize, '\0');
+  out_.seekp(0);
+  out_.write(header.data(), static_cast<std::streamsize>(header.size()));
+  out_.close();
+
+  finished_ = true;
+}
+
+CheckpointReader::CheckpointReader(const std::string &path)
+    : in_(path, std::ios::binary) {
+  char header[kCheckpointHeaderSize];
+  if (!in_.read(header, kCheckpointHeaderSize)
+      || std::memcmp(header, kCheckpointMagic, sizeof(kCheckpointMagic))
+             != 0) {
+    std::cerr << path << " is not a checkpoint." << std::endl;
+    assert(false);
+  }
+
+  const char *in = header + sizeof(kCheckpointMagic);
+  auto version = Get<uint32_t>(&in);
+  auto num_entries = Get<uint32_t>(&in);
+  auto index_offset = Get<uint64_t>(&in);
+  auto index_size = Get<uint64_t>(&in);
+  auto index_checksum = Get<uint64_t>(&in);
+  if (version != kCheckpointVersion) {
+    std::cerr << "Unsupported checkpoint version " << version << std::endl;
+    assert(false);
+  }
+
+  std::vector<char> index(index_size);
+  in_.seekg(static_cast<std::streamoff>(index_offset));
+  in_.read(index.data(), static_cast<std::streamsize>(index_size));
+  if (!in_ || UpdateChecksum(kChecksumSeed, index.data(), index.size())
+                  != index_checksum) {
+    std::cerr << "Corrupted checkpoint index in " << path << std::endl;
+    assert(false);
+  }
+
+  in = index.data();
+  for (uint32_t i = 0; i != num_entries; ++i) {
+    CheckpointEntry entry;
+    auto name_size = Get<uint32_t>(&in);
+    entry.name.assign(in, name_size);
+    in += name_size;
+    entry.encoding = Get<uint32_t>(&in);
+    entry.target = Get<uint32_t>(&in);
+    entry.internal_format = Get<uint32_t>(&in);
+    entry.format = Get<uint32_t>(&in);
+    entry.type = Get<uint32_t>(&in);
+    entry.width = Get<int32_t>(&in);
+    entry.height = Get<int32_t>(&in);
+    entry.chunk_size = Get<uint64_t>(&in);
+    entry.offset = Get<uint64_t>(&in);
+    entry.size = Get<uint64_t>(&in);
+    entry.checksum = Get<uint64_t>(&in);
+    entries_.push_back(entry);
+  }
+}
+
+const CheckpointEntry *CheckpointReader::Find(const std::string &name) const {
+  for (auto &entry : entries_) {
+    if (entry.name == name) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+void CheckpointReader::Read(const std::string &name, Texture *texture,
+                            StagingRing *ring) {
+  const CheckpointEntry *entry = Find(name);
+  if (entry == nullptr) {
+    std::cerr << "No tensor " << name << " in checkpoint." << std::endl;
+    assert(false);
+  }
+  if (texture->target() != entry->target
+      || texture->internal_format() != entry->internal_format
+      || texture->width() != entry->width
+      || texture->height() != entry->height) {
+    std::cerr << "Tensor " << name << " does not fit the texture."
+              << std::endl;
+    assert(false);
+  }
+
+  auto &workspace = Workspace::GetInstance();
+  size_t texel_size = CheckpointTexelSize(*entry);
+  GLenum type = CheckpointTransferType(*entry);
+  size_t transfer_texel_size = entry->target == GL_TEXTURE_BUFFER
+      ? texel_size : gl::PixelSize(entry->format, type);
+
+  uint64_t checksum = kChecksumSeed;
+  in_.seekg(static_cast<std::streamoff>(entry->offset));
+
+  ForEachChunk(entry->width, entry->height, texel_size,
+               static_cast<size_t>(entry->chunk_size),
+               [&](GLint x, GLint y, GLsizei width, GLsizei height) {
+    size_t size = transfer_texel_size * width * height;
+    StagingRing::Region region = ring->Acquire(static_cast<GLsizeiptr>(size));
+
+    if (entry->encoding == CheckpointEntry::kInt8) {
+      // Dequantize from a small host buffer into the staging memory.
+      size_t num_values = size / sizeof(GLfloat);
+      encoded_.resize(8 + num_values);
+      in_.read(encoded_.data(), static_cast<std::streamsize>(encoded_.size()));
+      checksum = UpdateChecksum(checksum, encoded_.data(), encoded_.size());
+
+      const char *in = encoded_.data();
+      auto scale = Get<GLfloat>(&in);
+      auto zero_point = Get<int32_t>(&in);
+      auto quantized = reinterpret_cast<const GLubyte *>(in);
+      auto values = static_cast<GLfloat *>(region.data);
+      for (size_t i = 0; i != num_values; ++i) {
+        values[i] = scale * (static_cast<int32_t>(quantized[i]) - zero_point);
+      }
+    } else {
+      // Straight from the file into the staging memory.
+      in_.read(static_cast<char *>(region.data),
+               static_cast<std::streamsize>(size));
+      checksum = UpdateChecksum(checksum,
+                                static_cast<const char *>(region.data), size);
+    }
+
+    workspace.Upload(ring, region, texture, x, y, width, height, type);
+  });
+
+  if (!in_ || checksum != entry->checksum) {
+    std::cerr << "Corrupted tensor " << name << " in checkpoint." << std::endl;
+    assert(false);
+  }
+}
+
+TiledMatmul::TiledMatmul(GLsizei tile_size, GLsizei tile_depth)
+    : tile_size_(tile_size), tile_depth_(tile_depth),
+      program_(Workspace::GetInstance().CreateProgram(
+          matmul_accumulate_shader_text)),
+      ring_(Workspace::GetInstance().CreateStagingRing(
+          StagingBytes(tile_size, tile_depth))) {
+  auto &workspace = Workspace::GetInstance();
+  for (int i = 0; i != 2; ++i) {
+    a_tiles_.push_back(workspace.CreateTexture(nullptr, tile_depth,
+                                               tile_size));
+    b_tiles_.push_back(workspace.CreateTexture(nullptr, tile_size,
+                                               tile_depth));
+    c_tiles_.push_back(workspace.CreateTexture(nullptr, tile_size,
+                                               tile_size));
+  }
+}
+
+GLsizeiptr TiledMatmul::StagingBytes(GLsizei tile_size, GLsizei tile_depth) {
+  GLsizeiptr region = sizeof(GLfloat) * static_cast<GLsizeiptr>(tile_size)
+                      * std::max(tile_size, tile_depth);
+  region = (region + StagingRing::kAlignment - 1) / StagingRing::kAlignment
+           * StagingRing::kAlignment;
+  return 6 * region;
+}
+
+size_t TiledMatmul::DeviceBytes(GLsizei tile_size, GLsizei tile_depth) {
+  size_t texel_size = gl::TexelSize(GL_RGBA32F);
+  size_t tile = static_cast<size_t>(tile_size) * texel_size;
+  return 2 * tile * (2 * tile_depth + tile_size);
+}
+
+GLsizei TiledMatmul::TileSizeFor(size_t bytes) {
+  // 6 square tiles.
+  auto tile_size = static_cast<GLsizei>(
+      std::sqrt(bytes / (6.0 * gl::TexelSize(GL_RGBA32F))));
+  while (tile_size > 1 && DeviceBytes(tile_size, tile_size) > bytes) {
+    --tile_size;
+  }
+  return tile_size;
+}
+
+void TiledMatmul::UploadTile(const GLfloat *matrix, GLsizei ld, GLsizei row,
+                             GLsizei col, GLsizei rows, GLsizei cols,
+                             Texture *texture) {
+  size_t row_size = sizeof(GLfloat) * cols;
+  StagingRing::Region region = ring_.Acquire(
+      static_cast<GLsizeiptr>(row_size * rows));
+
+  auto dst = static_cast<char *>(region.data);
+  for (GLsizei i = 0; i != rows; ++i) {
+    std::memcpy(dst + row_size * i,
+                matrix + static_cast<size_t>(row + i) * ld + col, row_size);
+  }
+
+  Workspace::GetInstance().Upload(&ring_, region, texture, 0, 0, cols, rows);
+}
+
+void TiledMatmul::FinishTile(GLfloat *c, GLsizei N) {
+  PendingTile tile = pending_.front();
+  pending_.pop_front();
+  ring_.Wait(tile.region);
+
+  size_t row_size = sizeof(GLfloat) * tile.cols;
+  auto src = static_cast<const char *>(tile.region.data);
+  for (GLsizei i = 0; i != tile.rows; ++i) {
+    std::memcpy(c + static_cast<size_t>(tile.row + i) * N + tile.col,
+                src + row_size * i, row_size);
+  }
+
+  ring_.Release(tile.region);
+}
+
+void TiledMatmul::Run(const GLfloat *a, const GLfloat *b, GLfloat *c,
+                      GLsizei M, GLsizei N, GLsizei K) {
+  auto &workspace = Workspace::GetInstance();
+
+  GLsizei num_steps = (K + tile_depth_ - 1) / tile_depth_;
+  for (GLsizei row = 0; row < M; row += tile_size_) {
+    GLsizei rows = std::min(tile_size_, M - row);
+    for (GLsizei col = 0; col < N; col += tile_size_) {
+      GLsizei cols = std::min(tile_size_, N - col);
+
+      // Edge tiles only use the top-left corner of the textures; the rest of
+      // C is computed from stale data and never read back.
+      auto upload = [&](GLsizei step) {
+        GLsizei k = step * tile_depth_;
+        GLsizei depth = std::min(tile_depth_, K - k);
+        UploadTile(a, K, row, k, rows, depth, &a_tiles_[step % 2]);
+        UploadTile(b, N, k, col, depth, cols, &b_tiles_[step % 2]);
+      };
+
+      upload(0);
+      for (GLsizei step = 0; step != num_steps; ++step) {
+        // Overlap the next transfer with this block.
+        if (step + 1 != num_steps) {
+          upload(step + 1);
+        }
+
+        GLsizei depth = std::min(tile_depth_, K - step * tile_depth_);
+        workspace.Dispatch(program_,
+                           {{"A", &a_tiles_[step % 2]},
+                            {"B", &b_tiles_[step % 2]},
+                            {"C_in", &c_tiles_[(step + 1) % 2]}},
+                           {{"K", depth}, {"accumulate", step != 0}},
+                           &c_tiles_[step % 2]);
+
+        // The previous C tile is done by now.
+        if (step == 0 && !pending_.empty()) {
+          FinishTile(c, N);
+        }
+      }
+
+      StagingRing::Region region = ring_.Acquire(
+          static_cast<GLsizeiptr>(sizeof(GLfloat) * rows * cols));
+      workspace.Download(c_tiles_[(num_steps - 1) % 2], &ring_, region, 0, 0,
+                         cols, rows, GL_FLOAT);
+      pending_.push_back(PendingTile{region, row, col, rows, cols});
+    }
+  }
+
+  while (!pending_.empty()) {
+    FinishTile(c, N);
+  }
+}
+
+int KernelGraph::AddExternal(std::shared_ptr<Texture> texture, GLsizei rows,
+                             GLsizei cols) {
+  values_.push_back(Value{rows, cols, std::move(texture),
+                          ValueKind::kExternal, /*row=*/0});
+  return static_cast<int>(values_.size()) - 1;
+}
+
+int KernelGraph::AddIntermediate(GLsizei rows, GLsizei cols) {
+  values_.push_back(Value{rows, cols, nullptr, ValueKind::kIntermediate,
+                          /*row=*/0});
+  planned_ = false;
+  return static_cast<int>(values_.size()) - 1;
+}
+
+int KernelGraph::AddInput(GLsizei rows, GLsizei cols) {
+  values_.push_back(Value{rows, cols, nullptr, ValueKind::kInput,
+                          /*row=*/0});
+  inputs_.push_back(static_cast<int>(values_.size()) - 1);
+  return inputs_.back();
+}
+
+void KernelGraph::Bind(size_t index, std::shared_ptr<Texture> texture) {
+  Value &value = values_[inputs_[index]];
+  if (texture->height() != value.rows || texture->width() != value.cols) {
+    std::cerr << "Input " << index << " must be " << value.rows << "x"
+              << value.cols << std::endl;
+    assert(false);
+  }
+  value.texture = std::move(texture);
+}
+
+void KernelGraph::Run() {
+  for (int input : inputs_) {
+    if (values_[input].texture == nullptr) {
+      std::cerr << "Unbound graph input." << std::endl;
+      assert(false);
+    }
+  }
+
+  if (!planned_) {
+    Plan();
+  }
+
+  for (auto &kernel : kernels_) {
+    Dispatch(kernel);
+  }
+}
+
+void KernelGraph::Dispatch(const Kernel &kernel) {
+  std::vector<std::pair<std::string, Texture *>> inputs;
+  std::vector<std::pair<std::string, int>> uniforms = kernel.uniforms;
+  for (auto &input : kernel.inputs) {
+    const Value &value = values_[input.second];
+    inputs.emplace_back(input.first, value.texture.get());
+    uniforms.emplace_back(input.first + "_row0", value.row);
+  }
+
+  const Value &output = values_[kernel.output];
+  uniforms.emplace_back("out_row0", output.row);
+  Workspace::GetInstance().Dispatch(*kernel.program, inputs, uniforms,
+                                    output.texture.get(), 0, output.row,
+                                    output.cols, output.rows);
+}
+
+void KernelGraph::Lifetimes(std::vector<int> *first,
+                            std::vector<int> *last) const {
+  first->assign(values_.size(), -1);
+  last->assign(values_.size(), -1);
+  for (size_t k = 0; k != kernels_.size(); ++k) {
+    auto touch = [&](int value) {
+      if ((*first)[value] == -1) {
+        (*first)[value] = static_cast<int>(k);
+      }
+      (*last)[value] = static_cast<int>(k);
+    };
+    for (auto &input : kernels_[k].inputs) {
+      touch(input.second);
+    }
+    touch(kernels_[k].output);
+  }
+}
+
+void KernelGraph::Plan() {
+  auto &workspace = Workspace::GetInstance();
+
+  GLint max_rows;
+  OPENGL_CALL(glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_rows));
+
+  std::vector<int> first, last;
+  Lifetimes(&first, &last);
+
+  std::vector<bool> is_output(values_.size(), false);
+  for (int value : outputs_) {
+    is_output[value] = true;
+  }
+
+  // What a kernel reads cannot share a texture with what it writes.
+  std::vector<std::set<int>> conflicts(values_.size());
+  for (auto &kernel : kernels_) {
+    for (auto &input : kernel.inputs) {
+      conflicts[kernel.output].insert(input.second);
+      conflicts[input.second].insert(kernel.output);
+    }
+  }
+
+  std::vector<int> order;
+  for (size_t i = 0; i != values_.size(); ++i) {
+    Value &value = values_[i];
+    if (value.kind != ValueKind::kIntermediate) {
+      continue;
+    }
+    if (is_output[i]) {
+      if (value.texture == nullptr) {
+        value.texture = std::make_shared<Texture>(
+            workspace.CreateTexture(nullptr, value.cols, value.rows));
+      }
+      value.row = 0;
+    } else if (first[i] != -1) {
+      order.push_back(static_cast<int>(i));
+    }
+  }
+
+  // Largest first; longest lived first among equals.
+  std::sort(order.begin(), order.end(), [&](int a, int b) {
+    if (values_[a].rows != values_[b].rows) {
+      return values_[a].rows > values_[b].rows;
+    }
+    return last[a] - first[a] > last[b] - first[b];
+  });
+
+  struct Arena {
+    GLsizei width;
+    GLsizei height;
+    std::vector<int> values;
+  };
+  std::vector<Arena> arenas;
+  std::vector<int> arena_of(values_.size(), -1);
+
+  for (int value : order) {
+    GLsizei rows = values_[value].rows;
+
+    // The smallest waste wins. Appending after the last band is only
+    // considered when no gap fits, and then the least growth wins.
+    int best_arena = -1;
+    GLint best_row = 0;
+    int64_t best_score = std::numeric_limits<int64_t>::max();
+
+    for (size_t a = 0; a != arenas.size(); ++a) {
+      const Arena &arena = arenas[a];
+
+      bool conflict = false;
+      std::vector<std::pair<GLint, GLint>> busy;
+      for (int other : arena.values) {
+        conflict |= conflicts[value].count(other) != 0;
+        if (first[other] <= last[value] && first[value] <= last[other]) {
+          busy.emplace_back(values_[other].row,
+                            values_[other].row + values_[other].rows);
+        }
+      }
+      if (conflict) {
+        continue;
+      }
+      std::sort(busy.begin(), busy.end());
+
+      GLint end = 0;
+      for (auto &band : busy) {
+        GLint gap = band.first - end;
+        if (gap >= rows && gap - rows < best_score) {
+          best_arena = static_cast<int>(a);
+          best_row = end;
+          best_score = gap - rows;
+        }
+        end = std::max(end, band.second);
+      }
+
+      if (end + rows <= max_rows) {
+        int64_t score = static_cast<int64_t>(max_rows)
+                        + std::max(0, end + rows - arena.height);
+        if (score < best_score) {
+          best_arena = static_cast<int>(a);
+          best_row = end;
+          best_score = score;
+        }
+      }
+    }
+
+    if (best_arena == -1) {
+      best_arena = static_cast<int>(arenas.size());
+      best_row = 0;
+      arenas.push_back(Arena{0, 0, {}});
+    }
+
+    Arena &arena = arenas[best_arena];
+    arena.values.push_back(value);
+    arena.width = std::max(arena.width, values_[value].cols);
+    arena.height = std::max(arena.height, best_row + rows);
+    arena_of[value] = best_arena;
+    values_[value].row = best_row;
+  }
+
+  arenas_.clear();
+  for (auto &arena : arenas) {
+    arenas_.push_back(std::make_shared<Texture>(
+        workspace.CreateTexture(nullptr, arena.width, arena.height)));
+  }
+  for (int value : order) {
+    values_[value].texture = arenas_[arena_of[value]];
+  }
+
+  std::clog << "Planned " << order.size() << " intermediates into "
+            << arenas_.size() << " textures: " << arena_bytes()
+            << " bytes, at least " << peak_live_bytes() << " needed"
+            << std::endl;
+
+  planned_ = true;
+}
+
+size_t KernelGraph::arena_bytes() const {
+  size_t bytes = 0;
+  for (auto &arena : arenas_) {
+    bytes += arena->bytes();
+  }
+  return bytes;
+}
+
+size_t KernelGraph::peak_live_bytes() const {
+  std::vector<int> first, last;
+  Lifetimes(&first, &last);
+
+  std::vector<bool> is_output(values_.size(), false);
+  for (int value : outputs_) {
+    is_output[value] = true;
+  }
+
+  size_t peak = 0;
+  for (size_t k = 0; k != kernels_.size(); ++k) {
+    size_t live = 0;
+    for (size_t i = 0; i != values_.size(); ++i) {
+      const Value &value = values_[i];
+      if (value.kind == ValueKind::kIntermediate && !is_output[i]
+          && first[i] <= static_cast<int>(k)
+          && static_cast<int>(k) <= last[i]) {
+        live += gl::TexelSize(GL_RGBA32F) * value.rows * value.cols;
+      }
+    }
+    peak = std::max(peak, live);
+  }
+  return peak;
+}
+
+int KernelGraph::EliminateCommonSubexpressions() {
+  // What each value was merged into.
+  std::vector<int> replacement(values_.size());
+  for (size_t i = 0; i != values_.size(); ++i) {
+    replacement[i] = static_cast<int>(i);
+  }
+
+  using Key = std::tuple<const Program *,
+                         std::vector<std::pair<std::string, int>>,
+                         std::vector<std::pair<std::string, int>>>;
+  std::map<Key, int> seen;
+
+  std::vector<Kernel> kernels;
+  for (auto &kernel : kernels_) {
+    for (auto &input : kernel.inputs) {
+      input.second = replacement[input.second];
+    }
+
+    Key key(kernel.program, kernel.inputs, kernel.uniforms);
+    auto it = seen.find(key);
+    if (it != seen.end()) {
+      replacement[kernel.output] = it->second;
+      continue;
+    }
+    seen.emplace(key, kernel.output);
+    kernels.push_back(std::move(kernel));
+  }
+  for (auto &output : outputs_) {
+    output = replacement[output];
+  }
+
+  int num_removed = static_cast<int>(kernels_.size() - kernels.size());
+  kernels_ = std::move(kernels);
+  planned_ = false;
+  return num_removed;
+}
+
+int KernelGraph::FoldConstants() {
+  auto &workspace = Workspace::GetInstance();
+
+  std::vector<Kernel> kernels;
+  for (auto &kernel : kernels_) {
+    bool constant = true;
+    for (auto &input : kernel.inputs) {
+      constant &= values_[input.second].kind == ValueKind::kExternal;
+    }
+    if (!constant) {
+      kernels.push_back(std::move(kernel));
+      continue;
+    }
+
+    Value &output = values_[kernel.output];
+    output.texture = std::make_shared<Texture>(
+        workspace.CreateTexture(nullptr, output.cols, output.rows));
+    output.kind = ValueKind::kExternal;
+    output.row = 0;
+    Dispatch(kernel);
+  }
+
+  int num_removed = static_cast<int>(kernels_.size() - kernels.size());
+  kernels_ = std::move(kernels);
+  planned_ = false;
+  return num_removed;
+}
+
+int KernelGraph::EliminateDeadKernels() {
+  std::vector<bool> live(values_.size(), false);
+  for (int output : outputs_) {
+    live[output] = true;
+  }
+
+  // Backwards, so that consumers are decided before their producers.
+  std::vector<Kernel> kernels;
+  for (auto it = kernels_.rbegin(); it != kernels_.rend(); ++it) {
+    if (!live[it->output]) {
+      continue;
+    }
+    for (auto &input : it->inputs) {
+      live[input.second] = true;
+    }
+    kernels.push_back(std::move(*it));
+  }
+  std::reverse(kernels.begin(), kernels.end());
+
+  int num_removed = static_cast<int>(kernels_.size() - kernels.size());
+  kernels_ = std::move(kernels);
+  planned_ = false;
+  return num_removed;
+}
+
+void KernelGraph::Optimize(bool fold_constants) {
+  int num_removed = EliminateCommonSubexpressions();
+  if (fold_constants) {
+    num_removed += FoldConstants();
+  }
+  num_removed += EliminateDeadKernels();
+
+  // Let go of the textures nothing reads anymore, e.g. folded weights.
+  std::vector<bool> referenced(values_.size(), false);
+  for (auto &kernel : kernels_) {
+    for (auto &input : kernel.inputs) {
+      referenced[input.second] = true;
+    }
+  }
+  for (int output : outputs_) {
+    referenced[output] = true;
+  }
+  for (size_t i = 0; i != values_.size(); ++i) {
+    if (!referenced[i] && values_[i].kind == ValueKind::kExternal) {
+      values_[i].texture = nullptr;
+    }
+  }
+
+  std::clog << "Optimized kernel graph: removed " << num_removed
+            << " kernels, " << kernels_.size() << " left" << std::endl;
+}
+
+namespace {
+
+// A GLSL float literal.
+std::string FloatLiteral(GLfloat value) {
+  std::ostringstream out;
+  out.precision(9);
+  out << std::scientific << value;
+  return out.str();
+}
+
+}  // namespace
+
+Tensor Tensor::FromData(const GLfloat *data, GLsizei rows, GLsizei cols) {
+  auto node = std::make_shared<Node>();
+  node->op = Node::kConstant;
+  node->rows = rows;
+  node->cols = cols;
+  node->scalar = 0.0f;
+  node->texture = std::make_shared<Texture>(
+      Workspace::GetInstance().CreateTexture(data, cols, rows));
+  return Tensor(node);
+}
+
+Tensor Tensor::Placeholder(GLsizei rows, GLsizei cols) {
+  auto node = std::make_shared<Node>();
+  node->op = Node::kInput;
+  node->rows = rows;
+  node->cols = cols;
+  node->scalar = 0.0f;
+  return Tensor(node);
+}
+
+Tensor Tensor::matmul(const Tensor &other) const {
+  if (cols() != other.rows()) {
+    std::cerr << "Cannot multiply " << rows() << "x" << cols() << " by "
+              << other.rows() << "x" << other.cols() << std::endl;
+    assert(false);
+  }
+
+  auto node = std::make_shared<Node>();
+  node->op = Node::kMatmul;
+  node->rows = rows();
+  node->cols = other.cols();
+  node->args = {node_, other.node_};
+  node->scalar = 0.0f;
+  return Tensor(node);
+}
+
+Tensor Tensor::relu() const {
+  return Unary(Node::kRelu, *this);
+}
+
+Tensor Tensor::operator+(const Tensor &other) const {
+  return Elementwise(Node::kAdd, *this, other);
+}
+
+Tensor Tensor::operator-(const Tensor &other) const {
+  return Elementwise(Node::kSub, *this, other);
+}
+
+Tensor Tensor::operator*(const Tensor &other) const {
+  return Elementwise(Node::kMul, *this, other);
+}
+
+Tensor Tensor::operator*(GLfloat scale) const {
+  return Unary(Node::kScale, *this, scale);
+}
+
+Tensor Tensor::Elementwise(Node::Op op, const Tensor &lhs,
+                           const Tensor &rhs) {
+  auto broadcast = [](GLsizei a, GLsizei b) {
+    return a == b || a == 1 || b == 1;
+  };
+  if (!broadcast(lhs.rows(), rhs.rows())
+      || !broadcast(lhs.cols(), rhs.cols())) {
+    std::cerr << "Cannot broadcast " << lhs.rows() << "x" << lhs.cols()
+              << " with " << rhs.rows() << "x" << rhs.cols() << std::endl;
+    assert(false);
+  }
+
+  auto node = std::make_shared<Node>();
+  node->op = op;
+  node->rows = std::max(lhs.rows(), rhs.rows());
+  node->cols = std::max(lhs.cols(), rhs.cols());
+  node->args = {lhs.node_, rhs.node_};
+  node->scalar = 0.0f;
+  return Tensor(node);
+}
+
+Tensor Tensor::Unary(Node::Op op, const Tensor &arg, GLfloat scalar) {
+  auto node = std::make_shared<Node>();
+  node->op = op;
+  node->rows = arg.rows();
+  node->cols = arg.cols();
+  node->args = {arg.node_};
+  node->scalar = scalar;
+  return Tensor(node);
+}
+
+KernelGraph Tensor::Compile(const std::vector<Tensor> &outputs,
+                            const std::vector<Tensor> &inputs) {
+  auto pending = [](const Node *node) {
+    return node->texture == nullptr && node->op != Node::kInput;
+  };
+
+  // Pending nodes, producers first.
+  std::vector<Node *> order;
+  std::set<Node *> visited;
+  std::function<void(Node *)> visit = [&](Node *node) {
+    if (!pending(node) || !visited.insert(node).second) {
+      return;
+    }
+    for (auto &arg : node->args) {
+      visit(arg.get());
+    }
+    order.push_back(node);
+  };
+  for (auto &output : outputs) {
+    visit(output.node_.get());
+  }
+
+  std::map<Node *, int> num_uses;
+  for (Node *node : order) {
+    for (auto &arg : node->args) {
+      ++num_uses[arg.get()];
+    }
+  }
+
+  // A pending node is fused into its consumer when that is its only use,
+  // and the consumer reads it at the same pixel.
+  std::set<Node *> fused;
+  for (Node *node : order) {
+    if (node->op == Node::kMatmul) {
+      continue;
+    }
+    for (auto &arg : node->args) {
+      if (pending(arg.get()) && num_uses[arg.get()] == 1
+          && arg->rows == node->rows && arg->cols == node->cols) {
+        fused.insert(arg.get());
+      }
+    }
+  }
+  for (auto &output : outputs) {
+    fused.erase(output.node_.get());
+  }
+
+  KernelGraph graph;
+  std::map<Node *, int> values;
+  for (auto &input : inputs) {
+    Node *node = input.node_.get();
+    values[node] = graph.AddInput(node->rows, node->cols);
+  }
+  auto value_of = [&](Node *node) {
+    auto it = values.find(node);
+    if (it == values.end()) {
+      // Only materialized nodes are not assigned yet.
+      if (node->op == Node::kInput) {
+        std::cerr << "Placeholder not given as a graph input." << std::endl;
+        assert(false);
+      }
+      it = values.emplace(node, graph.AddExternal(node->texture, node->rows,
+                                                  node->cols)).first;
+    }
+    return it->second;
+  };
+
+  for (Node *root : order) {
+    if (fused.count(root) != 0) {
+      continue;
+    }
+
+    KernelGraph::Kernel kernel;
+    std::map<Node *, std::string> samplers;
+    std::string body;
+    int num_temps = 0;
+
+    // A GLSL expression for "node" at (row, col).
+    std::function<std::string(Node *, const std::string &,
+                              const std::string &)> emit;
+    emit = [&](Node *node, const std::string &row,
+               const std::string &col) -> std::string {
+      if (node != root && fused.count(node) == 0) {
+        auto it = samplers.find(node);
+        if (it == samplers.end()) {
+          std::string name = "X" + std::to_string(samplers.size());
+          kernel.inputs.emplace_back(name, value_of(node));
+          it = samplers.emplace(node, name).first;
+        }
+        return "texelFetch(" + it->second + ", ivec2("
+               + (node->cols == 1 ? "0" : col) + ", " + it->second + "_row0"
+               + (node->rows == 1 ? "" : " + " + row) + "), 0).r";
+      }
+
+      switch (node->op) {
+        case Node::kMatmul: {
+          std::string id = std::to_string(num_temps++);
+          std::string sum = "t" + std::to_string(num_temps++);
+          std::string k = "k" + id;
+          std::string depth = "K" + id;
+          kernel.uniforms.emplace_back(depth, node->args[0]->cols);
+          std::string a = emit(node->args[0].get(), row, k);
+          std::string b = emit(node->args[1].get(), k, col);
+          body += "  float " + sum + " = 0.0;\n"
+                  "  for (int " + k + " = 0; " + k + " < " + depth + "; "
+                  + k + "++) {\n"
+                  "    " + sum + " += " + a + " * " + b + ";\n"
+                  "  }\n";
+          return sum;
+        }
+        case Node::kAdd:
+          return "(" + emit(node->args[0].get(), row, col) + " + "
+                 + emit(node->args[1].get(), row, col) + ")";
+        case Node::kSub:
+          return "(" + emit(node->args[0].get(), row, col) + " - "
+                 + emit(node->args[1].get(), row, col) + ")";
+        case Node::kMul:
+          return "(" + emit(node->args[0].get(), row, col) + " * "
+                 + emit(node->args[1].get(), row, col) + ")";
+        case Node::kScale:
+          return "(" + emit(node->args[0].get(), row, col) + " * "
+                 + FloatLiteral(node->scalar) + ")";
+        case Node::kRelu:
+          return "max(" + emit(node->args[0].get(), row, col) + ", 0.0)";
+        case Node::kConstant:
+        case Node::kInput:
+          break;
+      }
+      assert(false);
+      return "";
+    };
+
+    std::string result = emit(root, "row", "col");
+
+    std::string source = "#version 330 core\n";
+    for (auto &input : kernel.inputs) {
+      source += "uniform sampler2D " + input.first + ";\n"
+                "uniform int " + input.first + "_row0;\n";
+    }
+    for (auto &uniform : kernel.uniforms) {
+      source += "uniform int " + uniform.first + ";\n";
+    }
+    source += "uniform int out_row0;\n"
+              "out float color;\n"
+              "void main() {\n"
+              "  int row = int(gl_FragCoord.y) - out_row0;\n"
+              "  int col = int(gl_FragCoord.x);\n"
+              + body
+              + "  color = " + result + ";\n"
+              "}\n";
+
+    kernel.program = &Workspace::GetInstance().GetCachedProgram(source);
+    kernel.output = graph.AddIntermediate(root->rows, root->cols);
+    values[root] = kernel.output;
+    graph.AddKernel(std::move(kernel));
+  }
+
+  for (auto &output : outputs) {
+    graph.AddOutput(value_of(output.node_.get()));
+  }
+  return graph;
+}
+
+void Tensor::Eval(std::vector<Tensor> *outputs) {
+  KernelGraph graph = Compile(*outputs);
+  // Every input is a constant here.
+  graph.Optimize(/*fold_constants=*/false);
+  graph.Run();
+
+  for (size_t i = 0; i != outputs->size(); ++i) {
+    Node *node = (*outputs)[i].node_.get();
+    node->texture = graph.texture(graph.outputs()[i]);
+    // The inputs are not needed anymore.
+    node->args.clear();
+  }
+}
+
+void Tensor::eval() {
+  if (node_->texture == nullptr) {
+    std::vector<Tensor> outputs = {*this};
+    Eval(&outputs);
+  }
+}
+
+void Tensor::GetData(GLfloat *data) {
+  eval();
+  node_->texture->GetData(data);
+}
+
+const Texture &Tensor::texture() {
+  eval();
+  return *node_->texture;
+}
+
+namespace te {
+
+IterVar ReduceAxis(const std::string &name, int extent) {
+  return IterVar(new IterVarNode{name, extent, /*reduce=*/true});
+}
+
+Expr::Expr(float value)
+    : node_(new ExprNode{ExprNode::kConst, value, nullptr, nullptr, {}}) {}
+
+Expr::Expr(const IterVar &var)
+    : node_(new ExprNode{ExprNode::kVar, 0.0f, var, nullptr, {}}) {}
+
+namespace {
+
+Expr Binary(ExprNode::Kind kind, const Expr &a, const Expr &b) {
+  return Expr(std::make_shared<const ExprNode>(
+      ExprNode{kind, 0.0f, nullptr, nullptr, {a, b}}));
+}
+
+}  // namespace
+
+Expr operator+(const Expr &a, const Expr &b) {
+  return Binary(ExprNode::kAdd, a, b);
+}
+
+Expr operator-(const Expr &a, const Expr &b) {
+  return Binary(ExprNode::kSub, a, b);
+}
+
+Expr operator*(const Expr &a, const Expr &b) {
+  return Binary(ExprNode::kMul, a, b);
+}
+
+Expr Max(const Expr &a, const Expr &b) {
+  return Binary(ExprNode::kMax, a, b);
+}
+
+Expr Sum(const Expr &body, const IterVar &axis) {
+  if (!axis->reduce) {
+    std::cerr << "Can only sum over reduction axes." << std::endl;
+    assert(false);
+  }
+  return Expr(std::make_shared<const ExprNode>(
+      ExprNode{ExprNode::kSum, 0.0f, axis, nullptr, {body}}));
+}
+
+Expr Tensor::operator()(const Expr &row, const Expr &col) const {
+  return Expr(std::make_shared<const ExprNode>(
+      ExprNode{ExprNode::kLoad, 0.0f, nullptr, node_, {row, col}}));
+}
+
+Tensor Placeholder(const std::string &name, int rows, int cols,
+                   Layout layout) {
+  auto node = std::make_shared<TensorNode>();
+  node->name = name;
+  node->rows = rows;
+  node->cols = cols;
+  node->layout = layout;
+  return Tensor(node);
+}
+
+Tensor Compute(const std::string &name, int rows, int cols,
+               const std::function<Expr(IterVar, IterVar)> &f,
+               Layout layout) {
+  auto node = std::make_shared<TensorNode>();
+  node->name = name;
+  node->rows = rows;
+  node->cols = cols;
+  node->layout = layout;
+  node->axes[0] = IterVar(new IterVarNode{"i", rows, /*reduce=*/false});
+  node->axes[1] = IterVar(new IterVarNode{"j", cols, /*reduce=*/false});
+  node->body = std::make_shared<Expr>(f(node->axes[0], node->axes[1]));
+  return Tensor(node);
+}
+
+Schedule::Schedule(const Tensor &output) : output_(output.node()) {
+  if (output_->body == nullptr) {
+    std::cerr << "Can only schedule computes." << std::endl;
+    assert(false);
+  }
+}
+
+std::pair<IterVar, IterVar> Schedule::Tile(const IterVar &axis, int factor) {
+  if (split(axis.get()) != nullptr || axis->extent % factor != 0) {
+    std::cerr << "Cannot tile " << axis->name << " by " << factor
+              << std::endl;
+    assert(false);
+  }
+  Split &axis_split = splits_[axis.get()];
+  axis_split.factor = factor;
+  axis_split.outer = IterVar(new IterVarNode{
+      axis->name + "_o", axis->extent / factor, axis->reduce});
+  axis_split.inner = IterVar(new IterVarNode{axis->name + "_i", factor,
+                                             axis->reduce});
+  return {axis_split.outer, axis_split.inner};
+}
+
+void Schedule::Unroll(const IterVar &axis) {
+  unrolled_.insert(axis.get());
+}
+
+void Schedule::Vectorize(const IterVar &axis) {
+  if (axis->extent != 4) {
+    std::cerr << "Can only vectorize axes of 4 iterations." << std::endl;
+    assert(false);
+  }
+  vectorized_.insert(axis.get());
+}
+
+void Schedule::CacheRead(const Tensor &tensor, const IterVar &at) {
+  cache_reads_.emplace_back(tensor.node(), at);
+}
+
+namespace {
+
+void CollectLoads(const Expr &expr, std::vector<Expr> *loads) {
+  if (expr->kind == ExprNode::kLoad) {
+    loads->push_back(expr);
+    return;
+  }
+  for (auto &arg : expr->args) {
+    CollectLoads(arg, loads);
+  }
+}
+
+// GLSL code generation for one schedule.
+class Lowering {
+ public:
+  explicit Lowering(const Schedule &schedule)
+      : schedule_(schedule), output_(schedule.output()) {}
+
+  std::string Lower();
+
+ private:
+  struct Code {
+    std::string text;
+    bool vec;
+  };
+
+  // The axes that actually get iterated over, outermost first.
+  void Leaves(const IterVar &axis, std::vector<IterVar> *leaves) const;
+
+  bool DependsOn(const IterVar &axis, const IterVarNode *leaf) const;
+
+  bool DependsOn(const Expr &expr, const IterVarNode *leaf) const;
+
+  // The value of an axis, as a GLSL int.
+  std::string Value(const IterVar &axis);
+
+  std::string Index(const Expr &expr);
+
+  std::string ScalarLoad(const TensorNode &tensor, const Expr &row,
+                         const Expr &col);
+
+  Code Emit(const Expr &expr);
+
+  void EmitLoops(const std::vector<IterVar> &leaves, size_t position,
+                 const Expr &body, const std::string &indent);
+
+  void EmitCacheReads(const std::vector<IterVar> &leaves, size_t position,
+                      const std::string &indent);
+
+  // The body of one iteration of leaves[position]: its cache reads, then the
+  // loops inside it.
+  void EmitIteration(const std::vector<IterVar> &leaves, size_t position,
+                     const Expr &body, const std::string &indent);
+
+  const Schedule &schedule_;
+  const TensorNode &output_;
+
+  std::string code_;
+  std::map<const IterVarNode *, std::string> bindings_;
+  // The vectorized axis, and which lane is emitted (-1 for all at once).
+  const IterVarNode *vectorized_ = nullptr;
+  int lane_ = -1;
+
+  // Cached loads: the local array and the axis indexing it, if any.
+  std::map<const ExprNode *, std::pair<std::string, const IterVarNode *>>
+      cached_;
+  int num_cached_ = 0;
+};
+
+void Lowering::Leaves(const IterVar &axis,
+                      std::vector<IterVar> *leaves) const {
+  if (const Schedule::Split *split = schedule_.split(axis.get())) {
+    Leaves(split->outer, leaves);
+    Leaves(split->inner, leaves);
+  } else {
+    leaves->push_back(axis);
+  }
+}
+
+bool Lowering::DependsOn(const IterVar &axis,
+                         const IterVarNode *leaf) const {
+  const Schedule::Split *split = schedule_.split(axis.get());
+  return axis.get() == leaf
+         || (split != nullptr
+             && (DependsOn(split->outer, leaf)
+                 || DependsOn(split->inner, leaf)));
+}
+
+bool Lowering::DependsOn(const Expr &expr, const IterVarNode *leaf) const {
+  if (expr->kind == ExprNode::kVar) {
+    return DependsOn(expr->var, leaf);
+  }
+  for (auto &arg : expr->args) {
+    if (DependsOn(arg, leaf)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string Lowering::Value(const IterVar &axis) {
+  if (const Schedule::Split *split = schedule_.split(axis.get())) {
+    return "(" + Value(split->outer) + " * " + std::to_string(split->factor)
+           + " + " + Value(split->inner) + ")";
+  }
+  if (axis.get() == vectorized_) {
+    assert(lane_ != -1);
+    return std::to_string(lane_);
+  }
+  auto it = bindings_.find(axis.get());
+  if (it == bindings_.end()) {
+    std::cerr << "Axis " << axis->name << " used outside of its loop."
+              << std::endl;
+    assert(false);
+  }
+  return it->second;
+}
+
+std::string Lowering::Index(const Expr &expr) {
+  switch (expr->kind) {
+    case ExprNode::kConst:
+      return std::to_string(static_cast<int>(expr->value));
+    case ExprNode::kVar:
+      return Value(expr->var);
+    case ExprNode::kAdd:
+      return "(" + Index(expr->args[0]) + " + " + Index(expr->args[1]) + ")";
+    case ExprNode::kSub:
+      return "(" + Index(expr->args[0]) + " - " + Index(expr->args[1]) + ")";
+    case ExprNode::kMul:
+      return "(" + Index(expr->args[0]) + " * " + Index(expr->args[1]) + ")";
+    default:
+      std::cerr << "Unsupported index expression." << std::endl;
+      assert(false);
+      return "";
+  }
+}
+
+std::string Lowering::ScalarLoad(const TensorNode &tensor, const Expr &row,
+                                 const Expr &col) {
+  std::string r = Index(row);
+  std::string c = Index(col);
+  if (tensor.layout == Layout::kVec4) {
+    return "texelFetch(" + tensor.name + ", ivec2(" + c + " / 4, " + r
+           + "), 0)[" + c + " % 4]";
+  }
+  return "texelFetch(" + tensor.name + ", ivec2(" + c + ", " + r
+         + "), 0).r";
+}
+
+Lowering::Code Lowering::Emit(const Expr &expr) {
+  switch (expr->kind) {
+    case ExprNode::kConst:
+      return {FloatLiteral(expr->value), false};
+
+    case ExprNode::kLoad: {
+      auto cached = cached_.find(expr.get());
+      if (cached != cached_.end()) {
+        std::string text = cached->second.first;
+        if (cached->second.second != nullptr) {
+          text += "[" + bindings_[cached->second.second] + "]";
+        }
+        return {text, false};
+      }
+
+      const TensorNode &tensor = *expr->tensor;
+      const Expr &row = expr->args[0];
+      const Expr &col = expr->args[1];
+      if (vectorized_ == nullptr || lane_ != -1
+          || !DependsOn(expr, vectorized_)) {
+        return {ScalarLoad(tensor, row, col), false};
+      }
+
+      // Along the vectorized axis, in a kVec4 tensor: one aligned texel.
+      const Schedule::Split *split = col->kind == ExprNode::kVar
+                                         ? schedule_.split(col->var.get())
+                                         : nullptr;
+      if (tensor.layout == Layout::kVec4 && split != nullptr
+          && split->inner.get() == vectorized_ && split->factor == 4
+          && !DependsOn(row, vectorized_)) {
+        return {"texelFetch(" + tensor.name + ", ivec2("
+                    + Value(split->outer) + ", " + Index(row) + "), 0)",
+                true};
+      }
+
+      // Anything else is gathered lane by lane.
+      std::string text = "vec4(";
+      for (lane_ = 0; lane_ != 4; ++lane_) {
+        text += (lane_ == 0 ? "" : ", ") + ScalarLoad(tensor, row, col);
+      }
+      lane_ = -1;
+      return {text + ")", true};
+    }
+
+    case ExprNode::kAdd:
+    case ExprNode::kSub:
+    case ExprNode::kMul: {
+      Code a = Emit(expr->args[0]);
+      Code b = Emit(expr->args[1]);
+      const char *op = expr->kind == ExprNode::kAdd ? " + "
+                       : expr->kind == ExprNode::kSub ? " - " : " * ";
+      return {"(" + a.text + op + b.text + ")", a.vec || b.vec};
+    }
+
+    case ExprNode::kMax: {
+      Code a = Emit(expr->args[0]);
+      Code b = Emit(expr->args[1]);
+      // max(vec4, float) exists, max(float, vec4) does not.
+      if (!a.vec && b.vec) {
+        std::swap(a, b);
+      }
+      return {"max(" + a.text + ", " + b.text + ")", a.vec || b.vec};
+    }
+
+    case ExprNode::kVar:
+    case ExprNode::kSum:
+      break;
+  }
+  std::cerr << "Unsupported expression." << std::endl;
+  assert(false);
+  return {"", false};
+}
+
+void Lowering::EmitCacheReads(const std::vector<IterVar> &leaves,
+                              size_t position, const std::string &indent) {
+  const IterVarNode *at = leaves[position].get();
+  for (auto &cache_read : schedule_.cache_reads()) {
+    if (cache_read.second.get() != at) {
+      continue;
+    }
+
+    std::vector<Expr> loads;
+    CollectLoads(*output_.body, &loads);
+    for (const Expr &load : loads) {
+      if (load->tensor != cache_read.first || cached_.count(load.get()) != 0) {
+        continue;
+      }
+
+      // At most one loop inside "at" may index the cache.
+      const IterVarNode *index = nullptr;
+      for (size_t p = position + 1; p != leaves.size(); ++p) {
+        if (DependsOn(load, leaves[p].get())) {
+          if (index != nullptr || schedule_.vectorized(leaves[p].get())) {
+            std::cerr << "Cannot cache " << load->tensor->name << " at "
+                      << at->name << std::endl;
+            assert(false);
+          }
+          index = leaves[p].get();
+        }
+      }
+      if (vectorized_ != nullptr && DependsOn(load, vectorized_)) {
+        std::cerr << "Cannot cache vectorized loads." << std::endl;
+        assert(false);
+      }
+
+      std::string name = load->tensor->name + "_local"
+                         + std::to_string(num_cached_++);
+      if (index == nullptr) {
+        code_ += indent + "float " + name + " = "
+                 + ScalarLoad(*load->tensor, load->args[0], load->args[1])
+                 + ";\n";
+      } else {
+        std::string extent = std::to_string(index->extent);
+        bindings_[index] = index->name;
+        code_ += indent + "float " + name + "[" + extent + "];\n"
+                 + indent + "for (int " + index->name + " = 0; "
+                 + index->name + " < " + extent + "; ++" + index->name
+                 + ") {\n"
+                 + indent + "  " + name + "[" + index->name + "] = "
+                 + ScalarLoad(*load->tensor, load->args[0], load->args[1])
+                 + ";\n"
+                 + indent + "}\n";
+      }
+      cached_[load.get()] = {name, index};
+    }
+  }
+}
+
+void Lowering::EmitLoops(const std::vector<IterVar> &leaves, size_t position,
+                         const Expr &body, const std::string &indent) {
+  if (position == leaves.size()) {
+    code_ += indent + "acc += " + Emit(body).text + ";\n";
+    return;
+  }
+
+  const IterVar &leaf = leaves[position];
+  if (schedule_.vectorized(leaf.get())) {
+    if (position + 1 != leaves.size()) {
+      std::cerr << "Only the innermost axis can be vectorized." << std::endl;
+      assert(false);
+    }
+    EmitLoops(leaves, position + 1, body, indent);
+    return;
+  }
+
+  if (schedule_.unrolled(leaf.get())) {
+    for (int i = 0; i != leaf->extent; ++i) {
+      bindings_[leaf.get()] = std::to_string(i);
+      code_ += indent + "{\n";
+      EmitIteration(leaves, position, body, indent + "  ");
+      code_ += indent + "}\n";
+    }
+    return;
+  }
+
+  bindings_[leaf.get()] = leaf->name;
+  code_ += indent + "for (int " + leaf->name + " = 0; " + leaf->name + " < "
+           + std::to_string(leaf->extent) + "; ++" + leaf->name + ") {\n";
+  EmitIteration(leaves, position, body, indent + "  ");
+  code_ += indent + "}\n";
+}
+
+void Lowering::EmitIteration(const std::vector<IterVar> &leaves,
+                             size_t position, const Expr &body,
+                             const std::string &indent) {
+  // The cache reads are local to the block, e.g. to one unrolled copy.
+  auto cached = cached_;
+  EmitCacheReads(leaves, position, indent);
+  EmitLoops(leaves, position + 1, body, indent);
+  cached_ = std::move(cached);
+}
+
+std::string Lowering::Lower() {
+  const IterVar &i = output_.axes[0];
+  const IterVar &j = output_.axes[1];
+  if (schedule_.split(i.get()) != nullptr) {
+    std::cerr << "The row axis cannot be split." << std::endl;
+    assert(false);
+  }
+
+  bool vec_out = output_.layout == Layout::kVec4;
+  const Schedule::Split *j_split = schedule_.split(j.get());
+  bool j_vectorized = j_split != nullptr
+                      && schedule_.vectorized(j_split->inner.get())
+                      && j_split->factor == 4
+                      && schedule_.split(j_split->inner.get()) == nullptr
+                      && schedule_.split(j_split->outer.get()) == nullptr;
+  if ((j_split != nullptr && !j_vectorized) || vec_out != j_vectorized) {
+    std::cerr << "The column axis can only be split by 4 and vectorized, "
+              << "for a kVec4 output." << std::endl;
+    assert(false);
+  }
+
+  code_ = "  int i = int(gl_FragCoord.y);\n";
+  bindings_[i.get()] = "i";
+  if (j_vectorized) {
+    code_ += "  int j_o = int(gl_FragCoord.x);\n";
+    bindings_[j_split->outer.get()] = "j_o";
+    vectorized_ = j_split->inner.get();
+  } else {
+    code_ += "  int j = int(gl_FragCoord.x);\n";
+    bindings_[j.get()] = "j";
+  }
+
+  const Expr &body = *output_.body;
+  if (body->kind == ExprNode::kSum) {
+    std::vector<IterVar> leaves;
+    Leaves(body->var, &leaves);
+
+    bool reduce_vectorized = false;
+    for (auto &leaf : leaves) {
+      if (schedule_.vectorized(leaf.get())) {
+        if (vectorized_ != nullptr) {
+          std::cerr << "Only one axis can be vectorized." << std::endl;
+          assert(false);
+        }
+        vectorized_ = leaf.get();
+        reduce_vectorized = true;
+      }
+    }
+
+    bool vec_acc = vectorized_ != nullptr;
+    code_ += std::string(vec_acc ? "  vec4" : "  float") + " acc = "
+             + (vec_acc ? "vec4(0.0)" : "0.0") + ";\n";
+    EmitLoops(leaves, 0, body->args[0], "  ");
+    code_ += reduce_vectorized ? "  color = dot(acc, vec4(1.0));\n"
+                               : "  color = acc;\n";
+  } else {
+    Code code = Emit(body);
+    code_ += "  color = " + std::string(vec_out && !code.vec ? "vec4" : "")
+             + "(" + code.text + ");\n";
+  }
+
+  // Every tensor loaded is a sampler.
+  std::vector<Expr> loads;
+  CollectLoads(body, &loads);
+  std::set<std::string> inputs;
+  for (const Expr &load : loads) {
+    inputs.insert(load->tensor->name);
+  }
+
+  std::string source = "#version 330 core\n";
+  for (auto &input : inputs) {
+    source += "uniform sampler2D " + input + ";\n";
+  }
+  source += vec_out ? "out vec4 color;\n" : "out float color;\n";
+  source += "void main() {\n" + code_ + "}\n";
+  return source;
+}
+
+}  // namespace
+
+std::string Schedule::Lower() const {
+  return Lowering(*this).Lower();
+}
+
+}  // namespace te
+
+GLuint Workspace::NumTextureUnits() {
+  GLint num_units;
+  OPENGL_CALL(glGetIntegerv(GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS, &num_units));
+  return static_cast<GLuint>(num_units);
+}
+
+// https://www.opengl.org/discussion_boards/showthread.php/174926-when-to-use-glActiveTexture
+// Consider the internal OpenGL texture system as this.
+//   struct TextureUnit {
+//     GLuint target_texture_1D;
+//     GLuint target_texture_2D;
+//     GLuint target_texture_3D;
+//     GLuint target_texture_cube;
+//     ...
+//   };
+//   TextureUnit texture_units[GL_MAX_TEXTURE_IMAGE_UNITS];
+//   GLuint curr_texture_unit; // global state!!!
+//
+// Then:
+//   "glActiveTexture(GL_TEXTURE0);"
+//     <=>
+//   "curr_texture_unit = 0;"
+//
+//   "glBindTexture(GL_TEXTURE_1D, texture0);"
+//     <=>
+//   "texture_units[curr_texture_unit].target_texture_1D = texture0;"
+void Workspace::BindTextureUnit(GLuint unit, GLuint texture) {
+  BindTextureUnit(unit, GL_TEXTURE_2D, texture);
+}
+
+void Workspace::BindTextureUnit(GLuint unit, GLenum target, GLuint texture) {
+  OPENGL_CALL(glActiveTexture(GL_TEXTURE0 + unit));
+  OPENGL_CALL(glBindTexture(target, texture));
+}
+
+void Workspace::BindTextureUnit(GLuint unit, const Texture &texture) {
+  MakeResident(texture);
+  BindTextureUnit(unit, texture.target(), texture.texture());
+}
+
+void Workspace::SetMemoryBudget(size_t bytes) {
+  memory_budget_ = bytes;
+  Reserve(0);
+}
 
-  static const int kWindowHeight = 480;
+void Workspace::Track(Texture *texture) {
+  lru_.push_front(texture);
+  texture->lru_position_ = lru_.begin();
+  texture->tracked_ = true;
+}
+
+void Workspace::Untrack(Texture *texture) {
+  lru_.erase(texture->lru_position_);
+  texture->tracked_ = false;
+}
+
+void Workspace::MakeResident(const Texture &texture) {
+  if (!texture.resident_) {
+    texture.Restore();
+  }
+  if (texture.tracked_) {
+    lru_.splice(lru_.begin(), lru_, texture.lru_position_);
+  }
+}
+
+void Workspace::Pin(const Texture &texture) {
+  ++texture.pins_;
+  MakeResident(texture);
+}
+
+void Workspace::Unpin(const Texture &texture) {
+  assert(texture.pins_ > 0);
+  --texture.pins_;
+}
+
+void Workspace::Reserve(size_t bytes) {
+  if (memory_budget_ == 0) {
+    return;
+  }
+  while (memory_used_ + bytes > memory_budget_) {
+    if (!EvictOne()) {
+      std::cerr << "Memory budget too small: " << memory_used_ << " + "
+                << bytes << " > " << memory_budget_ << " bytes, and nothing "
+                << "left to evict." << std::endl;
+      assert(false);
+      return;
+    }
+  }
+}
+
+bool Workspace::EvictOne() {
+  for (auto it = lru_.rbegin(); it != lru_.rend(); ++it) {
+    const Texture *texture = *it;
+    if (texture->resident_ && texture->pins_ == 0) {
+      texture->Evict();
+      return true;
+    }
+  }
+  return false;
+}
+
+Workspace &Workspace::GetInstance() {
+  static std::unique_ptr<Workspace> instance_(new Workspace);
+  return *instance_;
+}
+
+Workspace::Workspace() {
+  // Set an error handler.
+  // This can be called before glfwInit().
+  glfwSetErrorCallback(&GlfwErrorCallback);
+
+  // Initialize GLFW.
+  if (glfwInit() != GL_TRUE) {
+    std::cout << "glfwInit() failed!" << std::endl;
+    assert(false);
+  }
+
+  // Create a window.
+  // TODO(zhixunt): GLFW allows us to create an invisible window.
+  // TODO(zhixunt): On retina display, window size is different from framebuffer size.
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+  window_ = glfwCreateWindow(kWindowWidth, kWindowHeight, "", nullptr, nullptr);
+  if (window_ == nullptr) {
+    std::cout << "glfwCreateWindow() failed!" << std::endl;
+    assert(false);
+  }
+
+  std::cout << "GLFW says OpenGL version: "
+            << glfwGetWindowAttrib(window_, GLFW_CONTEXT_VERSION_MAJOR)
+            << "."
+            << glfwGetWindowAttrib(window_, GLFW_CONTEXT_VERSION_MINOR)
+            << "."
+            << glfwGetWindowAttrib(window_, GLFW_CONTEXT_REVISION)
+            << std::endl;
+
+  // Before using any OpenGL API, we must specify a context.
+  glfwMakeContextCurrent(window_);
+
+  // Must be called after creating GLFW window.
+  gladLoadGL();
+
+  std::cout << "Opengl says version: " << glGetString(GL_VERSION) << std::endl;
+
+  OPENGL_CHECK_ERROR();
+
+  // We always render the same vertices and triangles.
+  GLuint vertex_buffer;
+  OPENGL_CALL(glGenBuffers(1, &vertex_buffer));
+  OPENGL_CALL(glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer));
+  OPENGL_CALL(glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices,
+                           GL_STATIC_DRAW));
+
+  OPENGL_CALL(glGenVertexArrays(1, &empty_vertex_array_));
+
+  OPENGL_CALL(glGenVertexArrays(1, &vertex_array_));
+  OPENGL_CALL(glBindVertexArray(vertex_array_));
+  glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+
+  // We always use the same vertex shader.
+  vertex_shader_ = CreateShader(GL_VERTEX_SHADER, vertex_shader_text_);
+}
+
+Workspace::~Workspace() {
+  // Cached objects need the context.
+  programs_.clear();
+  filter_programs_.clear();
+  point_programs_.clear();
+  fft_twiddles_.clear();
+
+  // Paired with glfwCreateWindow().
+  glfwDestroyWindow(window_);
+
+  // Paired with glfwInit().
+  glfwTerminate();
+}
+
+/*!
+ * \brief Create a program that uses the given vertex and fragment shader.
+ * \param fragment_shader The fragment shader **source**.
+ * \return The program ID.
+ */
+Program Workspace::CreateProgram(const char *fragment_shader_src) {
+  // Create and compile the shaders.
+  GLuint fragment_shader = CreateShader(GL_FRAGMENT_SHADER,
+                                        fragment_shader_src);
+
+  // Link the shaders and create the program.
+  Program program = CreateProgram(fragment_shader);
+
+  OPENGL_CALL(glDeleteShader(fragment_shader));
+
+  return program;
+}
+
+const Program &Workspace::GetCachedProgram(
+    const std::string &fragment_shader_src) {
+  auto it = programs_.find(fragment_shader_src);
+  if (it == programs_.end()) {
+    it = programs_.emplace(fragment_shader_src,
+                           CreateProgram(fragment_shader_src.c_str())).first;
+  }
+  return it->second;
+}
+
+void Workspace::Render(
+    const Program &program,
+    const std::vector<std::pair<std::string, Texture *>> &inputs,
+    const std::vector<std::pair<std::string, int>> &uniforms,
+    Texture *output,
+    int niters) {
+  GLuint frame_buffer = BeginPass(program, inputs, uniforms, output);
+
+  auto opengl_start = std::chrono::system_clock::now();
+  for (int iter = 0; iter < niters; ++iter) {
+    OPENGL_CALL(glClear(GL_COLOR_BUFFER_BIT));
+    OPENGL_CALL(glDrawArrays(GL_TRIANGLES, 0, 6));
+    glFinish();
+  }
+
+  EndPass(inputs, output, frame_buffer);
+
+  auto opengl_end = std::chrono::system_clock::now();
+  std::cout << "opengl: "
+            << (std::chrono::duration_cast<std::chrono::microseconds>(opengl_end - opengl_start).count() / niters)
+            << std::endl;
+}
+
+void Workspace::Dispatch(
+    const Program &program,
+    const std::vector<std::pair<std::string, Texture *>> &inputs,
+    const std::vector<std::pair<std::string, int>> &uniforms,
+    Texture *output) {
+  Dispatch(program, inputs, uniforms, output, 0, 0, output->width(),
+           output->height());
+}
+
+void Workspace::Dispatch(
+    const Program &program,
+    const std::vector<std::pair<std::string, Texture *>> &inputs,
+    const std::vector<std::pair<std::string, int>> &uniforms,
+    Texture *output, GLint x, GLint y, GLsizei width, GLsizei height) {
+  GLuint frame_buffer = BeginPass(program, inputs, uniforms, output);
+  OPENGL_CALL(glViewport(x, y, width, height));
+  OPENGL_CALL(glDrawArrays(GL_TRIANGLES, 0, 6));
+  EndPass(inputs, output, frame_buffer);
+}
+
+GLuint Workspace::BeginPass(
+    const Program &program,
+    const std::vector<std::pair<std::string, Texture *>> &inputs,
+    const std::vector<std::pair<std::string, int>> &uniforms,
+    Texture *output) {
+  if (inputs.size() + 2 > NumTextureUnits()) {
+    std::cerr << "Too many inputs!" << std::endl;
+    assert(false);
+  }
+
+  if (output->target() != GL_TEXTURE_2D) {
+    std::cerr << "Can only render to 2D textures!" << std::endl;
+    assert(false);
+  }
+
+  // Everything we touch must stay resident until we are done.
+  for (auto &input : inputs) {
+    Pin(*input.second);
+  }
+  Pin(*output);
+
+  OPENGL_CALL(glUseProgram(program.program_));
+
+  // Create frame buffer.
+  GLuint frame_buffer;
+  OPENGL_CALL(glGenFramebuffers(1, &frame_buffer));
+  OPENGL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, frame_buffer));
+
+  // Set "renderedTexture" as our colour attachement #0
+  OPENGL_CALL(glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                   output->texture(), 0));
+
+  // Set the list of draw buffers.
+  GLenum DrawBuffers[1] = {GL_COLOR_ATTACHMENT0};
+  // "1" is the size of DrawBuffers.
+  OPENGL_CALL(glDrawBuffers(1, DrawBuffers));
+
+  // Always check that our framebuffer is ok
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    std::cout << "Framebuffer not complete." << std::endl;
+    assert(false);
+  }
+
+  BindInputs(program, inputs, uniforms);
+
+  OPENGL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, frame_buffer));
+  OPENGL_CALL(glViewport(0, 0, output->width(), output->height()));
+
+  return frame_buffer;
+}
+
+void Workspace::BindInputs(
+    const Program &program,
+    const std::vector<std::pair<std::string, Texture *>> &inputs,
+    const std::vector<std::pair<std::string, int>> &uniforms) {
+  OPENGL_CALL(glUseProgram(program.program_));
+
+  // Tell the shaders what input textures to use.
+  for (GLuint unit = 0; unit != inputs.size(); ++unit) {
+    const std::string &name = inputs[unit].first;
+    Texture *texture = inputs[unit].second;
+
+    BindTextureUnit(unit, *texture);
+
+    GLint texture_uniform = glGetUniformLocation(program.program_,
+                                                 name.c_str());
+    OPENGL_CALL(glUniform1i(texture_uniform, unit));
+  }
+
+  // Tell the shaders about uniforms.
+  for (auto &uniform : uniforms) {
+    const std::string &name = uniform.first;
+    int value = uniform.second;
+    GLint shader_uniform = glGetUniformLocation(program.program_, name.c_str());
+    OPENGL_CALL(glUniform1i(shader_uniform, value));
+  }
+}
+
+void Workspace::EndPass(
+    const std::vector<std::pair<std::string, Texture *>> &inputs,
+    Texture *output, GLuint frame_buffer) {
+  glDeleteFramebuffers(1, &frame_buffer);
+
+  for (auto &input : inputs) {
+    Unpin(*input.second);
+  }
+  Unpin(*output);
+}
+
+void Workspace::Render(
+    const Program &program,
+    const std::vector<std::pair<std::string, TextureView>> &inputs,
+    const std::vector<std::pair<std::string, int>> &uniforms,
+    Texture *output,
+    int niters) {
+  std::vector<std::pair<std::string, Texture *>> textures;
+  std::vector<std::pair<std::string, int>> view_uniforms = uniforms;
+  for (auto &input : inputs) {
+    const std::string &name = input.first;
+    const TextureView &view = input.second;
+    textures.emplace_back(name, view.texture);
+    view_uniforms.emplace_back(name + "_offset", view.offset);
+    view_uniforms.emplace_back(name + "_row_stride", view.row_stride);
+    view_uniforms.emplace_back(name + "_col_stride", view.col_stride);
+    view_uniforms.emplace_back(name + "_rows", view.rows);
+    view_uniforms.emplace_back(name + "_cols", view.cols);
+  }
+  Render(program, textures, view_uniforms, output, niters);
+}
+
+void Workspace::Render(
+    const Program &program,
+    const std::vector<std::pair<std::string, Texture *>> &inputs) {
+  if (inputs.size() + 1 > NumTextureUnits()) {
+    std::cerr << "Too many inputs!" << std::endl;
+    assert(false);
+  }
+
+  for (auto &input : inputs) {
+    Pin(*input.second);
+  }
+
+  OPENGL_CALL(glUseProgram(program.program_));
+
+  // Tell the fragment shader what input textures to use.
+  for (GLuint unit = 0; unit != inputs.size(); ++unit) {
+    const std::string &name = inputs[unit].first;
+    Texture *texture = inputs[unit].second;
+
+    BindTextureUnit(unit, *texture);
+
+    GLint texture_uniform = glGetUniformLocation(program.program_,
+                                                 name.c_str());
+    OPENGL_CALL(glUniform1i(texture_uniform, unit));
+  }
+
+  // Framebuffer 0 means the window.
+  OPENGL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+
+  // FIll the entire window.
+  GLint width, height;
+  glfwGetFramebufferSize(window_, &width, &height);
+  OPENGL_CALL(glViewport(0, 0, width, height));
+
+  OPENGL_CALL(glClear(GL_COLOR_BUFFER_BIT));
+  OPENGL_CALL(glDrawArrays(GL_TRIANGLES, 0, 6));
 
- private:
-  friend class Texture;
+  for (auto &input : inputs) {
+    Unpin(*input.second);
+  }
+}
 
-  explicit Workspace();
+/*!
+ * \brief Create and compile a shader from a source string.
+ * \param shader_kind The kind of shader.
+ * Could be GL_VERTEX_SHADER or GL_FRAGMENT_SHADER.
+ * \param shader_src The source string of the shader.
+ * \return The compiled shader ID.
+ */
+GLuint Workspace::CreateShader(GLenum shader_kind, const char *shader_src) {
+  // Create the shader.
+  GLuint shader = glCreateShader(shader_kind);
+  glShaderSource(shader, 1, &shader_src, nullptr);
+  glCompileShader(shader);
 
-  GLuint NumTextureUnits();
+  // Check compile errors.
+  GLint err;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &err);
 
-  void BindTextureUnit(GLuint unit, GLuint texture);
+  GLint info_log_len;
+  glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &info_log_len);
 
-  void BindTextureUnit(GLuint unit, const Texture &texture);
+  if (info_log_len > 0) {
+    std::unique_ptr<char[]> err_msg(new char[info_log_len + 1]);
+    glGetShaderInfoLog(shader, info_log_len, nullptr, err_msg.get());
+    std::cout << err_msg.get() << std::endl;
+    assert(false);
+  }
 
-  GLuint CreateShader(GLenum shader_kind, const char *shader_src);
+  OPENGL_CHECK_ERROR();
 
-  Program CreateProgram(GLuint fragment_shader);
+  return shader;
+}
 
-  // Don't need to change this.
-  // We want to draw 2 giant triangles that cover the whole screen.
-  struct Vertex {
-    float x, y;
-  };
+/*!
+ * \brief Create a program that uses the given vertex and fragment shaders.
+ * \param fragment_shader The **compiled** fragment shader.
+ * \return The program ID.
+ */
+Program Workspace::CreateProgram(GLuint fragment_shader) {
+  GLuint program = LinkProgram({vertex_shader_, fragment_shader}, {});
 
-  static constexpr size_t kNumVertices = 6;
+  auto point_attrib = GLuint(glGetAttribLocation(program, "point"));
+  OPENGL_CALL(glEnableVertexAttribArray(point_attrib));
 
-  static const Vertex vertices[kNumVertices];
+  OPENGL_CALL(glVertexAttribPointer(point_attrib, 2, GL_FLOAT, GL_FALSE,
+                                    sizeof(Vertex), nullptr));
 
-  static const char *vertex_shader_text_;
+  return Program(program);
+}
 
- public:
-  GLFWwindow *window_;
-  GLuint vertex_shader_;
-};
+Program Workspace::CreateFeedbackProgram(
+    const char *vertex_shader_src, const char *geometry_shader_src,
+    const std::vector<std::string> &varyings) {
+  std::vector<GLuint> shaders;
+  shaders.push_back(CreateShader(GL_VERTEX_SHADER, vertex_shader_src));
+  if (geometry_shader_src != nullptr) {
+    shaders.push_back(CreateShader(GL_GEOMETRY_SHADER, geometry_shader_src));
+  }
 
-void TestRenderToWindow() {
-  Workspace &workspace = Workspace::GetInstance();
+  Program program(LinkProgram(shaders, varyings));
 
-  GLint width, height;
-  glfwGetFramebufferSize(workspace.window_, &width, &height);
+  for (GLuint shader : shaders) {
+    OPENGL_CALL(glDeleteShader(shader));
+  }
 
-  auto texture_size = static_cast<size_t>(width) * height;
+  return program;
+}
 
-  std::vector<GLfloat> texture0_data(texture_size, 0.25f);
-  auto texture0 = workspace.CreateTexture(texture0_data.data(), width, height);
+Program Workspace::CreatePointProgram(const char *vertex_shader_src,
+                                     const char *fragment_shader_src) {
+  GLuint vertex_shader = CreateShader(GL_VERTEX_SHADER, vertex_shader_src);
+  GLuint fragment_shader = CreateShader(GL_FRAGMENT_SHADER,
+                                        fragment_shader_src);
 
-  std::vector<GLfloat> texture1_data(texture_size, 0.25f);
-  auto texture1 = workspace.CreateTexture(texture1_data.data(), width, height);
+  Program program(LinkProgram({vertex_shader, fragment_shader}, {}));
 
-  Program program = workspace.CreateProgram(fragment_shader_text);
+  OPENGL_CALL(glDeleteShader(vertex_shader));
+  OPENGL_CALL(glDeleteShader(fragment_shader));
 
-  while (glfwWindowShouldClose(workspace.window_) == GL_FALSE) {
-    workspace.Render(
-        program, {
-            {"texture0", &texture0},
-            {"texture1", &texture1}
-        }
-    );
-    glfwSwapBuffers(workspace.window_);
-    glfwPollEvents();
-  }
+  return program;
 }
 
-void TestRenderToTexture(int N, int niters) {
-  Workspace &workspace = Workspace::GetInstance();
+GLuint Workspace::LinkProgram(const std::vector<GLuint> &shaders,
+                              const std::vector<std::string> &varyings) {
+  // Create the program and link the shaders.
+  GLuint program = glCreateProgram();
+  for (GLuint shader : shaders) {
+    glAttachShader(program, shader);
+  }
+  if (!varyings.empty()) {
+    std::vector<const GLchar *> names;
+    for (auto &varying : varyings) {
+      names.push_back(varying.c_str());
+    }
+    glTransformFeedbackVaryings(program, static_cast<GLsizei>(names.size()),
+                                names.data(), GL_SEPARATE_ATTRIBS);
+  }
+  glLinkProgram(program);
 
-  std::random_device rd;
-  std::mt19937 mt(rd());
-  std::uniform_real_distribution<float> dist(1.0f, 2.0f);
+  // Check link errors.
+  GLint err;
+  glGetProgramiv(program, GL_LINK_STATUS, &err);
 
-  GLint width = N * N;
-  GLint height = 1;
-  auto texture_size = static_cast<size_t>(width) * height;
+  GLint info_log_len;
+  glGetProgramiv(program, GL_INFO_LOG_LENGTH, &info_log_len);
 
-  std::vector<GLfloat> texture0_data(texture_size, 0.0f);
-  for (size_t i = 0; i != texture_size; ++i) {
-    texture0_data[i] = dist(mt);
+  if (info_log_len > 0) {
+    std::unique_ptr<char[]> err_msg(new char[info_log_len + 1]);
+    glGetProgramInfoLog(program, info_log_len, nullptr, err_msg.get());
+    std::cout << err_msg.get() << std::endl;
+    assert(false);
   }
-  auto texture0 = workspace.CreateTexture(texture0_data.data(), width, height);
 
-  std::vector<GLfloat> texture1_data(texture_size, 0.0f);
-  for (size_t i = 0; i != texture_size; ++i) {
-    texture1_data[i] = dist(mt);
-  }
-  auto texture1 = workspace.CreateTexture(texture1_data.data(), width, height);
+  OPENGL_CHECK_ERROR();
 
-  Program program = workspace.CreateProgram(fragment_shader_text);
+  for (GLuint shader : shaders) {
+    OPENGL_CALL(glDetachShader(program, shader));
+  }
 
-  auto target_texture = workspace.CreateTexture(nullptr, width, height);
+  return program;
+}
 
-  workspace.Render(
-      program, {
-          {"A", &texture0},
-          {"B", &texture1}
-      }, {
-          {"N", N}
-      },
-      &target_texture,
-      niters
-  );
+GLuint Workspace::Feedback(
+    const Program &program,
+    const std::vector<std::pair<std::string, Texture *>> &inputs,
+    const std::vector<std::pair<std::string, int>> &uniforms,
+    GLsizei count, const std::vector<Texture *> &outputs) {
+  if (inputs.size() + 2 > NumTextureUnits()) {
+    std::cerr << "Too many inputs!" << std::endl;
+    assert(false);
+  }
 
-  std::vector<GLfloat> retrieved_data(static_cast<size_t>(width * height));
-  target_texture.GetData(retrieved_data.data());
+  GLint max_outputs;
+  OPENGL_CALL(glGetIntegerv(GL_MAX_TRANSFORM_FEEDBACK_SEPARATE_ATTRIBS,
+                            &max_outputs));
+  if (outputs.size() > static_cast<size_t>(max_outputs)) {
+    std::cerr << "Too many feedback outputs!" << std::endl;
+    assert(false);
+  }
 
-  std::vector<GLfloat> cpu_result(static_cast<size_t>(width * height));
-  auto cpu_start = std::chrono::system_clock::now();
-  for (int iter = 0; iter < niters; ++iter) {
-    for (int row = 0; row != N; ++row) {
-      for (int col = 0; col != N; ++col) {
-        cpu_result[row * N + col] = 0.0f;
-        for (int i = 0; i != N; ++i) {
-          GLfloat a = texture0_data[row * N + i];
-          GLfloat b = texture1_data[i * N + col];
-          cpu_result[row * N + col] += a * b;
-        }
-      }
+  for (auto &input : inputs) {
+    Pin(*input.second);
+  }
+  for (Texture *output : outputs) {
+    if (output->target() != GL_TEXTURE_BUFFER) {
+      std::cerr << "Can only capture into buffer textures!" << std::endl;
+      assert(false);
     }
+    Pin(*output);
   }
-  auto cpu_end = std::chrono::system_clock::now();
 
-  for (size_t i = 0; i < retrieved_data.size(); ++i) {
-    assert(std::abs(retrieved_data[i] - cpu_result[i]) < 0.001f);
+  BindInputs(program, inputs, uniforms);
+  for (GLuint index = 0; index != outputs.size(); ++index) {
+    OPENGL_CALL(glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, index,
+                                 outputs[index]->buffer_));
   }
 
-  std::cout << "cpu:    "
-            << (std::chrono::duration_cast<std::chrono::microseconds>(cpu_end - cpu_start).count() / niters)
-            << std::endl;
-}
+  GLuint query;
+  OPENGL_CALL(glGenQueries(1, &query));
+
+  OPENGL_CALL(glBindVertexArray(empty_vertex_array_));
+  OPENGL_CALL(glEnable(GL_RASTERIZER_DISCARD));
+  OPENGL_CALL(glBeginQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN, query));
+  OPENGL_CALL(glBeginTransformFeedback(GL_POINTS));
+  OPENGL_CALL(glDrawArrays(GL_POINTS, 0, count));
+  OPENGL_CALL(glEndTransformFeedback());
+  OPENGL_CALL(glEndQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN));
+  OPENGL_CALL(glDisable(GL_RASTERIZER_DISCARD));
+  OPENGL_CALL(glBindVertexArray(vertex_array_));
+
+  for (GLuint index = 0; index != outputs.size(); ++index) {
+    OPENGL_CALL(glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, index, 0));
+  }
 
-int main(int argc, char **argv) {
-  Workspace::GetInstance();
+  GLuint written;
+  OPENGL_CALL(glGetQueryObjectuiv(query, GL_QUERY_RESULT, &written));
+  OPENGL_CALL(glDeleteQueries(1, &query));
 
-  TestRenderToTexture(atoi(argv[1]), /*niters=*/atoi(argv[2]));
+  for (auto &input : inputs) {
+    Unpin(*input.second);
+  }
+  for (Texture *output : outputs) {
+    Unpin(*output);
+  }
 
-  return 0;
+  return written;
 }
 
-Program::Program(Program &&other) noexcept : program_(other.program_) {
-  other.program_ = kInvalidProgram;
-}
+void Workspace::Scatter(
+    const Program &program,
+    const std::vector<std::pair<std::string, Texture *>> &inputs,
+    const std::vector<std::pair<std::string, int>> &uniforms,
+    GLsizei count, Texture *output, bool clear) {
+  GLuint frame_buffer = BeginPass(program, inputs, uniforms, output);
 
-Program::Program(GLuint program) : program_(program) {}
+  if (clear) {
+    OPENGL_CALL(glClearColor(0.0f, 0.0f, 0.0f, 0.0f));
+    OPENGL_CALL(glClear(GL_COLOR_BUFFER_BIT));
+  }
 
-Program::~Program() {
-  if (program_ != kInvalidProgram) {
-    glDeleteProgram(program_);
-    program_ = kInvalidProgram;
+  OPENGL_CALL(glBindVertexArray(empty_vertex_array_));
+  OPENGL_CALL(glEnable(GL_BLEND));
+  OPENGL_CALL(glBlendFunc(GL_ONE, GL_ONE));
+  OPENGL_CALL(glDrawArrays(GL_POINTS, 0, count));
+  OPENGL_CALL(glDisable(GL_BLEND));
+  OPENGL_CALL(glBindVertexArray(vertex_array_));
+
+  EndPass(inputs, output, frame_buffer);
+}
+
+const Program &Workspace::GetCachedPointProgram(
+    const char *vertex_shader_src) {
+  auto it = point_programs_.find(vertex_shader_src);
+  if (it == point_programs_.end()) {
+    it = point_programs_.emplace(
+        vertex_shader_src,
+        CreatePointProgram(vertex_shader_src,
+                           point_fragment_shader_text)).first;
   }
+  return it->second;
 }
 
-Texture::Texture(const GLfloat *data, GLsizei width, GLsizei height)
-    : texture_(kInvalidTexture), width_(width), height_(height) {
-  auto &workspace = Workspace::GetInstance();
+void Workspace::ScatterAdd(TypedTexture<dtype::Int32> *indices,
+                           Texture *values, Texture *output) {
+  if (values->height() != indices->width()
+      || values->width() != output->width()) {
+    std::cerr << "ScatterAdd shape mismatch." << std::endl;
+    assert(false);
+  }
+  // The vertex shader fetches indices from an isamplerBuffer.
+  if (indices->target() != GL_TEXTURE_BUFFER) {
+    std::cerr << "ScatterAdd indices must be a buffer texture!" << std::endl;
+    assert(false);
+  }
+
+  const Program &program =
+      GetCachedPointProgram(scatter_add_vertex_shader_text);
+  Scatter(program, {{"indices", indices}, {"values", values}},
+          {{"dim", values->width()}, {"out_rows", output->height()}},
+          values->width() * values->height(), output, false);
+}
 
-  // Create a texture.
-  OPENGL_CALL(glGenTextures(1, &texture_));
+void Workspace::Histogram(TypedTexture<dtype::Int32> *values,
+                          Texture *counts) {
+  // The vertex shader fetches values from an isamplerBuffer.
+  if (values->target() != GL_TEXTURE_BUFFER) {
+    std::cerr << "Histogram values must be a buffer texture!" << std::endl;
+    assert(false);
+  }
 
-  std::clog << "Created texture [" << texture_ << "]" << std::endl;
+  Scatter(GetCachedPointProgram(histogram_vertex_shader_text),
+          {{"values", values}}, {{"bins", counts->width()}}, values->width(),
+          counts, true);
+}
 
-  // Bind to temporary unit.
-  workspace.BindTextureUnit(workspace.NumTextureUnits() - 1, texture_);
+template <typename DType>
+PingPong<DType> Workspace::CreatePingPong(GLsizei width, GLsizei height) {
+  return PingPong<DType>(CreateTexture<DType>(nullptr, width, height),
+                         CreateTexture<DType>(nullptr, width, height));
+}
 
-  // Similar to cudaMemcpy.
-  OPENGL_CALL(glTexImage2D(GL_TEXTURE_2D, /*level=*/0, GL_RGBA32F,
-                           width_, height_, /*border=*/0,
-                           GL_RED, GL_FLOAT, data));
+PingPong<dtype::Float32x4> Workspace::PadRows(
+    TypedTexture<dtype::Float32x4> *pairs, GLsizei width, bool descending) {
+  auto padded = CreatePingPong<dtype::Float32x4>(width, pairs->height());
+  Dispatch(GetCachedProgram(bitonic_pad_shader_text), {{"X", pairs}},
+           {{"cols", pairs->width()}, {"descending", descending}},
+           &padded.back());
+  padded.Swap();
+  return padded;
+}
 
-  // TODO(zhixunt): What are these?
-  OPENGL_CALL(
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
-  OPENGL_CALL(
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
-  OPENGL_CALL(
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
-  OPENGL_CALL(
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+void Workspace::BitonicMerge(PingPong<dtype::Float32x4> *pairs,
+                             GLsizei width, GLsizei k, GLsizei j_start,
+                             bool descending) {
+  const Program &program = GetCachedProgram(bitonic_shader_text);
+  for (GLsizei j = j_start; j >= 1; j /= 2) {
+    Dispatch(program, {{"X", &pairs->front()}},
+             {{"k", k}, {"j", j}, {"descending", descending}},
+             &pairs->back(), 0, 0, width, pairs->back().height());
+    pairs->Swap();
+  }
 }
 
-Texture::Texture(Texture &&other) noexcept
-    : texture_(other.texture_), width_(other.width_), height_(other.height_) {
-  other.texture_ = kInvalidTexture;
+TypedTexture<dtype::Float32x4> Workspace::CropRows(
+    PingPong<dtype::Float32x4> *pairs, GLsizei width) {
+  auto cropped = CreateTexture<dtype::Float32x4>(nullptr, width,
+                                                 pairs->front().height());
+  Dispatch(GetCachedProgram(bitonic_pad_shader_text),
+           {{"X", &pairs->front()}}, {{"cols", width}, {"descending", 0}},
+           &cropped);
+  return cropped;
 }
 
-Texture::~Texture() {
-  if (texture_ != kInvalidTexture) {
-    std::clog << "Deleting texture [" << texture_ << "]" << std::endl;
-    OPENGL_CALL(glDeleteTextures(1, &texture_));
-    texture_ = kInvalidTexture;
+TypedTexture<dtype::Float32x4> Workspace::SortRows(
+    TypedTexture<dtype::Float32x4> *pairs, bool descending) {
+  GLsizei width = 1;
+  while (width < pairs->width()) {
+    width *= 2;
   }
+
+  auto sorted = PadRows(pairs, width, descending);
+  for (GLsizei k = 2; k <= width; k *= 2) {
+    BitonicMerge(&sorted, width, k, k / 2, descending);
+  }
+  return CropRows(&sorted, pairs->width());
 }
 
-void Texture::GetData(GLfloat *data) const {
-  auto &workspace = Workspace::GetInstance();
-  workspace.BindTextureUnit(workspace.NumTextureUnits() - 1, texture_);
+TypedTexture<dtype::Float32x4> Workspace::TopK(
+    TypedTexture<dtype::Float32x4> *pairs, GLsizei k) {
+  if (k < 1 || k > pairs->width()) {
+    std::cerr << "TopK needs 1 <= k <= " << pairs->width() << "."
+              << std::endl;
+    assert(false);
+  }
+
+  GLsizei block = 1;
+  while (block < k) {
+    block *= 2;
+  }
+  GLsizei width = block;
+  while (width < pairs->width()) {
+    width *= 2;
+  }
+
+  // Sort blocks, alternately ascending and descending.
+  auto top = PadRows(pairs, width, true);
+  for (GLsizei stage = 2; stage <= block; stage *= 2) {
+    BitonicMerge(&top, width, stage, stage / 2, false);
+  }
 
-  glGetTexImage(GL_TEXTURE_2D, /*level=*/0, GL_RED, GL_FLOAT, data);
+  // Merge pairs of blocks, then sort the resulting bitonic blocks.
+  for (; width > block; width /= 2) {
+    Dispatch(GetCachedProgram(bitonic_topk_shader_text),
+             {{"X", &top.front()}}, {{"k", block}}, &top.back(), 0, 0,
+             width / 2, top.back().height());
+    top.Swap();
+    BitonicMerge(&top, width / 2, block, block / 2, false);
+  }
+
+  // The last block is bitonic: sort it descending.
+  BitonicMerge(&top, block, 2 * block, block / 2, true);
+  return CropRows(&top, k);
 }
 
-GLuint Workspace::NumTextureUnits() {
-  GLint num_units;
-  OPENGL_CALL(glGetIntegerv(GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS, &num_units));
-  return static_cast<GLuint>(num_units);
+void Workspace::ScanRows(Texture *input, Texture *output, bool inclusive) {
+  GLsizei rows = input->height();
+
+  // Up-sweep, until a level fits in one block.
+  const Program &reduce = GetCachedProgram(scan_reduce_shader_text);
+  std::vector<Texture> levels;
+  while (true) {
+    Texture *level = levels.empty() ? input : &levels.back();
+    if (level->width() <= kScanRadix) {
+      break;
+    }
+    Texture sums = CreateTexture(
+        nullptr, (level->width() + kScanRadix - 1) / kScanRadix, rows);
+    Dispatch(reduce, {{"X", level}},
+             {{"cols", level->width()}, {"radix", kScanRadix}}, &sums);
+    levels.push_back(std::move(sums));
+  }
+
+  // Down-sweep: exclusive prefixes of each level, from the top.
+  const Program &down = GetCachedProgram(scan_down_shader_text);
+  if (levels.empty()) {
+    Dispatch(down, {{"X", input}, {"P", input}},
+             {{"radix", kScanRadix}, {"has_parent", 0},
+              {"inclusive", inclusive}},
+             output);
+    return;
+  }
+
+  auto prefixes = CreatePingPong<dtype::Float32>(levels.front().width(),
+                                                 rows);
+  for (size_t i = levels.size(); i-- > 0;) {
+    bool top = i + 1 == levels.size();
+    Dispatch(down, {{"X", &levels[i]}, {"P", &prefixes.front()}},
+             {{"radix", kScanRadix}, {"has_parent", !top},
+              {"inclusive", 0}},
+             &prefixes.back(), 0, 0, levels[i].width(), rows);
+    prefixes.Swap();
+  }
+  Dispatch(down, {{"X", input}, {"P", &prefixes.front()}},
+           {{"radix", kScanRadix}, {"has_parent", 1},
+            {"inclusive", inclusive}},
+           output);
 }
 
-// https://www.opengl.org/discussion_boards/showthread.php/174926-when-to-use-glActiveTexture
-// Consider the internal OpenGL texture system as this.
-//   struct TextureUnit {
-//     GLuint target_texture_1D;
-//     GLuint target_texture_2D;
-//     GLuint target_texture_3D;
-//     GLuint target_texture_cube;
-//     ...
-//   };
-//   TextureUnit texture_units[GL_MAX_TEXTURE_IMAGE_UNITS];
-//   GLuint curr_texture_unit; // global state!!!
-//
-// Then:
-//   "glActiveTexture(GL_TEXTURE0);"
-//     <=>
-//   "curr_texture_unit = 0;"
-//
-//   "glBindTexture(GL_TEXTURE_1D, texture0);"
-//     <=>
-//   "texture_units[curr_texture_unit].target_texture_1D = texture0;"
-void Workspace::BindTextureUnit(GLuint unit, GLuint texture) {
-  OPENGL_CALL(glActiveTexture(GL_TEXTURE0 + unit));
-  OPENGL_CALL(glBindTexture(GL_TEXTURE_2D, texture));
+void Workspace::Scan(Texture *input, Texture *output, bool inclusive) {
+  GLsizei rows = input->height();
+  if (rows == 1) {
+    ScanRows(input, output, inclusive);
+    return;
+  }
+
+  Texture exclusive = CreateTexture(nullptr, input->width(), rows);
+  ScanRows(input, &exclusive, false);
+
+  Texture totals = CreateTexture(nullptr, rows, 1);
+  Dispatch(GetCachedProgram(scan_totals_shader_text),
+           {{"X", input}, {"E", &exclusive}}, {{"cols", input->width()}},
+           &totals);
+  Texture offsets = CreateTexture(nullptr, rows, 1);
+  ScanRows(&totals, &offsets, false);
+
+  Dispatch(GetCachedProgram(scan_offset_shader_text),
+           {{"X", input}, {"E", &exclusive}, {"T", &offsets}},
+           {{"inclusive", inclusive}}, output);
 }
 
-void Workspace::BindTextureUnit(GLuint unit, const Texture &texture) {
-  BindTextureUnit(unit, texture.texture());
+TypedTexture<dtype::Complex64> Workspace::ToComplex(Texture *real) {
+  auto complex = CreateTexture<dtype::Complex64>(nullptr, real->width(),
+                                                 real->height());
+  Dispatch(GetCachedProgram(real_to_complex_shader_text), {{"X", real}}, {},
+           &complex);
+  return complex;
 }
 
-Workspace &Workspace::GetInstance() {
-  static std::unique_ptr<Workspace> instance_(new Workspace);
-  return *instance_;
+void Workspace::FftRows(TypedTexture<dtype::Complex64> *input,
+                        TypedTexture<dtype::Complex64> *output,
+                        bool inverse) {
+  Fft(input, output, 0, inverse);
 }
 
-Workspace::Workspace() {
-  // Set an error handler.
-  // This can be called before glfwInit().
-  glfwSetErrorCallback(&GlfwErrorCallback);
+void Workspace::Fft2d(TypedTexture<dtype::Complex64> *input,
+                      TypedTexture<dtype::Complex64> *output, bool inverse) {
+  auto rows = CreateTexture<dtype::Complex64>(nullptr, input->width(),
+                                              input->height());
+  Fft(input, &rows, 0, inverse);
+  Fft(&rows, output, 1, inverse);
+}
 
-  // Initialize GLFW.
-  if (glfwInit() != GL_TRUE) {
-    std::cout << "glfwInit() failed!" << std::endl;
+void Workspace::Fft(TypedTexture<dtype::Complex64> *input,
+                    TypedTexture<dtype::Complex64> *output, int axis,
+                    bool inverse) {
+  GLsizei n = axis == 0 ? input->width() : input->height();
+  if (n < 2 || (n & (n - 1)) != 0) {
+    std::cerr << "FFT length " << n << " is not a power of 2 above 1."
+              << std::endl;
     assert(false);
   }
 
-  // Create a window.
-  // TODO(zhixunt): GLFW allows us to create an invisible window.
-  // TODO(zhixunt): On retina display, window size is different from framebuffer size.
-  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-  window_ = glfwCreateWindow(kWindowWidth, kWindowHeight, "", nullptr, nullptr);
-  if (window_ == nullptr) {
-    std::cout << "glfwCreateWindow() failed!" << std::endl;
-    assert(false);
+  // exp(-2 pi i k / n) for k in [0, n).
+  auto it = fft_twiddles_.find(n);
+  if (it == fft_twiddles_.end()) {
+    std::vector<GLfloat> data(static_cast<size_t>(n) * 2);
+    for (GLsizei k = 0; k != n; ++k) {
+      double angle = -2.0 * std::acos(-1.0) * k / n;
+      data[k * 2] = static_cast<GLfloat>(std::cos(angle));
+      data[k * 2 + 1] = static_cast<GLfloat>(std::sin(angle));
+    }
+    it = fft_twiddles_.emplace(
+        n, CreateTexture<dtype::Complex64>(data.data(), n, 1)).first;
   }
 
-  std::cout << "GLFW says OpenGL version: "
-            << glfwGetWindowAttrib(window_, GLFW_CONTEXT_VERSION_MAJOR)
-            << "."
-            << glfwGetWindowAttrib(window_, GLFW_CONTEXT_VERSION_MINOR)
-            << "."
-            << glfwGetWindowAttrib(window_, GLFW_CONTEXT_REVISION)
-            << std::endl;
-
-  // Before using any OpenGL API, we must specify a context.
-  glfwMakeContextCurrent(window_);
-
-  // Must be called after creating GLFW window.
-  gladLoadGL();
-
-  std::cout << "Opengl says version: " << glGetString(GL_VERSION) << std::endl;
+  std::vector<GLsizei> radices;
+  GLsizei remaining = n;
+  for (; remaining % 4 == 0; remaining /= 4) {
+    radices.push_back(4);
+  }
+  if (remaining == 2) {
+    radices.push_back(2);
+  }
 
-  OPENGL_CHECK_ERROR();
+  const Program &program = GetCachedProgram(fft_shader_text);
+  auto buffers = CreatePingPong<dtype::Complex64>(input->width(),
+                                                  input->height());
+  GLsizei ns = 1;
+  for (size_t pass = 0; pass != radices.size(); ++pass) {
+    bool last = pass + 1 == radices.size();
+    Dispatch(program,
+             {{"X", pass == 0 ? input : &buffers.front()},
+              {"twiddles", &it->second}},
+             {{"n", n}, {"ns", ns}, {"radix", radices[pass]},
+              {"axis", axis}, {"inverse", inverse}, {"last", last}},
+             last ? output : &buffers.back());
+    buffers.Swap();
+    ns *= radices[pass];
+  }
+}
 
-  // We always render the same vertices and triangles.
-  GLuint vertex_buffer;
-  OPENGL_CALL(glGenBuffers(1, &vertex_buffer));
-  OPENGL_CALL(glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer));
-  OPENGL_CALL(glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices,
-                           GL_STATIC_DRAW));
+GLuint Workspace::Filter(TypedTexture<dtype::Float32> *input,
+                         const std::string &predicate,
+                         TypedTexture<dtype::Float32> *values,
+                         TypedTexture<dtype::Int32> *indices) {
+  // The vertex shader fetches from a samplerBuffer.
+  if (input->target() != GL_TEXTURE_BUFFER) {
+    std::cerr << "Can only filter buffer textures!" << std::endl;
+    assert(false);
+  }
 
-  GLuint vertex_array;
-  OPENGL_CALL(glGenVertexArrays(1, &vertex_array));
-  OPENGL_CALL(glBindVertexArray(vertex_array));
-  glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+  auto it = filter_programs_.find(predicate);
+  if (it == filter_programs_.end()) {
+    std::string geometry_shader_src = filter_geometry_shader_text;
+    geometry_shader_src.insert(
+        geometry_shader_src.find('\n') + 1,
+        "bool Keep(float x) { return " + predicate + "; }\n");
+    it = filter_programs_.emplace(predicate, CreateFeedbackProgram(
+        filter_vertex_shader_text, geometry_shader_src.c_str(),
+        {"value", "index"})).first;
+  }
 
-  // We always use the same vertex shader.
-  vertex_shader_ = CreateShader(GL_VERTEX_SHADER, vertex_shader_text_);
+  return Feedback(it->second, {{"X", input}}, {}, input->width(),
+                  {values, indices});
 }
 
-Workspace::~Workspace() {
-  // Paired with glfwCreateWindow().
-  glfwDestroyWindow(window_);
-
-  // Paired with glfwInit().
-  glfwTerminate();
+Texture Workspace::CreateTexture(const GLfloat *data, GLsizei width,
+                                 GLsizei height) {
+  return Texture(data, width, height);
 }
 
-/*!
- * \brief Create a program that uses the given vertex and fragment shader.
- * \param fragment_shader The fragment shader **source**.
- * \return The program ID.
- */
-Program Workspace::CreateProgram(const char *fragment_shader_src) {
-  // Create and compile the shaders.
-  GLuint fragment_shader = CreateShader(GL_FRAGMENT_SHADER,
-                                        fragment_shader_src);
+QuantizedTexture Workspace::CreateQuantizedTexture(const GLubyte *data,
+                                                  GLsizei rows, GLsizei cols,
+                                                  const QuantParams &params) {
+  if (cols % 4 != 0) {
+    std::cerr << "Quantized matrices must have a multiple of 4 columns."
+              << std::endl;
+    assert(false);
+  }
 
-  // Link the shaders and create the program.
-  Program program = CreateProgram(fragment_shader);
+  auto num_channels = static_cast<GLsizei>(params.scales.size());
+  bool per_channel = num_channels != 1;
+  assert(params.zero_points.size() == params.scales.size());
+  assert(!per_channel || num_channels == rows);
+
+  std::vector<GLfloat> packed_params(static_cast<size_t>(num_channels) * 4,
+                                     0.0f);
+  for (GLsizei channel = 0; channel != num_channels; ++channel) {
+    packed_params[channel * 4] = params.scales[channel];
+    packed_params[channel * 4 + 1] =
+        static_cast<GLfloat>(params.zero_points[channel]);
+  }
 
-  OPENGL_CALL(glDeleteShader(fragment_shader));
+  return QuantizedTexture(
+      CreateTexture<dtype::UInt8x4Integer>(data, rows * cols / 4, 1),
+      CreateTexture<dtype::Float32x4>(packed_params.data(), num_channels, 1),
+      rows, cols, per_channel);
+}
 
-  return program;
+Nhwc4Tensor Workspace::CreateNhwc4Tensor(const GLfloat *nhwc, GLsizei batch,
+                                         GLsizei height, GLsizei width,
+                                         GLsizei channels) {
+  GLsizei c4 = (channels + 3) / 4;
+  if (nhwc == nullptr) {
+    return Nhwc4Tensor(
+        CreateTexture<dtype::Float32x4>(nullptr, width * c4, batch * height),
+        batch, height, width, channels);
+  }
+
+  size_t num_pixels = static_cast<size_t>(batch) * height * width;
+  std::vector<GLfloat> packed(num_pixels * c4 * 4, 0.0f);
+  for (size_t pixel = 0; pixel != num_pixels; ++pixel) {
+    std::memcpy(&packed[pixel * c4 * 4], nhwc + pixel * channels,
+                sizeof(GLfloat) * channels);
+  }
+  return Nhwc4Tensor(
+      CreateTexture<dtype::Float32x4>(packed.data(), width * c4,
+                                      batch * height),
+      batch, height, width, channels);
 }
 
-void Workspace::Render(
-    const Program &program,
-    const std::vector<std::pair<std::string, Texture *>> &inputs,
-    const std::vector<std::pair<std::string, int>> &uniforms,
-    Texture *output,
-    int niters) {
-  if (inputs.size() + 2 > NumTextureUnits()) {
-    std::cerr << "Too many inputs!" << std::endl;
+Conv2dFilter Workspace::CreateConv2dFilter(const GLfloat *hwio,
+                                           const GLfloat *bias,
+                                           GLsizei kernel_h, GLsizei kernel_w,
+                                           GLsizei in_channels,
+                                           GLsizei out_channels) {
+  GLsizei in_c4 = (in_channels + 3) / 4;
+  GLsizei out_c4 = (out_channels + 3) / 4;
+
+  // Each output channel block is a row of 4 texels per tap and input block.
+  GLint max_size;
+  OPENGL_CALL(glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size));
+  if (kernel_h * kernel_w * in_c4 * 4 > max_size || out_c4 > max_size) {
+    std::cerr << "Conv2d filter " << kernel_h << "x" << kernel_w << "x"
+              << in_channels << "x" << out_channels << " needs "
+              << kernel_h * kernel_w * in_c4 * 4 << " x " << out_c4
+              << " texels, over GL_MAX_TEXTURE_SIZE " << max_size
+              << std::endl;
     assert(false);
   }
 
-  OPENGL_CALL(glUseProgram(program.program_));
+  // Pack num_taps x in_channels x out_channels weights.
+  auto pack = [&](const GLfloat *taps, GLsizei num_taps) {
+    GLsizei row_texels = num_taps * in_c4 * 4;
+    std::vector<GLfloat> packed(static_cast<size_t>(row_texels) * out_c4 * 4,
+                                0.0f);
+    for (GLsizei tap = 0; tap != num_taps; ++tap) {
+      for (GLsizei ic = 0; ic != in_channels; ++ic) {
+        for (GLsizei oc = 0; oc != out_channels; ++oc) {
+          // Texel (4 * k4 + ic % 4, oc / 4), lane oc % 4.
+          size_t texel = static_cast<size_t>(oc / 4) * row_texels
+                         + (tap * in_c4 + ic / 4) * 4 + ic % 4;
+          packed[texel * 4 + oc % 4] =
+              taps[(static_cast<size_t>(tap) * in_channels + ic)
+                   * out_channels + oc];
+        }
+      }
+    }
+    return CreateTexture<dtype::Float32x4>(packed.data(), row_texels, out_c4);
+  };
 
-  // Create frame buffer.
-  GLuint frame_buffer;
-  OPENGL_CALL(glGenFramebuffers(1, &frame_buffer));
-  OPENGL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, frame_buffer));
+  std::vector<GLfloat> packed_bias(static_cast<size_t>(out_c4) * 4, 0.0f);
+  if (bias != nullptr) {
+    std::copy(bias, bias + out_channels, packed_bias.begin());
+  }
 
-  // Set "renderedTexture" as our colour attachement #0
-  OPENGL_CALL(glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                                   output->texture(), 0));
+  // Without room for the 16 transformed taps, Winograd is not an option.
+  std::unique_ptr<TypedTexture<dtype::Float32x4>> winograd_weights;
+  if (kernel_h == 3 && kernel_w == 3 && 16 * in_c4 * 4 <= max_size) {
+    // U = G g G^T for every pair of channels, as 16 x in x out.
+    static const GLfloat G[4][3] = {
+        {1.0f, 0.0f, 0.0f},
+        {0.5f, 0.5f, 0.5f},
+        {0.5f, -0.5f, 0.5f},
+        {0.0f, 0.0f, 1.0f},
+    };
+    size_t num_pairs = static_cast<size_t>(in_channels) * out_channels;
+    std::vector<GLfloat> u(16 * num_pairs, 0.0f);
+    for (size_t pair = 0; pair != num_pairs; ++pair) {
+      // g[i][j] is tap 3 * i + j.
+      auto g = [&](int i, int j) {
+        return hwio[(3 * i + j) * num_pairs + pair];
+      };
+      for (int a = 0; a != 4; ++a) {
+        for (int b = 0; b != 4; ++b) {
+          GLfloat sum = 0.0f;
+          for (int i = 0; i != 3; ++i) {
+            for (int j = 0; j != 3; ++j) {
+              sum += G[a][i] * g(i, j) * G[b][j];
+            }
+          }
+          u[(a * 4 + b) * num_pairs + pair] = sum;
+        }
+      }
+    }
+    winograd_weights.reset(
+        new TypedTexture<dtype::Float32x4>(pack(u.data(), 16)));
+  }
 
-  // Set the list of draw buffers.
-  GLenum DrawBuffers[1] = {GL_COLOR_ATTACHMENT0};
-  // "1" is the size of DrawBuffers.
-  OPENGL_CALL(glDrawBuffers(1, DrawBuffers));
+  return Conv2dFilter(
+      pack(hwio, kernel_h * kernel_w),
+      CreateTexture<dtype::Float32x4>(packed_bias.data(), out_c4, 1),
+      std::move(winograd_weights), kernel_h, kernel_w, in_channels,
+      out_channels);
+}
 
-  // Always check that our framebuffer is ok
-  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-    std::cout << "Framebuffer not complete." << std::endl;
+Nhwc4Tensor Workspace::Conv2d(const Nhwc4Tensor &input, Conv2dFilter &filter,
+                              GLsizei stride, GLsizei padding,
+                              Conv2dAlgorithm algorithm) {
+  if (input.channels() != filter.in_channels()) {
+    std::cerr << "Conv2d: " << input.channels() << " input channels, but "
+              << "the filter takes " << filter.in_channels() << std::endl;
     assert(false);
   }
 
-  // Tell the fragment shader what input textures to use.
-  for (GLuint unit = 0; unit != inputs.size(); ++unit) {
-    const std::string &name = inputs[unit].first;
-    Texture *texture = inputs[unit].second;
+  GLsizei out_height =
+      (input.height() + 2 * padding - filter.kernel_h()) / stride + 1;
+  GLsizei out_width =
+      (input.width() + 2 * padding - filter.kernel_w()) / stride + 1;
+  Nhwc4Tensor output = CreateNhwc4Tensor(nullptr, input.batch(), out_height,
+                                         out_width, filter.out_channels());
+
+  GLsizei kk4 = filter.kernel_h() * filter.kernel_w() * input.c4();
+  GLsizei im2col_width = out_width * kk4;
+  GLsizei im2col_height = input.batch() * out_height;
+
+  GLint max_size;
+  OPENGL_CALL(glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size));
+
+  // The 16 positions of the Winograd transforms are stacked vertically.
+  GLsizei tiles_h = (out_height + 1) / 2;
+  GLsizei tiles_w = (out_width + 1) / 2;
+  GLsizei rows_per_pos = input.batch() * tiles_h;
+  bool winograd = filter.winograd_weights() != nullptr && stride == 1
+                  && 16 * rows_per_pos <= max_size;
+
+  if (algorithm == Conv2dAlgorithm::kAuto && winograd) {
+    algorithm = Conv2dAlgorithm::kWinograd;
+  }
+  bool im2col_fits = im2col_width <= max_size && im2col_height <= max_size;
+  if (algorithm == Conv2dAlgorithm::kAuto) {
+    size_t im2col_bytes = gl::TexelSize(GL_RGBA32F) * im2col_width
+                          * im2col_height;
+    bool fits = im2col_fits && im2col_bytes <= kMaxIm2colBytes;
+    bool single_tap = filter.kernel_h() == 1 && filter.kernel_w() == 1;
+    algorithm = fits && !single_tap ? Conv2dAlgorithm::kIm2col
+                                    : Conv2dAlgorithm::kDirect;
+  }
+  if (algorithm == Conv2dAlgorithm::kIm2col && !im2col_fits) {
+    std::cerr << "Conv2d: the im2col matrix needs " << im2col_width << " x "
+              << im2col_height << " texels, over GL_MAX_TEXTURE_SIZE "
+              << max_size << std::endl;
+    assert(false);
+  }
 
-    BindTextureUnit(unit, *texture);
+  // Textures are const only in their contents.
+  auto input_texture = const_cast<TypedTexture<dtype::Float32x4> *>(
+      &input.texture());
 
-    GLint texture_uniform = glGetUniformLocation(program.program_,
-                                                 name.c_str());
-    OPENGL_CALL(glUniform1i(texture_uniform, unit));
-  }
+  if (algorithm == Conv2dAlgorithm::kWinograd) {
+    if (!winograd) {
+      std::cerr << "Winograd conv2d needs a 3x3 filter with at most "
+                << max_size / 16 << " input channels, stride 1 and at most "
+                << max_size / 16 << " rows of tiles." << std::endl;
+      assert(false);
+    }
 
-  // Tell the fragment shader about uniforms.
-  for (auto &uniform : uniforms) {
-    const std::string &name = uniform.first;
-    int value = uniform.second;
-    GLint shader_uniform = glGetUniformLocation(program.program_, name.c_str());
-    OPENGL_CALL(glUniform1i(shader_uniform, value));
+    auto v = CreateTexture<dtype::Float32x4>(nullptr, tiles_w * input.c4(),
+                                             16 * rows_per_pos);
+    auto m = CreateTexture<dtype::Float32x4>(nullptr, tiles_w * output.c4(),
+                                             16 * rows_per_pos);
+    Dispatch(GetCachedProgram(winograd_input_shader_text),
+             {{"X", input_texture}},
+             {{"in_height", input.height()}, {"in_width", input.width()},
+              {"in_c4", input.c4()}, {"tiles_h", tiles_h},
+              {"rows_per_pos", rows_per_pos}, {"padding", padding}},
+             &v);
+    Dispatch(GetCachedProgram(winograd_gemm_shader_text),
+             {{"V", &v}, {"U", filter.winograd_weights()}},
+             {{"in_c4", input.c4()}, {"out_c4", output.c4()},
+              {"rows_per_pos", rows_per_pos}},
+             &m);
+    Dispatch(GetCachedProgram(winograd_output_shader_text),
+             {{"M", &m}, {"bias", &filter.bias()}},
+             {{"out_height", out_height}, {"out_c4", output.c4()},
+              {"tiles_h", tiles_h}, {"rows_per_pos", rows_per_pos}},
+             &output.texture());
+    return output;
   }
 
-  OPENGL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, frame_buffer));
-  OPENGL_CALL(glViewport(0, 0, output->width(), output->height()));
-
-  auto opengl_start = std::chrono::system_clock::now();
-  for (int iter = 0; iter < niters; ++iter) {
-    OPENGL_CALL(glClear(GL_COLOR_BUFFER_BIT));
-    OPENGL_CALL(glDrawArrays(GL_TRIANGLES, 0, 6));
-    glFinish();
+  if (algorithm == Conv2dAlgorithm::kDirect) {
+    Dispatch(GetCachedProgram(conv2d_direct_shader_text),
+             {{"X", input_texture}, {"W", &filter.weights()},
+              {"bias", &filter.bias()}},
+             {{"in_height", input.height()}, {"in_width", input.width()},
+              {"in_c4", input.c4()}, {"out_height", out_height},
+              {"out_c4", output.c4()}, {"kernel_h", filter.kernel_h()},
+              {"kernel_w", filter.kernel_w()}, {"stride", stride},
+              {"padding", padding}},
+             &output.texture());
+    return output;
   }
 
-  glDeleteFramebuffers(1, &frame_buffer);
+  auto cols = CreateTexture<dtype::Float32x4>(nullptr, im2col_width,
+                                              im2col_height);
+  Dispatch(GetCachedProgram(im2col_shader_text), {{"X", input_texture}},
+           {{"in_height", input.height()}, {"in_width", input.width()},
+            {"in_c4", input.c4()}, {"out_height", out_height},
+            {"kernel_w", filter.kernel_w()}, {"kk4", kk4},
+            {"stride", stride}, {"padding", padding}},
+           &cols);
+  Dispatch(GetCachedProgram(im2col_matmul_shader_text),
+           {{"cols", &cols}, {"W", &filter.weights()},
+            {"bias", &filter.bias()}},
+           {{"out_c4", output.c4()}, {"kk4", kk4}}, &output.texture());
+  return output;
+}
 
-  auto opengl_end = std::chrono::system_clock::now();
-  std::cout << "opengl: "
-            << (std::chrono::duration_cast<std::chrono::microseconds>(opengl_end - opengl_start).count() / niters)
-            << std::endl;
+TypedTexture<dtype::Float32x4> Workspace::CreateVec4Matrix(
+    const GLfloat *data, GLsizei rows, GLsizei cols) {
+  GLsizei cols4 = (cols + 3) / 4;
+  std::vector<GLfloat> packed(static_cast<size_t>(rows) * cols4 * 4, 0.0f);
+  for (GLsizei row = 0; row != rows; ++row) {
+    std::memcpy(&packed[static_cast<size_t>(row) * cols4 * 4],
+                data + static_cast<size_t>(row) * cols,
+                sizeof(GLfloat) * cols);
+  }
+  return CreateTexture<dtype::Float32x4>(packed.data(), cols4, rows);
 }
 
-void Workspace::Render(
-    const Program &program,
-    const std::vector<std::pair<std::string, Texture *>> &inputs) {
-  if (inputs.size() + 1 > NumTextureUnits()) {
-    std::cerr << "Too many inputs!" << std::endl;
+void Workspace::Gemv(TypedTexture<dtype::Float32x4> *a,
+                     TypedTexture<dtype::Float32x4> *x, Texture *y,
+                     Texture *scratch) {
+  GLsizei num_partials = (a->width() + kGemvChunk - 1) / kGemvChunk;
+  if (a->width() != x->width() || y->width() != a->height()
+      || (scratch != nullptr && (scratch->width() != a->height()
+                                 || scratch->height() != num_partials))) {
+    std::cerr << "Gemv shape mismatch." << std::endl;
     assert(false);
   }
 
-  OPENGL_CALL(glUseProgram(program.program_));
+  const Program &partial = GetCachedProgram(gemv_partial_shader_text);
+  std::vector<std::pair<std::string, int>> uniforms = {
+      {"cols4", a->width()}, {"chunk", kGemvChunk}};
+  if (num_partials == 1) {
+    Dispatch(partial, {{"A", a}, {"x", x}}, uniforms, y);
+    return;
+  }
 
-  // Tell the fragment shader what input textures to use.
-  for (GLuint unit = 0; unit != inputs.size(); ++unit) {
-    const std::string &name = inputs[unit].first;
-    Texture *texture = inputs[unit].second;
+  std::unique_ptr<Texture> temporary;
+  if (scratch == nullptr) {
+    temporary.reset(new Texture(CreateGemvScratch(*a)));
+    scratch = temporary.get();
+  }
+  Dispatch(partial, {{"A", a}, {"x", x}}, uniforms, scratch);
+  Dispatch(GetCachedProgram(gemv_reduce_shader_text),
+           {{"partials", scratch}}, {{"num_partials", num_partials}}, y);
+}
 
-    BindTextureUnit(unit, *texture);
+Texture Workspace::CreateGemvScratch(
+    const TypedTexture<dtype::Float32x4> &a) {
+  return CreateTexture(nullptr, a.height(),
+                       (a.width() + kGemvChunk - 1) / kGemvChunk);
+}
 
-    GLint texture_uniform = glGetUniformLocation(program.program_,
-                                                 name.c_str());
-    OPENGL_CALL(glUniform1i(texture_uniform, unit));
+TypedTexture<dtype::Float32x4> Workspace::RowStats(const Program &program,
+                                                   Texture *input,
+                                                   int partials) {
+  GLsizei width = (input->width() + kRowChunk - 1) / kRowChunk;
+  auto stats = CreateTexture<dtype::Float32x4>(nullptr, width,
+                                               input->height());
+  Dispatch(program, {{"X", input}},
+           {{"cols", input->width()}, {"chunk", kRowChunk},
+            {"partials", partials}},
+           &stats);
+  if (width == 1) {
+    return stats;
   }
+  return RowStats(program, &stats, 1);
+}
 
-  // Framebuffer 0 means the window.
-  OPENGL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
-
-  // FIll the entire window.
-  GLint width, height;
-  glfwGetFramebufferSize(window_, &width, &height);
-  OPENGL_CALL(glViewport(0, 0, width, height));
+void Workspace::Softmax(Texture *input, Texture *output) {
+  auto stats = RowStats(GetCachedProgram(softmax_stats_shader_text), input);
+  Dispatch(GetCachedProgram(softmax_shader_text),
+           {{"X", input}, {"stats", &stats}}, {}, output);
+}
 
-  OPENGL_CALL(glClear(GL_COLOR_BUFFER_BIT));
-  OPENGL_CALL(glDrawArrays(GL_TRIANGLES, 0, 6));
+void Workspace::LayerNorm(Texture *input, Texture *gamma, Texture *beta,
+                          GLfloat epsilon, Texture *output) {
+  auto stats = RowStats(GetCachedProgram(layernorm_stats_shader_text), input);
+
+  // Uniforms are integers, so epsilon is baked into the program.
+  std::string source = layernorm_shader_text;
+  source.insert(source.find('\n') + 1,
+                "const float epsilon = " + FloatLiteral(epsilon) + ";\n");
+  Dispatch(GetCachedProgram(source),
+           {{"X", input}, {"stats", &stats}, {"gamma", gamma},
+            {"beta", beta}},
+           {}, output);
 }
 
-/*!
- * \brief Create and compile a shader from a source string.
- * \param shader_kind The kind of shader.
- * Could be GL_VERTEX_SHADER or GL_FRAGMENT_SHADER.
- * \param shader_src The source string of the shader.
- * \return The compiled shader ID.
- */
-GLuint Workspace::CreateShader(GLenum shader_kind, const char *shader_src) {
-  // Create the shader.
-  GLuint shader = glCreateShader(shader_kind);
-  glShaderSource(shader, 1, &shader_src, nullptr);
-  glCompileShader(shader);
+StagingRing Workspace::CreateStagingRing(GLsizeiptr capacity) {
+  return StagingRing(capacity);
+}
 
-  // Check compile errors.
-  GLint err;
-  glGetShaderiv(shader, GL_COMPILE_STATUS, &err);
+void Workspace::Upload(StagingRing *ring, const StagingRing::Region &region,
+                       Texture *texture) {
+  Upload(ring, region, texture, 0, 0, texture->width(), texture->height());
+}
 
-  GLint info_log_len;
-  glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &info_log_len);
+void Workspace::Upload(StagingRing *ring, const StagingRing::Region &region,
+                       Texture *texture, GLint x, GLint y, GLsizei width,
+                       GLsizei height) {
+  Upload(ring, region, texture, x, y, width, height, texture->type_);
+}
 
-  if (info_log_len > 0) {
-    std::unique_ptr<char[]> err_msg(new char[info_log_len + 1]);
-    glGetShaderInfoLog(shader, info_log_len, nullptr, err_msg.get());
-    std::cout << err_msg.get() << std::endl;
-    assert(false);
+void Workspace::Upload(StagingRing *ring, const StagingRing::Region &region,
+                       Texture *texture, GLint x, GLint y, GLsizei width,
+                       GLsizei height, GLenum type) {
+  MakeResident(*texture);
+
+  if (texture->target() == GL_TEXTURE_BUFFER) {
+    // A plain buffer-to-buffer copy.
+    GLsizeiptr texel_size = texture->buffer_size_ / texture->width();
+    assert(y == 0 && height == 1);
+    assert(region.size >= texel_size * width);
+    OPENGL_CALL(glBindBuffer(GL_COPY_READ_BUFFER, ring->buffer()));
+    OPENGL_CALL(glBindBuffer(GL_COPY_WRITE_BUFFER, texture->buffer_));
+    OPENGL_CALL(glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                                    region.offset, texel_size * x,
+                                    texel_size * width));
+    OPENGL_CALL(glBindBuffer(GL_COPY_READ_BUFFER, 0));
+    OPENGL_CALL(glBindBuffer(GL_COPY_WRITE_BUFFER, 0));
+  } else {
+    assert(region.size >= static_cast<GLsizeiptr>(
+        gl::PixelSize(texture->format_, type) * width * height));
+    // With a pixel unpack buffer bound, the "pixels" argument is an offset.
+    BindTextureUnit(NumTextureUnits() - 1, *texture);
+    OPENGL_CALL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring->buffer()));
+    OPENGL_CALL(glPixelStorei(GL_UNPACK_ALIGNMENT, 1));
+    OPENGL_CALL(glTexSubImage2D(
+        GL_TEXTURE_2D, /*level=*/0, x, y, width, height, texture->format_,
+        type, reinterpret_cast<const GLvoid *>(region.offset)));
+    OPENGL_CALL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
   }
 
-  OPENGL_CHECK_ERROR();
+  ring->Fence(region);
+}
 
-  return shader;
+void Workspace::Download(const Texture &texture, StagingRing *ring,
+                         const StagingRing::Region &region) {
+  MakeResident(texture);
+
+  if (texture.target() == GL_TEXTURE_BUFFER) {
+    assert(region.size >= texture.buffer_size_);
+    OPENGL_CALL(glBindBuffer(GL_COPY_READ_BUFFER, texture.buffer_));
+    OPENGL_CALL(glBindBuffer(GL_COPY_WRITE_BUFFER, ring->buffer()));
+    OPENGL_CALL(glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                                    0, region.offset, texture.buffer_size_));
+    OPENGL_CALL(glBindBuffer(GL_COPY_READ_BUFFER, 0));
+    OPENGL_CALL(glBindBuffer(GL_COPY_WRITE_BUFFER, 0));
+  } else {
+    assert(region.size >= static_cast<GLsizeiptr>(
+        gl::PixelSize(texture.format_, texture.type_) * texture.width()
+        * texture.height()));
+    // With a pixel pack buffer bound, the "pixels" argument is an offset.
+    BindTextureUnit(NumTextureUnits() - 1, texture);
+    OPENGL_CALL(glBindBuffer(GL_PIXEL_PACK_BUFFER, ring->buffer()));
+    OPENGL_CALL(glPixelStorei(GL_PACK_ALIGNMENT, 1));
+    OPENGL_CALL(glGetTexImage(GL_TEXTURE_2D, /*level=*/0, texture.format_,
+                              texture.type_,
+                              reinterpret_cast<GLvoid *>(region.offset)));
+    OPENGL_CALL(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+  }
+
+  ring->Fence(region, true);
 }
 
-/*!
- * \brief Create a program that uses the given vertex and fragment shaders.
- * \param fragment_shader The **compiled** fragment shader.
- * \return The program ID.
- */
-Program Workspace::CreateProgram(GLuint fragment_shader) {
-  // Create the program and link the shaders.
-  GLuint program = glCreateProgram();
-  glAttachShader(program, vertex_shader_);
-  glAttachShader(program, fragment_shader);
-  glLinkProgram(program);
+void Workspace::Download(const Texture &texture, StagingRing *ring,
+                         const StagingRing::Region &region, GLint x, GLint y,
+                         GLsizei width, GLsizei height, GLenum type) {
+  MakeResident(texture);
+
+  if (texture.target() == GL_TEXTURE_BUFFER) {
+    GLsizeiptr texel_size = texture.buffer_size_ / texture.width();
+    assert(y == 0 && height == 1);
+    assert(region.size >= texel_size * width);
+    OPENGL_CALL(glBindBuffer(GL_COPY_READ_BUFFER, texture.buffer_));
+    OPENGL_CALL(glBindBuffer(GL_COPY_WRITE_BUFFER, ring->buffer()));
+    OPENGL_CALL(glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                                    texel_size * x, region.offset,
+                                    texel_size * width));
+    OPENGL_CALL(glBindBuffer(GL_COPY_READ_BUFFER, 0));
+    OPENGL_CALL(glBindBuffer(GL_COPY_WRITE_BUFFER, 0));
+  } else {
+    assert(region.size >= static_cast<GLsizeiptr>(
+        gl::PixelSize(texture.format_, type) * width * height));
+    // glGetTexImage cannot read a sub-rectangle, glReadPixels can.
+    GLuint frame_buffer;
+    OPENGL_CALL(glGenFramebuffers(1, &frame_buffer));
+    OPENGL_CALL(glBindFramebuffer(GL_READ_FRAMEBUFFER, frame_buffer));
+    OPENGL_CALL(glFramebufferTexture(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                     texture.texture(), 0));
+    OPENGL_CALL(glReadBuffer(GL_COLOR_ATTACHMENT0));
+
+    OPENGL_CALL(glBindBuffer(GL_PIXEL_PACK_BUFFER, ring->buffer()));
+    OPENGL_CALL(glPixelStorei(GL_PACK_ALIGNMENT, 1));
+    OPENGL_CALL(glReadPixels(x, y, width, height, texture.format_, type,
+                             reinterpret_cast<GLvoid *>(region.offset)));
+    OPENGL_CALL(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+
+    OPENGL_CALL(glBindFramebuffer(GL_READ_FRAMEBUFFER, 0));
+    OPENGL_CALL(glDeleteFramebuffers(1, &frame_buffer));
+  }
 
-  // Check link errors.
-  GLint err;
-  glGetProgramiv(program, GL_LINK_STATUS, &err);
+  ring->Fence(region, true);
+}
 
-  GLint info_log_len;
-  glGetProgramiv(program, GL_INFO_LOG_LENGTH, &info_log_len);
+template <typename DType>
+TypedTexture<DType> Workspace::LoadTexture(const TensorFile &file,
+                                           GLsizei width, GLsizei height,
+                                           StagingRing *ring,
+                                           size_t chunk_size) {
+  using TransferType = typename DType::TransferType;
 
-  if (info_log_len > 0) {
-    std::unique_ptr<char[]> err_msg(new char[info_log_len + 1]);
-    glGetProgramInfoLog(program, info_log_len, nullptr, err_msg.get());
-    std::cout << err_msg.get() << std::endl;
+  if (file.descr() != NpyDescr<TransferType>()) {
+    std::cerr << "Cannot load " << file.descr() << " values into a "
+              << NpyDescr<TransferType>() << " texture." << std::endl;
     assert(false);
   }
 
-  OPENGL_CHECK_ERROR();
+  size_t texel_size = DType::kLanes * sizeof(TransferType);
+  size_t row_size = texel_size * width;
+  if (file.values_size() < row_size * height) {
+    std::cerr << "Tensor file too small for a " << width << " x " << height
+              << " texture." << std::endl;
+    assert(false);
+  }
 
-  OPENGL_CALL(glDetachShader(program, vertex_shader_));
-  OPENGL_CALL(glDetachShader(program, fragment_shader));
+  auto texture = CreateTexture<DType>(nullptr, width, height);
 
-  auto point_attrib = GLuint(glGetAttribLocation(program, "point"));
-  OPENGL_CALL(glEnableVertexAttribArray(point_attrib));
+  chunk_size = std::min(chunk_size, static_cast<size_t>(ring->capacity()));
 
-  OPENGL_CALL(glVertexAttribPointer(point_attrib, 2, GL_FLOAT, GL_FALSE,
-                                    sizeof(Vertex), nullptr));
+  ForEachChunk(width, height, texel_size, chunk_size,
+               [&](GLint x, GLint y, GLsizei texels, GLsizei rows) {
+    size_t begin = row_size * y + texel_size * x;
+    size_t size = texel_size * texels * rows;
 
-  return Program(program);
+    StagingRing::Region region = ring->Acquire(static_cast<GLsizeiptr>(size));
+    std::memcpy(region.data, file.values() + begin, size);
+    Upload(ring, region, &texture, x, y, texels, rows);
+
+    file.Drop(begin, begin + size);
+  });
+
+  return texture;
 }
 
-Texture Workspace::CreateTexture(const GLfloat *data, GLsizei width,
-                                 GLsizei height) {
-  return Texture(data, width, height);
+bool Workspace::HasVersion(GLint major, GLint minor) {
+  GLint context_major, context_minor;
+  OPENGL_CALL(glGetIntegerv(GL_MAJOR_VERSION, &context_major));
+  OPENGL_CALL(glGetIntegerv(GL_MINOR_VERSION, &context_minor));
+  return context_major > major
+         || (context_major == major && context_minor >= minor);
+}
+
+bool Workspace::HasExtension(const char *name) {
+  GLint num_extensions;
+  OPENGL_CALL(glGetIntegerv(GL_NUM_EXTENSIONS, &num_extensions));
+  for (GLint i = 0; i != num_extensions; ++i) {
+    auto extension = reinterpret_cast<const char *>(
+        glGetStringi(GL_EXTENSIONS, static_cast<GLuint>(i)));
+    if (std::strcmp(extension, name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+template <typename DType>
+TypedTexture<DType> Workspace::CreateTexture(
+    const typename DType::HostType *data, GLsizei width, GLsizei height) {
+  return TypedTexture<DType>(data, width, height);
+}
+
+template <typename DType>
+TypedTexture<DType> Workspace::CreateBufferTexture(
+    const typename DType::HostType *data, GLsizei width) {
+  return TypedTexture<DType>(data, width);
 }
 
 // Don't need to change this.
@@ -701,6 +8772,11 @@ const char *Workspace::vertex_shader_text_ = "#version 330 core\n"
     "  gl_Position = vec4(point, 0.0, 1.0);\n"
     "}\n";
 
+// Passed by reference, as uniform values.
+const GLsizei Workspace::kGemvChunk;
+const GLsizei Workspace::kRowChunk;
+const GLsizei Workspace::kScanRadix;
+
 const Workspace::Vertex Workspace::vertices[kNumVertices] = {
     {-1.f, -1.f},
     {1.0f, -1.f},